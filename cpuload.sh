@@ -0,0 +1,24 @@
+# measure CPU load of a running syntwo over a period of time
+# usage: cpuload.sh [seconds]
+# result is given in % of one core: busy-polling main loop gives ~100%, idle event-driven loop should give ~0%
+
+duration=${1:-10}
+
+pid=$( pidof syntwo.a )
+if [ -z "$pid" ];
+then
+	echo "syntwo is not running"
+	exit 1
+fi
+
+hz=$( getconf CLK_TCK )
+
+# utime and stime of main thread only (ie. main loop), then of the whole process (including fluidsynth threads)
+main_start=$( awk '{print $14+$15}' /proc/$pid/task/$pid/stat )
+all_start=$( awk '{print $14+$15}' /proc/$pid/stat )
+sleep $duration
+main_end=$( awk '{print $14+$15}' /proc/$pid/task/$pid/stat )
+all_end=$( awk '{print $14+$15}' /proc/$pid/stat )
+
+echo "main loop : $( echo "scale=1; ($main_end - $main_start) * 100 / ($hz * $duration)" | bc ) % of one core"
+echo "process   : $( echo "scale=1; ($all_end - $all_start) * 100 / ($hz * $duration)" | bc ) % of one core"
@@ -0,0 +1,169 @@
+/** @file abloop.c
+ *
+ * @brief A-B loop for rehearsal: a region between two sections of the song is repeated until the loop is cleared.
+ * Wrap is done from the player tick callback, ie. in the synth thread: it is scheduled one audio block ahead of the loop end,
+ * so no event at or after the loop end is played, and channel state at loop start is restored before the player resumes from it.
+ * Loop ends and state are built by the main loop into a spare buffer, and handed to the synth thread with a single pointer swap.
+ *
+ */
+
+#include <stdatomic.h>
+#include <unistd.h>
+#include "types.h"
+#include "globals.h"
+#include "config.h"
+#include "process.h"
+#include "utils.h"
+#include "gpio.h"
+#include "smf.h"
+#include "chase.h"
+#include "section.h"
+#include "engine.h"
+#include "abloop.h"
+
+typedef struct {				// loop published to the synth thread
+	uint32_t a, b;					// loop start and end, in ticks
+	snapshot_t snap;				// channel state at loop start, restored at each wrap
+	int id;							// number of the update that built the loop
+} loop_t;
+
+// ends of the loop as set by the user; main loop only
+static uint32_t loop_a;					// loop start, in ticks
+static uint32_t loop_b;					// loop end, in ticks; 0 if not set
+static int loop_id = 0;					// number of the last loop built
+
+// loops are built by the main loop in the buffer that is not published, then published with a single pointer swap
+static loop_t loops [2];
+static _Atomic (loop_t *) active = NULL;	// loop read by the synth thread; NULL if loop is not active
+static atomic_int reading = FALSE;			// TRUE while the synth thread reads the active loop
+
+// synth thread only
+static int last_tick = -1;				// tick of the previous tick callback, used to predict the tick of the next audio block
+static int last_id = -1;				// loop of the previous tick callback
+
+
+// publish a loop, or NULL to stop looping; once this returns, the synth thread does not read the previous loop anymore
+static void publish_loop (loop_t *l)
+{
+	atomic_store (&active, l);
+	while (atomic_load (&reading)) usleep (100);
+}
+
+
+// tick of the start of the section containing tick (0 if there is no section before tick)
+static uint32_t section_start (uint32_t tick)
+{
+	int i;
+
+	i = find_section (&sections, tick + 1) - 1;
+	return (i >= 0) ? sections.section [i].tick : 0;
+}
+
+
+// tick of the start of the next section after tick (end of song if there is none)
+static uint32_t section_end (uint32_t tick)
+{
+	int i;
+
+	if ((i = next_section (tick)) >= 0) return sections.section [i].tick;
+	if ((song_smf != NULL) && (song_smf->nb_event > 0)) return song_smf->event [song_smf->nb_event - 1].tick;
+	return engine_get_total_ticks (player);
+}
+
+
+// activate loop if both ends are set; channel state at loop start is computed here, not in the synth thread
+static void update_loop ()
+{
+	loop_t *l;
+
+	if (loop_b <= loop_a) {
+		publish_loop (NULL);
+		return;
+	}
+
+	// spare buffer: the synth thread reads the other one, or none
+	l = (atomic_load (&active) == &loops [0]) ? &loops [1] : &loops [0];
+	l->a = loop_a;
+	l->b = loop_b;
+	l->id = ++loop_id;
+	make_snapshot (song_smf, loop_a, &l->snap);
+	publish_loop (l);
+	printf ("loop: tick %u to %u\n", loop_a, loop_b);
+}
+
+
+// set loop start at the start of the section being played
+// if loop is already active, loop start is moved back to the previous section
+void set_loop_start (uint32_t tick)
+{
+	if (atomic_load (&active) != NULL) loop_a = (loop_a > 0) ? section_start (loop_a - 1) : 0;
+	else loop_a = section_start (tick);
+	update_loop ();
+}
+
+
+// set loop end at the start of the next section: current section is looped
+// if loop is already active, loop end is moved forward to the following section
+void set_loop_end (uint32_t tick)
+{
+	if (atomic_load (&active) != NULL) loop_b = section_end (loop_b);
+	else {
+		if ((loop_b == 0) && (loop_a == 0)) loop_a = section_start (tick);
+		loop_b = section_end (tick);
+	}
+	update_loop ();
+}
+
+
+// clear loop; playback goes on normally
+void clear_loop ()
+{
+	if (atomic_load (&active) != NULL) printf ("loop: cleared\n");
+	publish_loop (NULL);
+	loop_a = 0;
+	loop_b = 0;
+}
+
+
+// return TRUE if loop is active
+int is_looping ()
+{
+	return (atomic_load (&active) != NULL);
+}
+
+
+// called at each tick callback of the player (ie. in the synth thread, once per audio block)
+// if loop end would be reached during the next audio block, release notes, restore channel state at loop start and seek to it:
+// the player resumes from loop start at the next block, instead of playing events at or after loop end
+// returns TRUE if the loop has wrapped
+int loop_tick (int tick)
+{
+	loop_t *l;
+	int delta, wrap = FALSE;
+
+	atomic_store (&reading, TRUE);
+	if ((l = atomic_load (&active)) == NULL) {
+		atomic_store (&reading, FALSE);
+		return FALSE;
+	}
+
+	// new loop: prediction starts again
+	if (l->id != last_id) {
+		last_id = l->id;
+		last_tick = -1;
+	}
+
+	// ticks played per audio block, from the previous callback
+	delta = ((last_tick >= 0) && (tick > last_tick)) ? tick - last_tick : 0;
+	last_tick = tick;
+
+	// player moved before the loop (marker, rewind) is let to reach the loop
+	if (((uint32_t) tick + delta >= l->b) && ((uint32_t) tick >= l->a)) {
+		apply_snapshot (&l->snap);
+		engine_seek (player, l->a);
+		last_tick = -1;
+		wrap = TRUE;
+	}
+	atomic_store (&reading, FALSE);
+	return wrap;
+}
@@ -0,0 +1,11 @@
+/** @file abloop.h
+ *
+ * @brief This file defines prototypes of functions inside abloop.c
+ *
+ */
+
+void set_loop_start (uint32_t);
+void set_loop_end (uint32_t);
+void clear_loop ();
+int is_looping ();
+int loop_tick (int);
@@ -0,0 +1,379 @@
+/** @file audio.c
+ *
+ * @brief Audio output: the synth is rendered from our own audio driver callback, so output latency is known and xruns can be counted.
+ * Audio profiles trade latency against robustness: standard (128 x 16 frames) or low latency (64 x 3 frames), or any period size x periods.
+ * Profile may also be tuned: a stress workload is rendered through the real driver with buffer settings of increasing latency,
+ * and the first one without xrun and with cpu headroom is kept; the result is saved per audio device, and reused at next startups.
+ *
+ */
+
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include "types.h"
+#include "globals.h"
+#include "config.h"
+#include "process.h"
+#include "utils.h"
+#include "gpio.h"
+#include "loop.h"
+#include "audio.h"
+#include "mixer.h"
+#include "schedule.h"
+#include "engine.h"
+
+#define REPORT_S		60		// period of xrun report, in seconds
+#define TUNE_FILE		"./save/audio"	// buffer settings tuned per audio device, one line per device: "device PxN"
+#define TUNE_SETTLE_MS	500		// time given to a new driver to settle before measuring, in ms
+#define TUNE_MS			4000	// duration of stress workload per candidate, in ms
+#define TUNE_SAMPLE_MS	100		// sampling period of cpu load during stress workload, in ms
+#define TUNE_HEADROOM	0.7		// candidate is kept if cpu load and render time stay below 70% of real time
+
+// tune modes of the audio profile
+#define TUNE_OFF		0		// fixed profile
+#define TUNE_AUTO		1		// reuse tuned settings of audio device if any, tune otherwise
+#define TUNE_FORCE		2		// tune again, even if audio device has been tuned before
+
+typedef struct {
+	char *name;
+	int period_size;			// frames per period
+	int periods;				// periods in the buffer
+} audio_profile_t;
+
+static audio_profile_t profile [] = {
+	{ "standard", 128, 16 },	// former fixed setting: robust, about 46 ms of buffered audio at 44.1 kHz
+	{ "low", 64, 3 },			// low latency: about 4 ms at 44.1 kHz, at the price of more xruns on a loaded system
+	{ NULL, 0, 0 }
+};
+
+// candidates of tuning, in order of increasing latency; at equal latency, more periods is more robust and comes first
+static audio_profile_t candidate [] = {
+	{ "64x2", 64, 2 },
+	{ "64x3", 64, 3 },
+	{ "64x4", 64, 4 },
+	{ "128x3", 128, 3 },
+	{ "128x4", 128, 4 },
+	{ "256x3", 256, 3 },
+	{ "256x4", 256, 4 },
+	{ "512x4", 512, 4 },
+	{ NULL, 0, 0 }
+};
+
+static int tune_mode = TUNE_OFF;
+static int period_size = 128;
+static int periods = 16;
+static double sample_rate = 44100.0;
+static uint64_t period_us;			// duration of a period, in us
+static uint64_t buffer_us;			// duration of the whole buffer, in us
+static uint64_t extra_latency_us = 0;	// latency of the sound card and beyond, given by the user
+
+// statistics of the audio callback, updated in the audio thread
+static uint64_t last_callback = 0;	// time of the previous callback
+static int64_t fill_us;				// estimated audio left in the buffer, in us
+static atomic_ulong nb_callbacks = 0;
+static atomic_ulong nb_xruns = 0;		// estimated buffer underruns
+static atomic_ulong max_render_us = 0;	// longest rendering of a period since last report
+static unsigned long reported_xruns = 0;
+static unsigned long reported_posted = 0, reported_sent = 0;	// mixer statistics at last report
+static unsigned long reported_scheduled = 0, reported_late = 0;	// scheduler statistics at last report
+static int report_timer = -1;
+
+
+// audio driver callback: render synth, and estimate buffer fill from the time between callbacks
+// buffer is refilled by one period at each callback, and drained in real time; if it goes empty, an xrun has happened
+static int audio_callback (void *data, int len, int nfx, float *fx[], int nout, float *out[])
+{
+	uint64_t start, end;
+	unsigned long render, max;
+	int res;
+
+	start = micros ();
+	if (last_callback != 0) {
+		fill_us -= (int64_t) (start - last_callback);
+		if (fill_us < 0) {
+			atomic_fetch_add (&nb_xruns, 1);
+			fill_us = 0;
+		}
+	}
+	last_callback = start;
+
+	// changes of sliders and knobs since last period are scheduled in one batch, before rendering
+	schedule_period (len);
+	flush_mixer ();
+	// events of the songs being played are dispatched block by block while the period is rendered (see engine.c)
+	res = process_engines ((fluid_synth_t *) data, len, nfx, fx, nout, out);
+
+	fill_us += (int64_t) (len * 1000000.0 / sample_rate);
+	if (fill_us > (int64_t) buffer_us) fill_us = buffer_us;
+
+	end = micros ();
+	render = end - start;
+	max = atomic_load (&max_render_us);
+	if (render > max) atomic_store (&max_render_us, render);
+	atomic_fetch_add (&nb_callbacks, 1);
+	return res;
+}
+
+
+// set audio buffer settings from profile: "standard", "low", or "period_size x periods" (eg. "96x4")
+// "auto" reuses settings tuned before for the audio device, or tunes them at start of audio; "tune" tunes them again
+// extra is the latency of the sound card and beyond, in us, added to the buffer latency
+// shall be called before audio driver is created
+// returns TRUE if OK, FALSE if profile is unknown
+int set_audio_profile (char *name, int extra)
+{
+	int i, p, n;
+
+	if (name != NULL) {
+		for (i = 0; profile [i].name != NULL; i++) {
+			if (strcmp (name, profile [i].name) == 0) break;
+		}
+		if (strcmp (name, "auto") == 0) tune_mode = TUNE_AUTO;
+		else if (strcmp (name, "tune") == 0) tune_mode = TUNE_FORCE;
+		else if (profile [i].name != NULL) {
+			period_size = profile [i].period_size;
+			periods = profile [i].periods;
+		}
+		else if ((sscanf (name, "%dx%d", &p, &n) == 2) && (p >= 16) && (n >= 2)) {
+			period_size = p;
+			periods = n;
+		}
+		else {
+			fprintf (stderr, "unknown audio profile %s\n", name);
+			return FALSE;
+		}
+	}
+	if (extra > 0) extra_latency_us = extra;
+
+	fluid_settings_setint (settings, "audio.period-size", period_size);
+	fluid_settings_setint (settings, "audio.periods", periods);
+	return TRUE;
+}
+
+
+// main loop handler for report timer: report xruns and coalesced controller changes since last report
+int audio_event (int fd)
+{
+	uint64_t expirations;
+	unsigned long xruns, posted, sent, scheduled, late, quantized;
+
+	// acknowledge timer
+	read (fd, &expirations, sizeof (expirations));
+
+	xruns = atomic_load (&nb_xruns);
+	if (xruns != reported_xruns) {
+		printf ("audio: %lu xruns in last %d s (%lu total, %.1f per hour), max render %lu us for a %llu us period\n",
+			xruns - reported_xruns, REPORT_S, xruns,
+			xruns * 3600.0 * 1000000.0 / ((double) atomic_load (&nb_callbacks) * period_us),
+			atomic_load (&max_render_us), (unsigned long long) period_us);
+		reported_xruns = xruns;
+	}
+	atomic_store (&max_render_us, 0);
+
+	// controller changes coalesced by the mixer: several moves of a slider or knob within a period give a single CC
+	get_mixer_stats (&posted, &sent);
+	if (posted != reported_posted) {
+		// a change flagged just before the previous report may have been sent just after it: it is not counted as coalesced
+		printf ("mixer: %lu controller changes in last %d s, %lu CC sent to synth (%lu coalesced)\n",
+			posted - reported_posted, REPORT_S, sent - reported_sent,
+			(posted - reported_posted > sent - reported_sent) ? (posted - reported_posted) - (sent - reported_sent) : 0);
+		reported_posted = posted;
+		reported_sent = sent;
+	}
+
+	// scheduled changes take effect one period after they are made; late ones have been applied as soon as possible
+	get_schedule_stats (&scheduled, &late, &quantized);
+	if (scheduled != reported_scheduled) {
+		printf ("schedule: %lu changes in last %d s, applied %llu us after they were made, %lu late (%lu quantized since start)\n",
+			scheduled - reported_scheduled, REPORT_S, (unsigned long long) get_schedule_latency (), late - reported_late, quantized);
+		reported_scheduled = scheduled;
+		reported_late = late;
+	}
+	return TRUE;
+}
+
+
+// create audio driver rendering the synth from audio_callback, with buffer settings of settings
+// statistics of the audio callback are reset
+// returns audio driver, or NULL if it could not be created
+static fluid_audio_driver_t* open_driver ()
+{
+	// actual values, as set in settings
+	fluid_settings_getint (settings, "audio.period-size", &period_size);
+	fluid_settings_getint (settings, "audio.periods", &periods);
+	fluid_settings_getnum (settings, "synth.sample-rate", &sample_rate);
+	period_us = (uint64_t) (period_size * 1000000.0 / sample_rate);
+	buffer_us = period_us * periods;
+
+	last_callback = 0;
+	fill_us = buffer_us;
+	atomic_store (&nb_callbacks, 0);
+	atomic_store (&nb_xruns, 0);
+	atomic_store (&max_render_us, 0);
+	reported_xruns = 0;
+
+	return new_fluid_audio_driver2 (settings, audio_callback, (void *) synth);
+}
+
+
+// read buffer settings tuned for audio device
+// returns TRUE if found, FALSE otherwise
+static int load_tuning (char *device, int *p, int *n)
+{
+	FILE *fp;
+	char dev [64];
+	int found = FALSE;
+
+	if ((fp = fopen (TUNE_FILE, "rt")) == NULL) return FALSE;
+	while (fscanf (fp, "%63s %dx%d\n", dev, p, n) == 3) {
+		if (strcmp (dev, device) == 0) {
+			found = TRUE;
+			break;
+		}
+	}
+	fclose (fp);
+	return found;
+}
+
+
+// save buffer settings tuned for audio device; lines of other devices are kept
+// returns TRUE if OK, FALSE otherwise
+static int save_tuning (char *device, int p, int n)
+{
+	FILE *fp, *tmp;
+	char dev [64];
+	int pp, nn;
+
+	if ((tmp = fopen (TUNE_FILE ".new", "wt")) == NULL) return FALSE;
+	if ((fp = fopen (TUNE_FILE, "rt")) != NULL) {
+		while (fscanf (fp, "%63s %dx%d\n", dev, &pp, &nn) == 3) {
+			if (strcmp (dev, device) != 0) fprintf (tmp, "%s %dx%d\n", dev, pp, nn);
+		}
+		fclose (fp);
+	}
+	fprintf (tmp, "%s %dx%d\n", device, p, n);
+	fclose (tmp);
+	return (rename (TUNE_FILE ".new", TUNE_FILE) == 0);
+}
+
+
+// stress workload: hold as many notes as the polyphony of the synth allows, spread on all midi channels with various programs
+// one note per channel is retriggered at each call, so voices keep starting (attack) and stealing as in a dense song
+static void stress (int step)
+{
+	int ch, key, nb;
+
+	nb = fluid_synth_get_polyphony (synth) / NB_MIDI_CHANNEL;
+	if (nb < 1) nb = 1;
+	for (ch = 0; ch < NB_MIDI_CHANNEL; ch++) {
+		if (step == 0) {
+			fluid_synth_program_change (synth, ch, (ch * 8) & 0x7F);
+			for (key = 0; key < nb; key++) fluid_synth_noteon (synth, ch, 36 + ((key * 5) % 60), 100);
+		}
+		else {
+			key = 36 + (((step + ch) % nb) * 5) % 60;
+			fluid_synth_noteoff (synth, ch, key);
+			fluid_synth_noteon (synth, ch, key, 100);
+		}
+	}
+}
+
+
+// tune buffer settings: render stress workload through the real driver with candidates of increasing latency,
+// and keep the first one without xrun, with cpu load and render time below headroom
+// returns TRUE and settings in p and n if a candidate is kept, FALSE otherwise
+static int autotune (int *p, int *n)
+{
+	fluid_audio_driver_t* d;
+	double load, max_load;
+	unsigned long xruns, render;
+	int i, t;
+
+	printf ("audio: tuning buffer, this takes a few seconds per setting...\n");
+	for (i = 0; candidate [i].name != NULL; i++) {
+		fluid_settings_setint (settings, "audio.period-size", candidate [i].period_size);
+		fluid_settings_setint (settings, "audio.periods", candidate [i].periods);
+		if ((d = open_driver ()) == NULL) continue;
+
+		// let driver settle: the first periods are irregular
+		stress (0);
+		usleep (TUNE_SETTLE_MS * 1000);
+		atomic_store (&nb_xruns, 0);
+		atomic_store (&max_render_us, 0);
+
+		max_load = 0.0;
+		for (t = 0; t < TUNE_MS / TUNE_SAMPLE_MS; t++) {
+			usleep (TUNE_SAMPLE_MS * 1000);
+			stress (t + 1);
+			load = fluid_synth_get_cpu_load (synth);
+			if (load > max_load) max_load = load;
+		}
+		xruns = atomic_load (&nb_xruns);
+		render = atomic_load (&max_render_us);
+
+		delete_fluid_audio_driver (d);
+		fluid_synth_system_reset (synth);
+
+		printf ("audio: %s: %lu xruns, cpu load %.0f%%, max render %lu us for a %llu us period\n", candidate [i].name,
+			xruns, max_load, render, (unsigned long long) period_us);
+		if ((xruns == 0) && (max_load < TUNE_HEADROOM * 100.0) && (render < TUNE_HEADROOM * period_us)) {
+			*p = candidate [i].period_size;
+			*n = candidate [i].periods;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+
+// start audio driver rendering the synth from audio_callback, and xrun report timer
+// if profile is tuned, buffer settings are tuned first, or read from the settings saved for the audio device
+// returns audio driver, or NULL if it could not be created
+fluid_audio_driver_t* start_audio ()
+{
+	fluid_audio_driver_t* d;
+	struct itimerspec its;
+	char device [64];
+	int p, n;
+
+	if (tune_mode != TUNE_OFF) {
+		if (fluid_settings_copystr (settings, "audio.alsa.device", device, sizeof (device)) != FLUID_OK) strcpy (device, "default");
+		if ((tune_mode == TUNE_AUTO) && load_tuning (device, &p, &n)) printf ("audio: buffer tuned before for %s\n", device);
+		else if (autotune (&p, &n)) {
+			if (save_tuning (device, p, n) == FALSE) fprintf (stderr, "audio: could not save tuning to %s\n", TUNE_FILE);
+		}
+		else {
+			fprintf (stderr, "audio: no buffer setting without xrun, using standard profile\n");
+			p = profile [0].period_size;
+			n = profile [0].periods;
+		}
+		fluid_settings_setint (settings, "audio.period-size", p);
+		fluid_settings_setint (settings, "audio.periods", n);
+	}
+
+	d = open_driver ();
+	if (d == NULL) {
+		fprintf (stderr, "audio driver creation failed\n");
+		return NULL;
+	}
+	printf ("audio: %d x %d frames at %.0f Hz, output latency %llu us\n", period_size, periods, sample_rate,
+		(unsigned long long) get_audio_latency ());
+
+	report_timer = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (report_timer >= 0) {
+		memset (&its, 0, sizeof (its));
+		its.it_value.tv_sec = REPORT_S;
+		its.it_interval.tv_sec = REPORT_S;
+		timerfd_settime (report_timer, 0, &its, NULL);
+		add_loop_fd (report_timer, audio_event);
+	}
+	return d;
+}
+
+
+// output latency: time between rendering of a sample by the synth and the moment it is heard, in us
+// audio rendered by the callback is queued behind the whole buffer
+uint64_t get_audio_latency ()
+{
+	return buffer_us + extra_latency_us;
+}
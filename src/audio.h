@@ -0,0 +1,10 @@
+/** @file audio.h
+ *
+ * @brief This file defines prototypes of functions inside audio.c
+ *
+ */
+
+int set_audio_profile (char *, int);
+int audio_event (int);
+fluid_audio_driver_t* start_audio ();
+uint64_t get_audio_latency ();
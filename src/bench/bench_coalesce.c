@@ -0,0 +1,263 @@
+/** @file bench_coalesce.c
+ *
+ * @brief Stress test of the coalescing of slider and knob changes: fader sweeps of a nanoKONTROL2 are replayed in real time through
+ * dispatch_control (), as the main loop does, while an audio thread renders the synth and calls flush_mixer () at each period, as the
+ * audio callback does. Changes are either sent at once by the main thread (former behaviour) or coalesced once per period.
+ * Reports CC sent to synth, render time of the audio thread and time of the main thread per change, and checks the state of the synth
+ * against the final positions of sliders and knobs.
+ * Built-in sweeps are modelled on the nanoKONTROL2 (one CC per step of a fader, about 1 ms apart in a fast move);
+ * sweeps recorded from the hardware may be replayed instead, from a text file: one "time_us status controller value" line per message.
+ *
+ */
+
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "../types.h"
+#include "../main.h"
+#include "../config.h"
+#include "../process.h"
+#include "../utils.h"
+#include "../mixer.h"
+
+#define NB_EVENT	65536		// max number of messages in a replay
+#define PERIOD		64			// frames per audio period, as the low latency audio profile
+#define RATE		44100.0
+
+typedef struct {
+	uint32_t time_us;			// time of the message from start of replay
+	uint8_t data [3];			// status, controller, value
+} event_t;
+
+typedef struct {
+	uint8_t controller;			// 0x00-0x07 sliders, 0x10-0x17 knobs, 0x20-0x27 solo buttons
+	int from, to;				// values at start and end of the move (for solo: 0x7F press, 0x00 release)
+	int start_ms, length_ms;	// time of the move from start of replay, and its duration
+} gesture_t;
+
+// built-in sweeps: fast and slow fader moves, two faders moved together, knob twists, solo toggles during a sweep
+static gesture_t gesture [] = {
+	{ 0x00, 0, 127, 0, 100 },
+	{ 0x00, 127, 0, 200, 80 },
+	{ 0x01, 0, 127, 400, 600 },
+	{ 0x02, 20, 110, 1100, 150 },
+	{ 0x03, 110, 20, 1100, 150 },
+	{ 0x04, 64, 127, 1400, 60 },
+	{ 0x04, 127, 0, 1470, 60 },
+	{ 0x04, 0, 100, 1540, 60 },
+	{ 0x10, 0, 127, 1700, 250 },
+	{ 0x11, 127, 0, 1700, 250 },
+	{ 0x20, 0x7F, 0x7F, 1800, 0 },
+	{ 0x05, 0, 127, 1810, 120 },
+	{ 0x20, 0x00, 0x00, 2000, 0 },
+	{ 0x06, 127, 0, 2100, 2000 },
+	{ 0x07, 0, 127, 2100, 50 },
+	{ 0x07, 127, 0, 2160, 50 },
+	{ 0x07, 0, 127, 2220, 50 },
+	{ 0x07, 127, 40, 2280, 50 },
+	{ 0x12, 64, 0, 2500, 100 },
+	{ 0x12, 0, 127, 2610, 100 },
+	{ 0x12, 127, 64, 2720, 100 },
+	{ 0, 0, 0, -1, 0 }
+};
+
+static event_t event [NB_EVENT];
+static int nb_event = 0;
+static atomic_int running;
+static int coalesce;			// TRUE if changes are sent by the audio thread once per period
+static uint64_t nb_period, max_render_us, sum_render_us;
+
+
+// sort events on time
+static int cmp_event (const void *a, const void *b)
+{
+	return (int) ((event_t *) a)->time_us - (int) ((event_t *) b)->time_us;
+}
+
+
+// expand built-in gestures into one message per step of value
+static void make_sweeps ()
+{
+	gesture_t *g;
+	int i, n;
+
+	for (g = gesture; g->start_ms >= 0; g++) {
+		n = abs (g->to - g->from);
+		for (i = 0; (i <= n) && (nb_event < NB_EVENT); i++) {
+			event [nb_event].time_us = g->start_ms * 1000 + ((n == 0) ? 0 : g->length_ms * 1000 * i / n);
+			event [nb_event].data [0] = 0xB0;
+			event [nb_event].data [1] = g->controller;
+			event [nb_event].data [2] = (g->to >= g->from) ? g->from + i : g->from - i;
+			nb_event++;
+		}
+	}
+	qsort (event, nb_event, sizeof (event_t), cmp_event);
+}
+
+
+// read recorded sweeps: one "time_us status controller value" line per message (status, controller and value in hex)
+// returns TRUE if OK, FALSE if file cannot be read
+static int read_sweeps (char *name)
+{
+	FILE *fp;
+	char s [80];
+	unsigned int t, st, c, v;
+
+	if ((fp = fopen (name, "rt")) == NULL) {
+		fprintf (stderr, "cannot open %s\n", name);
+		return FALSE;
+	}
+	while ((fgets (s, sizeof (s), fp) != NULL) && (nb_event < NB_EVENT)) {
+		if (sscanf (s, "%u %x %x %x", &t, &st, &c, &v) != 4) continue;
+		event [nb_event].time_us = t;
+		event [nb_event].data [0] = st;
+		event [nb_event].data [1] = c;
+		event [nb_event].data [2] = v;
+		nb_event++;
+	}
+	fclose (fp);
+	qsort (event, nb_event, sizeof (event_t), cmp_event);
+	return TRUE;
+}
+
+
+// audio thread: render one period every period, as the audio driver would call the audio callback
+static void *audio_thread (void *arg)
+{
+	static float left [PERIOD], right [PERIOD];
+	float *out [2] = { left, right };
+	uint64_t next, start, render;
+
+	next = micros ();
+	while (atomic_load (&running)) {
+		start = micros ();
+		if (coalesce) flush_mixer ();
+		// effects mixed into the dry buffers, as in the audio callback
+		fluid_synth_process (synth, PERIOD, 2, out, 2, out);
+		render = micros () - start;
+		if (render > max_render_us) max_render_us = render;
+		sum_render_us += render;
+		nb_period++;
+
+		next += (uint64_t) (PERIOD * 1000000.0 / RATE);
+		if (next > micros ()) usleep (next - micros ());
+	}
+	return NULL;
+}
+
+
+// replay events in real time (or as fast as possible if fast is TRUE); returns time spent in dispatch, in us
+static uint64_t replay (int fast)
+{
+	uint64_t start, t, spent = 0;
+	int i;
+
+	start = micros ();
+	for (i = 0; i < nb_event; i++) {
+		if (!fast) {
+			t = start + event [i].time_us;
+			if (t > micros ()) usleep (t - micros ());
+		}
+		t = micros ();
+		dispatch_control (event [i].data);
+		// former behaviour: CC sent to synth by the main thread, for each change
+		if (!coalesce) flush_mixer ();
+		spent += micros () - t;
+	}
+	return spent;
+}
+
+
+// CC7 and CC10 of synth shall match final slider and knob positions; returns number of channels that do not
+static int check_state ()
+{
+	channel_t *chan;
+	int k, v, p, bad = 0;
+
+	for (k = 0; k < NB_MIDI_CHANNEL; k++) {
+		chan = &channel [k & 0x07][k >> 3];
+		fluid_synth_get_cc (synth, k, 7, &v);
+		fluid_synth_get_cc (synth, k, 10, &p);
+		if ((v != adjust_volume (chan->slider.value, chan->slider.value_rt)) ||
+			(p != adjust_panning (chan->knob.value, chan->knob.value_rt))) bad++;
+	}
+	return bad;
+}
+
+
+// replay sweeps in one mode, and print results
+static void run (char *name, int mode, int fast)
+{
+	pthread_t t;
+	unsigned long posted, sent, p0, s0;
+	uint64_t spent;
+	int bad;
+
+	coalesce = mode;
+	nb_period = max_render_us = sum_render_us = 0;
+	set_volume_value (0x64);
+	set_panning_value (0x40);
+	get_mixer_stats (&p0, &s0);
+
+	atomic_store (&running, TRUE);
+	pthread_create (&t, NULL, audio_thread, NULL);
+	spent = replay (fast);
+	// let the audio thread send the last changes
+	usleep (20000);
+	atomic_store (&running, FALSE);
+	pthread_join (t, NULL);
+
+	get_mixer_stats (&posted, &sent);
+	bad = check_state ();
+	printf ("%-22s %6lu changes %6lu CC sent (%5.1f%% coalesced)   dispatch %6.2f us/msg   render max %5llu us mean %6.2f us   %s\n",
+		name, posted - p0, sent - s0, (posted == p0) ? 0.0 : 100.0 * ((posted - p0) - (sent - s0)) / (posted - p0),
+		(double) spent / nb_event, (unsigned long long) max_render_us,
+		(nb_period == 0) ? 0.0 : (double) sum_render_us / nb_period, (bad == 0) ? "state OK" : "STATE MISMATCH");
+}
+
+
+int main (int argc, char *argv[])
+{
+	int i, id, opt, notes = FALSE;
+
+	settings = new_fluid_settings ();
+	fluid_settings_setint (settings, "synth.lock-memory", 0);
+	synth = new_fluid_synth (settings);
+
+	memset (channel, 0, NB_CHANNEL * NB_RECSHIFT * sizeof (channel_t));
+	read_config ();
+	init_mixer (NULL, NULL);
+
+	// -s soundfont: notes are held on all channels, so the audio thread has voices to render; -f file: recorded sweeps
+	while ((opt = getopt (argc, argv, "s:f:")) != -1) {
+		switch (opt) {
+			case 's':
+				if ((id = fluid_synth_sfload (synth, optarg, TRUE)) == FLUID_FAILED) fprintf (stderr, "cannot load %s\n", optarg);
+				else notes = TRUE;
+				break;
+			case 'f':
+				if (read_sweeps (optarg) == FALSE) exit (1);
+				break;
+			default:
+				fprintf (stderr, "usage: %s [-s soundfont] [-f recorded_sweeps]\n", argv [0]);
+				exit (1);
+		}
+	}
+	if (nb_event == 0) make_sweeps ();
+	if (notes) {
+		for (i = 0; i < NB_MIDI_CHANNEL; i++) {
+			if (i != 9) fluid_synth_noteon (synth, i, 48 + i * 2, 100);
+		}
+	}
+	printf ("%d messages over %.2f s, audio period %d frames (%.2f ms)\n", nb_event, event [nb_event - 1].time_us / 1000000.0,
+		PERIOD, PERIOD * 1000.0 / RATE);
+
+	run ("immediate, real time", FALSE, FALSE);
+	run ("coalesced, real time", TRUE, FALSE);
+	run ("immediate, flood", FALSE, TRUE);
+	run ("coalesced, flood", TRUE, TRUE);
+
+	delete_fluid_synth (synth);
+	delete_fluid_settings (settings);
+	return 0;
+}
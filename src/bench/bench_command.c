@@ -0,0 +1,93 @@
+/** @file bench_command.c
+ *
+ * @brief Stress test of the command rings (see command.c): two producer threads, as the midi driver thread and the synth thread,
+ * flood their ring with control commands while the main loop drains them through its epoll loop, as syntwo does.
+ * Each command carries a sequence number of its producer in its data bytes; the action checks that commands of each producer
+ * arrive once, in order. A producer that finds its ring full tries again, so no command is expected to be lost.
+ * Reports commands per second, number of times a ring was full (also reported by the main loop on stderr), and ordering errors.
+ *
+ */
+
+#include <sched.h>
+#include <pthread.h>
+#include "../types.h"
+#include "../main.h"
+#include "../config.h"
+#include "../process.h"
+#include "../utils.h"
+#include "../loop.h"
+#include "../command.h"
+
+#define NB_PUSH		1000000		// commands pushed by each producer
+
+static uint8_t no_shift = 0;					// shift key of the controls used by the test: never pressed
+static unsigned int received [NB_CMD_SOURCE];	// commands received from each producer
+static unsigned long errors = 0;				// commands received out of order
+static unsigned long full [NB_CMD_SOURCE];		// times the ring of each producer was full
+
+
+// action of the controls used by the test: check sequence number of the command against the one expected from its producer
+// midi thread sends CC (status B0), synth thread sends note on (status 90); sequence number is 14 bits, in data bytes 1 and 2
+static int check_action (void *control, uint8_t *data)
+{
+	int source = (data [0] == 0xB0) ? CMD_FROM_MIDI : CMD_FROM_SYNTH;
+	unsigned int seq = data [1] | (data [2] << 7);
+
+	if (seq != (received [source] & 0x3FFF)) errors++;
+	received [source]++;
+	return FLUID_OK;
+}
+
+
+// producer thread: push commands with increasing sequence numbers; try again while ring is full
+static void *producer (void *arg)
+{
+	int source = (intptr_t) arg;
+	uint8_t data [3];
+	unsigned int i;
+
+	data [0] = (source == CMD_FROM_MIDI) ? 0xB0 : 0x90;
+	for (i = 0; i < NB_PUSH; i++) {
+		data [1] = i & 0x7F;
+		data [2] = (i >> 7) & 0x7F;
+		while (push_command (source, CMD_CONTROL, data) == FALSE) {
+			full [source]++;
+			sched_yield ();
+		}
+	}
+	return NULL;
+}
+
+
+int main (int argc, char *argv[])
+{
+	pthread_t t [NB_CMD_SOURCE];
+	uint64_t start, elapsed;
+	int i, j;
+
+	if ((init_loop () == FALSE) || (init_command () == FALSE)) exit (1);
+
+	// all CC and note on messages go to the check action
+	for (i = 1; i <= 3; i += 2) {
+		for (j = 0; j < NB_CONTROL; j++) {
+			dispatch [i][j].action [0] = dispatch [i][j].action [1] = check_action;
+			dispatch [i][j].control [0] = dispatch [i][j].control [1] = NULL;
+			dispatch [i][j].shift = &no_shift;
+		}
+	}
+
+	start = micros ();
+	for (i = 0; i < NB_CMD_SOURCE; i++) pthread_create (&t [i], NULL, producer, (void *) (intptr_t) i);
+	// every push wakes the main loop: it is woken until the last command has been drained
+	while (received [CMD_FROM_MIDI] + received [CMD_FROM_SYNTH] < NB_CMD_SOURCE * NB_PUSH) {
+		if (process_loop () == FALSE) exit (1);
+	}
+	elapsed = micros () - start;
+	for (i = 0; i < NB_CMD_SOURCE; i++) pthread_join (t [i], NULL);
+
+	printf ("%d producers, %d commands each, ring of %d commands\n", NB_CMD_SOURCE, NB_PUSH, NB_COMMAND);
+	printf ("%.2f s, %.0f commands/s   ring full: midi %lu, synth %lu   out of order: %lu   %s\n", elapsed / 1000000.0,
+		NB_CMD_SOURCE * NB_PUSH * 1000000.0 / elapsed, full [CMD_FROM_MIDI], full [CMD_FROM_SYNTH], errors,
+		(errors == 0) ? "OK" : "FAILED");
+	return (errors == 0) ? 0 : 1;
+}
@@ -0,0 +1,164 @@
+/** @file bench_dispatch.c
+ *
+ * @brief Microbenchmark of the dispatch of incoming midi messages: memcmp chain (former handle_midi_event_from_hw) vs dispatch table.
+ * Synthetic nanoKONTROL2 CC floods are fed through both dispatch paths; actions are replaced by a counter so only dispatch is measured.
+ *
+ */
+
+#include "../types.h"
+#include "../main.h"
+#include "../config.h"
+#include "../process.h"
+#include "../utils.h"
+
+#define NB_MSG		4096		// number of messages in a flood
+#define NB_LOOP		2000		// number of times the flood is sent
+
+static uint8_t flood [NB_MSG][3];
+static unsigned long count = 0;
+
+
+// action replacing all control actions: only count calls
+static int count_action (void *control, uint8_t *data)
+{
+	count++;
+	return FLUID_OK;
+}
+
+
+// replace actions of all controls and of dispatch table by count_action
+static void set_count_action ()
+{
+	int i, j;
+
+	for (i = 0; i<NB_CHANNEL; i++) {
+		for (j = 0; j<NB_RECSHIFT; j++) {
+			channel[i][j].slider.action = count_action;
+			channel[i][j].knob.action = count_action;
+			channel[i][j].solo.action = count_action;
+			channel[i][j].mute.action = count_action;
+			channel[i][j].rec.action = count_action;
+		}
+	}
+	for (i = 0; i<NB_CYCSHIFT; i++) {
+		track_l[i].action = count_action;
+		track_r[i].action = count_action;
+		rwd[i].action = count_action;
+		fwd[i].action = count_action;
+		marker_l[i].action = count_action;
+		marker_r[i].action = count_action;
+	}
+	cycle.action = play.action = stop.action = record.action = count_action;
+	set.action = count_action;
+
+	for (i = 0; i<NB_STATUS; i++) {
+		for (j = 0; j<NB_CONTROL; j++) {
+			if (dispatch[i][j].action [0] != NULL) dispatch[i][j].action [0] = dispatch[i][j].action [1] = count_action;
+		}
+	}
+}
+
+
+// former dispatch: chain of memcmp, then loop over channels
+static int old_dispatch (uint8_t *mididata)
+{
+	int i;
+	channel_t *chan;
+
+	if (memcmp (play.message, mididata, 2)==0) return play.action (&play, mididata);
+	if (memcmp (stop.message, mididata, 2)==0) return stop.action (&stop, mididata);
+	if (memcmp (record.message, mididata, 2)==0) return record.action (&record, mididata);
+	if (memcmp (set.message, mididata, 2)==0) return set.action (&set, mididata);
+	if (memcmp (marker_l[cycle.value].message, mididata, 2)==0) return marker_l[cycle.value].action (&marker_l[cycle.value], mididata);
+	if (memcmp (marker_r[cycle.value].message, mididata, 2)==0) return marker_r[cycle.value].action (&marker_r[cycle.value], mididata);
+	if (memcmp (cycle.message, mididata, 2)==0) return cycle.action (&cycle, mididata);
+	if (memcmp (track_l[cycle.value].message, mididata, 2)==0) return track_l[cycle.value].action (&track_l[cycle.value], mididata);
+	if (memcmp (track_r[cycle.value].message, mididata, 2)==0) return track_r[cycle.value].action (&track_r[cycle.value], mididata);
+	if (memcmp (rwd[cycle.value].message, mididata, 2)==0) return rwd[cycle.value].action (&rwd[cycle.value], mididata);
+	if (memcmp (fwd[cycle.value].message, mididata, 2)==0) return fwd[cycle.value].action (&fwd[cycle.value], mididata);
+
+	for (i = 0; i<NB_CHANNEL; i++) {
+		chan = & (channel[i][channel[i][0].rec.value & 0x01]);
+		if (memcmp (chan->slider.message, mididata, 2)==0) return chan->slider.action (&(chan->slider), mididata);
+		if (memcmp (chan->knob.message, mididata, 2)==0) return chan->knob.action (&(chan->knob), mididata);
+		if (memcmp (chan->solo.message, mididata, 2)==0) return chan->solo.action (&(chan->solo), mididata);
+		if (memcmp (chan->mute.message, mididata, 2)==0) return chan->mute.action (&(chan->mute), mididata);
+		chan = & (channel[i][0]);
+		if (memcmp (chan->rec.message, mididata, 2)==0) return chan->rec.action (&(chan->rec), mididata);
+	}
+
+	return FLUID_OK;
+}
+
+
+// new dispatch: dispatch_control (), run by the main loop for each control message pulled from the command ring
+static int new_dispatch (uint8_t *mididata)
+{
+	return dispatch_control (mididata);
+}
+
+
+// fill flood table with CC messages; controller number is given by function
+static void make_flood (uint8_t (*controller) (int))
+{
+	int i;
+
+	for (i = 0; i < NB_MSG; i++) {
+		flood [i][0] = 0xB0;
+		flood [i][1] = controller (i);
+		flood [i][2] = i & 0x7F;
+	}
+}
+
+static uint8_t last_slider (int i) { return 0x07; }						// slider 8: worst case for memcmp chain
+static uint8_t all_sliders (int i) { return i & 0x07; }					// fader sweeps on all sliders
+static uint8_t all_knobs (int i) { return 0x10 + (i & 0x07); }			// knob sweeps on all knobs
+static uint8_t unassigned (int i) { return 0x50 + (i & 0x0F); }			// controllers not assigned to any control
+static uint8_t mixed (int i) { return (uint8_t) ((i * 2654435761u) >> 25); }		// pseudo-random controller numbers
+
+
+// run flood through both dispatch paths and print ns per message
+static void run (char *name)
+{
+	int i, j;
+	uint64_t start, t_old, t_new;
+	unsigned long c_old, c_new;
+
+	count = 0;
+	start = micros ();
+	for (j = 0; j < NB_LOOP; j++) for (i = 0; i < NB_MSG; i++) old_dispatch (flood [i]);
+	t_old = micros () - start;
+	c_old = count;
+
+	count = 0;
+	start = micros ();
+	for (j = 0; j < NB_LOOP; j++) for (i = 0; i < NB_MSG; i++) new_dispatch (flood [i]);
+	t_new = micros () - start;
+	c_new = count;
+
+	// both paths shall call the same number of actions
+	printf ("%-14s old %7.2f ns/msg   new %7.2f ns/msg   speedup x%5.2f %s\n", name,
+		t_old * 1000.0 / ((double) NB_MSG * NB_LOOP), t_new * 1000.0 / ((double) NB_MSG * NB_LOOP),
+		(t_new == 0) ? 0.0 : (double) t_old / t_new, (c_old == c_new) ? "" : "(MISMATCH)");
+}
+
+
+int main (int argc, char *argv[])
+{
+	memset (channel, 0, NB_CHANNEL * NB_RECSHIFT * sizeof (channel_t));
+	read_config ();
+	set_count_action ();
+
+	make_flood (last_slider);
+	run ("last slider");
+	make_flood (all_sliders);
+	run ("all sliders");
+	make_flood (all_knobs);
+	run ("all knobs");
+	make_flood (unassigned);
+	run ("unassigned");
+	make_flood (mixed);
+	run ("mixed");
+
+	return 0;
+}
@@ -0,0 +1,123 @@
+/** @file bench_mixer.c
+ *
+ * @brief Microbenchmark of the mixer stage of handle_midi_event_to_synth (): weighting of CC7 and CC10 of the song by slider and knob position,
+ * computed for each event (former adjust_volume () and adjust_panning ()) vs a single access to the mixer tables.
+ * Linear tables are first checked against the former functions, for all slider / knob positions and CC values.
+ *
+ */
+
+#include "../types.h"
+#include "../main.h"
+#include "../config.h"
+#include "../process.h"
+#include "../utils.h"
+#include "../mixer.h"
+
+#define NB_EVENT	4096		// number of CC7 / CC10 events in a stream
+#define NB_LOOP		5000		// number of times the stream is played
+
+static uint8_t stream [NB_EVENT][3];		// channel, controller, value
+static uint8_t slider [NB_MIDI_CHANNEL], knob [NB_MIDI_CHANNEL];
+static volatile uint8_t sink;				// results are written here, so they are not optimised out
+
+
+// former adjust_volume (): float divide and multiply for each event
+static uint8_t old_volume (uint8_t sld, uint8_t vol)
+{
+	float a;
+
+	a = sld / 127.0f;
+	a *= vol;
+	return (uint8_t) a;
+}
+
+
+// former adjust_panning (): additive offset with branches for each event
+static uint8_t old_panning (uint8_t knb, uint8_t pan)
+{
+	int a;
+
+	a = knb - 0x40;
+	a += pan;
+	if (a < 0) a = 0;
+	if (a > 0x7f) a = 0x7f;
+	return (uint8_t) a;
+}
+
+
+// stream of CC7 and CC10 on all channels, as a dense song sends them (expression rides, auto-pan)
+static void make_stream ()
+{
+	unsigned int r = 12345;
+	int i;
+
+	for (i = 0; i < NB_EVENT; i++) {
+		r = r * 1103515245 + 12345;
+		stream [i][0] = (r >> 8) & 0x0F;
+		stream [i][1] = ((r >> 12) & 1) ? 7 : 10;
+		stream [i][2] = (r >> 16) & 0x7F;
+	}
+	for (i = 0; i < NB_MIDI_CHANNEL; i++) {
+		slider [i] = 0x64 - i * 3;
+		knob [i] = 0x30 + i * 2;
+	}
+}
+
+
+// play the stream through a mixer stage; returns ns per event
+static double run (int mode)
+{
+	uint64_t start;
+	uint8_t *e;
+	int i, j;
+
+	start = micros ();
+	for (j = 0; j < NB_LOOP; j++) {
+		for (i = 0; i < NB_EVENT; i++) {
+			e = stream [i];
+			switch (mode) {
+				case 0:
+					sink = (e [1] == 7) ? old_volume (slider [e [0]], e [2]) : old_panning (knob [e [0]], e [2]);
+					break;
+				case 1:
+					// dB taper and equal power panning of mixer.c, computed for each event as they would be without tables
+					sink = (e [1] == 7) ? db_volume (slider [e [0]], e [2]) : power_panning (knob [e [0]], e [2]);
+					break;
+				default:
+					sink = (e [1] == 7) ? volume_lut [slider [e [0]]][e [2]] : panning_lut [knob [e [0]]][e [2]];
+					break;
+			}
+		}
+	}
+	return (micros () - start) * 1000.0 / ((double) NB_EVENT * NB_LOOP);
+}
+
+
+int main (int argc, char *argv[])
+{
+	int i, j, mismatch = 0;
+	double t_old, t_db, t_lut;
+
+	make_stream ();
+
+	// linear tables give the same results as the former functions
+	init_mixer ("linear", "linear");
+	for (i = 0; i < 128; i++) {
+		for (j = 0; j < 128; j++) {
+			if (volume_lut [i][j] != old_volume (i, j)) mismatch++;
+			if (panning_lut [i][j] != old_panning (i, j)) mismatch++;
+		}
+	}
+	printf ("linear tables vs former functions: %d mismatches over %d values\n", mismatch, 2 * 128 * 128);
+
+	t_old = run (0);
+	t_lut = run (2);
+	printf ("linear     computed %6.2f ns/event   table %6.2f ns/event   speedup x%5.2f\n", t_old, t_lut, t_old / t_lut);
+
+	init_mixer ("db", "power");
+	t_db = run (1);
+	t_lut = run (2);
+	printf ("db, power  computed %6.2f ns/event   table %6.2f ns/event   speedup x%5.2f\n", t_db, t_lut, t_db / t_lut);
+
+	return 0;
+}
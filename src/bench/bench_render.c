@@ -0,0 +1,416 @@
+/** @file bench_render.c
+ *
+ * @brief Offline benchmark of synthesis throughput: a fixed corpus of generated midi files (dense GM drums, orchestra, sustained piano
+ * arpeggios, full band) is rendered through a song engine with the same synth setup as syntwo, against each soundfont given.
+ * Results are printed as CSV lines (one per soundfont and song) to compare commits and Pi models; progress, and peak memory of the
+ * whole run, go to stderr.
+ *
+ * usage: bench_render.a [-a standard|low|PxN] [-c cpu_cores] [-s soundfont.sf2 ...] [file.mid ...]
+ * default soundfont is used if none is given; midi files given are rendered after the corpus
+ * with -c, everything is rendered on 1 core, then again with voices rendered in parallel on cpu_cores (0 for all online cores),
+ * and the speedup of each song on cpu_cores is printed at the end
+ *
+ */
+
+#include <unistd.h>
+#include <sys/resource.h>
+#include "../types.h"
+#include "../main.h"
+#include "../config.h"
+#include "../process.h"
+#include "../utils.h"
+#include "../audio.h"
+#include "../profile.h"
+
+#define DIVISION	480			// ticks per quarter note of generated files
+#define NB_RUNS		3			// each song is rendered this number of times; fastest run is kept
+#define NB_SF		8			// max number of soundfonts
+
+typedef struct {
+	uint32_t tick;
+	uint32_t order;				// order of generation, so note off comes before note on at the same tick
+	uint8_t msg [3];
+	int len;
+} gen_event_t;
+
+typedef struct {
+	gen_event_t *ev;
+	int nb, max;
+} gen_t;
+
+typedef struct {
+	char *name;
+	int bpm;
+	void (*generate) (gen_t *);
+} corpus_t;
+
+
+// add a midi event to generated song
+static void add (gen_t *g, uint32_t tick, uint8_t status, uint8_t d1, uint8_t d2)
+{
+	if (g->nb == g->max) {
+		g->max = (g->max == 0) ? 4096 : g->max * 2;
+		g->ev = realloc (g->ev, g->max * sizeof (gen_event_t));
+	}
+	g->ev [g->nb].tick = tick;
+	g->ev [g->nb].order = g->nb;
+	g->ev [g->nb].msg [0] = status;
+	g->ev [g->nb].msg [1] = d1;
+	g->ev [g->nb].msg [2] = d2;
+	g->ev [g->nb].len = ((status & 0xF0) == 0xC0) ? 2 : 3;
+	g->nb++;
+}
+
+
+// add a note of length len (in ticks) to generated song
+static void note (gen_t *g, int ch, uint32_t tick, uint32_t len, int key, int vel)
+{
+	if ((key < 0) || (key > 127)) return;
+	add (g, tick, 0x90 | ch, key, vel);
+	add (g, tick + len, 0x80 | ch, key, 0);
+}
+
+
+// dense GM drums: 16th hi-hats, syncopated kick, snare with ghost notes, 32nd tom fills, crash and ride; 64 bars
+static void gen_drums (gen_t *g)
+{
+	static int tom [8] = { 50, 50, 48, 48, 47, 45, 43, 41 };
+	int bar, s, t;
+	uint32_t tick;
+
+	for (bar = 0; bar < 64; bar++) {
+		for (s = 0; s < 16; s++) {
+			tick = (bar * 16 + s) * DIVISION / 4;
+			note (g, 9, tick, 60, (bar >= 32) ? 51 : 42, (s & 1) ? 70 : 100);
+			if ((s == 0) || (s == 8) || (s == 10) || (s == 7)) note (g, 9, tick, 60, 36, 120);
+			if ((s == 4) || (s == 12)) note (g, 9, tick, 60, 38, 120);
+			else if (s & 1) note (g, 9, tick, 60, 38, 35);
+			if ((s == 0) && ((bar % 4) == 0)) note (g, 9, tick, 60, 49, 110);
+			if ((s % 4) == 2) note (g, 9, tick, 60, 44, 60);
+		}
+		// fill on the last beat of every 4th bar
+		if ((bar % 4) == 3) {
+			for (t = 0; t < 8; t++) note (g, 9, (bar * 16 + 12) * DIVISION / 4 + t * DIVISION / 8, 60, tom [t], 110);
+		}
+	}
+}
+
+
+// orchestra: 11 sections holding legato chords on every bar, with expression swells, and a harp playing 16th arpeggios; 48 bars
+static void gen_orchestra (gen_t *g)
+{
+	static int program [11] = { 48, 49, 40, 42, 56, 57, 60, 68, 71, 73, 46 };
+	static int octave [11] = { 60, 48, 72, 36, 60, 48, 48, 72, 60, 84, 48 };
+	static int chord [4][4] = { { 0, 4, 7, 12 }, { -3, 0, 4, 9 }, { -7, -3, 0, 5 }, { -5, -1, 2, 7 } };	// C Am F G
+	int bar, i, k, b, s, ch;
+	uint32_t tick;
+
+	for (i = 0; i < 11; i++) {
+		ch = (i < 9) ? i : i + 1;		// channel 9 is drums
+		add (g, 0, 0xC0 | ch, program [i], 0);
+	}
+	for (bar = 0; bar < 48; bar++) {
+		tick = bar * 4 * DIVISION;
+		for (i = 0; i < 10; i++) {
+			ch = (i < 9) ? i : i + 1;
+			for (k = 0; k < 4; k++) note (g, ch, tick, 4 * DIVISION + DIVISION / 4, octave [i] + chord [bar % 4][k], 80);
+			for (b = 0; b < 4; b++) add (g, tick + b * DIVISION, 0xB0 | ch, 11, 70 + 14 * b);
+		}
+		for (s = 0; s < 16; s++) note (g, 11, tick + s * DIVISION / 4, DIVISION, octave [10] + chord [bar % 4][s % 4] + 12 * ((s / 4) % 3), 90);
+	}
+}
+
+
+// piano: 32nd arpeggios over 4 octaves with sustain pedal held for each bar, so voices pile up; 32 bars
+static void gen_piano (gen_t *g)
+{
+	static int chord [4][4] = { { 0, 4, 7, 11 }, { 2, 5, 9, 12 }, { -1, 2, 5, 9 }, { 0, 4, 7, 9 } };
+	int bar, s;
+	uint32_t tick;
+
+	add (g, 0, 0xC0, 0, 0);
+	for (bar = 0; bar < 32; bar++) {
+		tick = bar * 4 * DIVISION;
+		add (g, tick, 0xB0, 64, 127);
+		for (s = 0; s < 32; s++) note (g, 0, tick + s * DIVISION / 8, DIVISION / 8, 36 + chord [bar % 4][s % 4] + 12 * ((s / 4) % 4), 60 + (s % 8) * 8);
+		add (g, tick + 4 * DIVISION - 10, 0xB0, 64, 0);
+	}
+}
+
+
+// full band on 16 channels: drums, bass, guitars, keys, pads, strings, brass, lead, with pitch bend and modulation; 64 bars
+static void gen_band (gen_t *g)
+{
+	static int program [16] = { 33, 25, 29, 4, 89, 90, 48, 61, 80, 0, 16, 52, 65, 71, 11, 95 };
+	static int root [4] = { 0, -3, 5, 7 };
+	int bar, s, ch, r;
+	uint32_t tick;
+
+	for (ch = 0; ch < 16; ch++) if (ch != 9) add (g, 0, 0xC0 | ch, program [ch], 0);
+	for (bar = 0; bar < 64; bar++) {
+		tick = bar * 4 * DIVISION;
+		r = 48 + root [bar % 4];
+		for (s = 0; s < 16; s++) {
+			note (g, 9, tick + s * DIVISION / 4, 60, 42, (s & 1) ? 60 : 90);
+			if ((s % 8) == 0) note (g, 9, tick + s * DIVISION / 4, 60, 36, 110);
+			if ((s % 8) == 4) note (g, 9, tick + s * DIVISION / 4, 60, 38, 110);
+		}
+		for (s = 0; s < 8; s++) note (g, 0, tick + s * DIVISION / 2, DIVISION / 2 - 20, r - 12, 100);
+		for (s = 0; s < 4; s++) {
+			note (g, 1, tick + s * DIVISION, DIVISION - 40, r + 12, 80);
+			note (g, 1, tick + s * DIVISION, DIVISION - 40, r + 16, 80);
+			note (g, 2, tick + s * DIVISION + DIVISION / 2, DIVISION / 4, r + 7, 90);
+			note (g, 2, tick + s * DIVISION + DIVISION / 2, DIVISION / 4, r + 12, 90);
+			note (g, 3, tick + s * DIVISION, DIVISION / 2, r + 24, 70);
+			note (g, 3, tick + s * DIVISION, DIVISION / 2, r + 28, 70);
+			note (g, 3, tick + s * DIVISION, DIVISION / 2, r + 31, 70);
+		}
+		for (ch = 4; ch < 16; ch++) {
+			if ((ch == 9) || (ch == 8)) continue;
+			note (g, ch, tick, 4 * DIVISION, r + 12, 60);
+			note (g, ch, tick, 4 * DIVISION, r + 19, 60);
+			add (g, tick + 2 * DIVISION, 0xB0 | ch, 1, (bar * 8) & 0x7F);
+		}
+		// lead with pitch bend
+		for (s = 0; s < 8; s++) {
+			note (g, 8, tick + s * DIVISION / 2, DIVISION / 2, r + 24 + root [(bar + s) % 4], 100);
+			add (g, tick + s * DIVISION / 2 + DIVISION / 4, 0xE8, 0, 0x40 + ((s & 1) ? 8 : -8));
+		}
+	}
+}
+
+
+static corpus_t corpus [] = {
+	{ "drums", 140, gen_drums },
+	{ "orchestra", 80, gen_orchestra },
+	{ "piano_sustain", 120, gen_piano },
+	{ "band", 120, gen_band },
+};
+
+
+// sort events by tick, then order of generation
+static int compare_event (const void *a, const void *b)
+{
+	const gen_event_t *x = a, *y = b;
+
+	if (x->tick != y->tick) return (x->tick < y->tick) ? -1 : 1;
+	if ((x->msg [0] & 0xF0) != (y->msg [0] & 0xF0)) {
+		// note off first, so a repeated note is not cut
+		if ((x->msg [0] & 0xF0) == 0x80) return -1;
+		if ((y->msg [0] & 0xF0) == 0x80) return 1;
+	}
+	return (x->order < y->order) ? -1 : 1;
+}
+
+
+// write variable length quantity
+static void put_var (FILE *fp, uint32_t v)
+{
+	uint8_t b [5];
+	int n = 0;
+
+	do {
+		b [n++] = v & 0x7F;
+		v >>= 7;
+	} while (v != 0);
+	while (n > 1) fputc (b [--n] | 0x80, fp);
+	fputc (b [0], fp);
+}
+
+
+// write generated song as a format 0 midi file
+// returns TRUE if OK, FALSE otherwise
+static int write_song (char *name, corpus_t *c)
+{
+	FILE *fp;
+	gen_t g;
+	uint32_t last = 0, tempo = 60000000 / c->bpm;
+	long start, end;
+	int i;
+
+	memset (&g, 0, sizeof (g));
+	c->generate (&g);
+	qsort (g.ev, g.nb, sizeof (gen_event_t), compare_event);
+
+	if ((fp = fopen (name, "wb")) == NULL) {
+		free (g.ev);
+		return FALSE;
+	}
+	fwrite ("MThd\0\0\0\6\0\0\0\1", 1, 12, fp);
+	fputc (DIVISION >> 8, fp);
+	fputc (DIVISION & 0xFF, fp);
+	fwrite ("MTrk\0\0\0\0", 1, 8, fp);
+	start = ftell (fp);
+
+	// tempo meta event
+	put_var (fp, 0);
+	fwrite ("\xFF\x51\x03", 1, 3, fp);
+	fputc ((tempo >> 16) & 0xFF, fp);
+	fputc ((tempo >> 8) & 0xFF, fp);
+	fputc (tempo & 0xFF, fp);
+
+	for (i = 0; i < g.nb; i++) {
+		put_var (fp, g.ev [i].tick - last);
+		last = g.ev [i].tick;
+		fwrite (g.ev [i].msg, 1, g.ev [i].len, fp);
+	}
+	put_var (fp, DIVISION);
+	fwrite ("\xFF\x2F\x00", 1, 3, fp);
+
+	// length of track
+	end = ftell (fp);
+	fseek (fp, start - 4, SEEK_SET);
+	fputc (((end - start) >> 24) & 0xFF, fp);
+	fputc (((end - start) >> 16) & 0xFF, fp);
+	fputc (((end - start) >> 8) & 0xFF, fp);
+	fputc ((end - start) & 0xFF, fp);
+	fclose (fp);
+	free (g.ev);
+	return TRUE;
+}
+
+
+// machine the benchmark runs on: model of the Pi, from the device tree
+static void get_model (char *model, int len)
+{
+	FILE *fp;
+	int i;
+
+	strcpy (model, "unknown");
+	if ((fp = fopen ("/proc/device-tree/model", "rt")) == NULL) return;
+	if (fgets (model, len, fp) == NULL) strcpy (model, "unknown");
+	fclose (fp);
+	// no comma in a CSV field
+	for (i = 0; model [i] != 0; i++) if ((model [i] == ',') || (model [i] == '\n')) model [i] = ' ';
+}
+
+
+// render song with the soundfont loaded, NB_RUNS times, and print CSV line of the fastest run
+// returns wall time of the fastest run in us, 0 if song could not be rendered
+static uint64_t bench (char *model, char *sf, char *song, char *midi)
+{
+	profile_t prof, best;
+	uint64_t start, wall, best_wall = 0;
+	double audio_s;
+	int run, period, cores;
+
+	fprintf (stderr, "%s: %s\n", sf, song);
+	for (run = 0; run < NB_RUNS; run++) {
+		start = micros ();
+		if (render_song (midi, &prof) == FALSE) return 0;
+		wall = micros () - start;
+		free_profile (&prof);
+		if ((run == 0) || (wall < best_wall)) {
+			best_wall = wall;
+			best = prof;
+		}
+	}
+
+	fluid_settings_getint (settings, "audio.period-size", &period);
+	fluid_settings_getint (settings, "synth.cpu-cores", &cores);
+	audio_s = best.duration_ms / 1000.0;
+
+	// voices per second: voice-seconds rendered per second of rendering, ie. voices that could be rendered in realtime at full load
+	printf ("%s,%s,%d,%d,%s,%s,%.1f,%.3f,%.1f,%.3f,%.3f,%.1f,%d,%.0f\n",
+		model, fluid_version_str (), period, cores, sf, song, audio_s, best_wall / 1000000.0, audio_s * 1000000.0 / best_wall,
+		best.mean_block_us / 1000.0, best.max_block_us / 1000.0, best.mean_voices, best.peak_voices,
+		best.mean_voices * best.rt_factor);
+	fflush (stdout);
+	return best_wall;
+}
+
+
+int main (int argc, char *argv[])
+{
+	char *sf [NB_SF];
+	struct rusage ru;
+	char model [64], midi [64], *s;
+	int opt, nb_sf = 0, i, j, k, id, c, nb_cores = 1, nb_song;
+	int cores [2] = { 1, 1 };
+	uint64_t *wall [2];				// wall time of each soundfont and song, for each number of cores; 0 if not rendered
+
+	// same synth as syntwo, rendered to a file instead of the audio driver
+	settings = new_fluid_settings ();
+	set_audio_profile (NULL, 0);
+
+	while ((opt = getopt (argc, argv, "a:c:s:")) != -1) {
+		switch (opt) {
+			case 'a':
+				if (set_audio_profile (optarg, 0) == FALSE) exit (0);
+				break;
+			case 'c':
+				cores [1] = atoi (optarg);
+				if (cores [1] <= 0) cores [1] = sysconf (_SC_NPROCESSORS_ONLN);
+				nb_cores = 2;
+				break;
+			case 's':
+				if (nb_sf < NB_SF) sf [nb_sf++] = optarg;
+				break;
+			default:
+				fprintf (stderr, "usage: bench_render.a [-a standard|low|PxN] [-c cpu_cores] [-s soundfont.sf2 ...] [file.mid ...]\n");
+				exit (0);
+		}
+	}
+	if (nb_sf == 0) sf [nb_sf++] = DEFAULT_SF2;
+
+	// song engine is timed on rendered frames, so songs are rendered as fast as the cpu allows
+	fluid_settings_setint (settings, "synth.lock-memory", 0);
+
+	nb_song = (int) (sizeof (corpus) / sizeof (corpus_t)) + argc - optind;
+	wall [0] = calloc (nb_sf * nb_song, sizeof (uint64_t));
+	wall [1] = calloc (nb_sf * nb_song, sizeof (uint64_t));
+	if ((wall [0] == NULL) || (wall [1] == NULL)) {
+		fprintf (stderr, "memory allocation failed\n");
+		exit (0);
+	}
+
+	get_model (model, sizeof (model));
+	printf ("model,fluidsynth,period,cores,soundfont,song,audio_s,wall_s,rt_factor,ms_per_period,max_ms_per_period,mean_voices,peak_voices,voices_per_s\n");
+
+	// number of cores is read by the synth when it is created: a synth is created for each number of cores
+	for (c = 0; c < nb_cores; c++) {
+		fluid_settings_setint (settings, "synth.cpu-cores", cores [c]);
+		synth = new_fluid_synth (settings);
+
+		for (i = 0; i < nb_sf; i++) {
+			if ((id = fluid_synth_sfload (synth, sf [i], TRUE)) == FLUID_FAILED) {
+				fprintf (stderr, "cannot load soundfont %s\n", sf [i]);
+				continue;
+			}
+			s = strrchr (sf [i], '/');
+			s = (s != NULL) ? s + 1 : sf [i];
+
+			k = i * nb_song;
+			for (j = 0; j < (int) (sizeof (corpus) / sizeof (corpus_t)); j++, k++) {
+				snprintf (midi, sizeof (midi), "/tmp/bench_render_%d_%s.mid", (int) getpid (), corpus [j].name);
+				if (write_song (midi, &corpus [j])) wall [c][k] = bench (model, s, corpus [j].name, midi);
+				unlink (midi);
+			}
+			for (j = optind; j < argc; j++, k++) wall [c][k] = bench (model, s, argv [j], argv [j]);
+
+			fluid_synth_sfunload (synth, id, TRUE);
+		}
+
+		delete_fluid_synth (synth);
+	}
+
+	// speedup of each song on several cores, against 1 core
+	for (i = 0; (nb_cores == 2) && (i < nb_sf); i++) {
+		for (j = 0; j < nb_song; j++) {
+			k = i * nb_song + j;
+			if ((wall [0][k] == 0) || (wall [1][k] == 0)) continue;
+			s = (j < (int) (sizeof (corpus) / sizeof (corpus_t))) ? corpus [j].name : argv [optind + j - (int) (sizeof (corpus) / sizeof (corpus_t))];
+			fprintf (stderr, "%s: %s: 1 core %.3f s, %d cores %.3f s, speedup x%.2f\n", sf [i], s,
+				wall [0][k] / 1000000.0, cores [1], wall [1][k] / 1000000.0, (double) wall [0][k] / wall [1][k]);
+		}
+	}
+	free (wall [0]);
+	free (wall [1]);
+
+	// peak memory is the peak of the whole process: it is reported once, for the run, not per song
+	getrusage (RUSAGE_SELF, &ru);
+	fprintf (stderr, "peak RSS of the run: %ld kB\n", ru.ru_maxrss);
+
+	delete_fluid_settings (settings);
+	return 0;
+}
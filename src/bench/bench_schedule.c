@@ -0,0 +1,158 @@
+/** @file bench_schedule.c
+ *
+ * @brief Timing of live changes: slider changes are made at random times by the main thread while an audio thread renders periods in
+ * real time, as the audio driver does. The time at which each change takes effect in the rendered audio is found by reading the CC of
+ * the synth after each internal block of 64 frames. Changes are either sent to the synth right away (former behaviour: effect at the
+ * next period, whenever it comes) or scheduled through the sequencer (see schedule.c: effect one period after the change).
+ * Reports mean latency and jitter (standard deviation, min and max) of changes for both.
+ *
+ */
+
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "../types.h"
+#include "../main.h"
+#include "../config.h"
+#include "../process.h"
+#include "../utils.h"
+#include "../mixer.h"
+#include "../schedule.h"
+
+#define NB_CHANGE	400			// number of changes per mode
+#define BLOCK		64			// internal block of the synth: resolution of the measure
+#define RATE		44100.0
+#define MAX_PERIOD	1024
+
+static int period = 256;		// frames per audio period
+static int scheduled;			// TRUE if changes go through the sequencer
+static atomic_int running;
+static _Atomic uint64_t made;	// time of the change in flight, 0 if none
+static _Atomic uint64_t effect;	// time at which it was heard in rendered audio, 0 if not yet
+
+
+// audio thread: render one period every period, as the audio driver would call the audio callback
+// rendering is split in blocks, and CC7 of channel 0 is read after each block to find when a change takes effect
+static void *audio_thread (void *arg)
+{
+	static float left [MAX_PERIOD], right [MAX_PERIOD];
+	float *out [2];
+	uint64_t next, start;
+	int i, v, last = -1;
+
+	next = micros ();
+	while (atomic_load (&running)) {
+		start = micros ();
+		if (scheduled) {
+			schedule_period (period);
+			flush_mixer ();
+		}
+		for (i = 0; i < period; i += BLOCK) {
+			out [0] = left + i;
+			out [1] = right + i;
+			// effects mixed into the dry buffers, as in the audio callback
+			fluid_synth_process (synth, BLOCK, 2, out, 2, out);
+			fluid_synth_get_cc (synth, 0, 7, &v);
+			if ((v != last) && (last != -1) && (atomic_load (&effect) == 0)) {
+				// time of the block in the period, as if the period was played out from the start of the callback
+				atomic_store (&effect, start + (uint64_t) (i * 1000000.0 / RATE));
+			}
+			last = v;
+		}
+
+		next += (uint64_t) (period * 1000000.0 / RATE);
+		if (next > micros ()) usleep (next - micros ());
+	}
+	return NULL;
+}
+
+
+// make changes of slider 1 at random times, and measure their latency; print mean, standard deviation, min and max
+static void run (char *name, int mode)
+{
+	pthread_t t;
+	double lat, sum = 0.0, sum2 = 0.0, min = 1e9, max = 0.0;
+	unsigned int r = 4321;
+	int i, n = 0;
+	uint64_t timeout;
+
+	scheduled = mode;
+	atomic_store (&made, 0);
+	atomic_store (&effect, 0);
+	atomic_store (&running, TRUE);
+	pthread_create (&t, NULL, audio_thread, NULL);
+	usleep (50000);
+
+	for (i = 0; i < NB_CHANGE; i++) {
+		// random time between changes: 10 to 30 ms, so changes fall anywhere in a period
+		r = r * 1103515245 + 12345;
+		usleep (10000 + (r >> 16) % 20000);
+
+		atomic_store (&effect, 0);
+		channel [0][0].slider.value = (i & 1) ? 0x40 : 0x60;
+		atomic_store (&made, micros ());
+		if (scheduled) post_volume (0);
+		else fluid_synth_cc (synth, 0, 7, adjust_volume (channel [0][0].slider.value, channel [0][0].slider.value_rt));
+
+		// wait for the change to be heard
+		timeout = micros () + 200000;
+		while ((atomic_load (&effect) == 0) && (micros () < timeout)) usleep (200);
+		if (atomic_load (&effect) == 0) continue;
+
+		lat = (int64_t) (atomic_load (&effect) - atomic_load (&made)) / 1000.0;
+		sum += lat;
+		sum2 += lat * lat;
+		if (lat < min) min = lat;
+		if (lat > max) max = lat;
+		n++;
+	}
+
+	atomic_store (&running, FALSE);
+	pthread_join (t, NULL);
+
+	if (n == 0) {
+		printf ("%-10s no change heard\n", name);
+		return;
+	}
+	printf ("%-10s %4d changes   latency mean %6.2f ms   jitter: std dev %5.2f ms, min %6.2f ms, max %6.2f ms\n", name, n,
+		sum / n, sqrt (sum2 / n - (sum / n) * (sum / n)), min, max);
+}
+
+
+int main (int argc, char *argv[])
+{
+	int opt;
+
+	// -p period: frames per audio period
+	while ((opt = getopt (argc, argv, "p:")) != -1) {
+		switch (opt) {
+			case 'p':
+				period = atoi (optarg) / BLOCK * BLOCK;
+				if ((period < BLOCK) || (period > MAX_PERIOD)) period = 256;
+				break;
+			default:
+				fprintf (stderr, "usage: %s [-p period_size]\n", argv [0]);
+				exit (1);
+		}
+	}
+
+	settings = new_fluid_settings ();
+	fluid_settings_setint (settings, "synth.lock-memory", 0);
+	fluid_settings_setnum (settings, "synth.sample-rate", RATE);
+	synth = new_fluid_synth (settings);
+
+	memset (channel, 0, NB_CHANNEL * NB_RECSHIFT * sizeof (channel_t));
+	init_mixer (NULL, NULL);
+	set_volume_value (0x7F);
+	if (init_schedule (NULL) == FALSE) exit (1);
+
+	printf ("audio period %d frames (%.2f ms), measured by blocks of %d frames (%.2f ms)\n",
+		period, period * 1000.0 / RATE, BLOCK, BLOCK * 1000.0 / RATE);
+	run ("immediate", FALSE);
+	run ("scheduled", TRUE);
+
+	kill_schedule ();
+	delete_fluid_synth (synth);
+	delete_fluid_settings (settings);
+	return 0;
+}
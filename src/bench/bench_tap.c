@@ -0,0 +1,225 @@
+/** @file bench_tap.c
+ *
+ * @brief Offline benchmark of tap tempo: synthetic jittered tap traces are replayed against a simulated player,
+ * with the former single-interval logic of beat_process and with the phase-locked tracker of tempo.c.
+ * Reports tempo error, phase error of the player against the drummer, and convergence time.
+ *
+ */
+
+#include <math.h>
+#include "../types.h"
+#include "../main.h"
+#include "../config.h"
+#include "../process.h"
+#include "../utils.h"
+#include "../tempo.h"
+
+#define NB_BEATS	128			// beats of drummer per trace
+#define NB_RUNS		200			// traces per scenario (different random seeds)
+#define SONG_PERIOD	500000.0	// tempo of the song: 120 BPM
+#define START_PHASE	80000.0		// player starts 80 ms late against the drummer
+#define STEP_US		10000		// simulation step, same as tempo ramp timer
+#define SETTLED		16			// beats after which errors are measured
+#define CONV_TEMPO	0.01		// converged when tempo error < 1%...
+#define CONV_PHASE	20000.0		// ...and phase error < 20 ms...
+#define CONV_BEATS	8			// ...for this number of consecutive beats (counted after the tempo step, if any)
+
+typedef struct {
+	char *name;
+	double bpm_start, bpm_end;	// tempo of the drummer, linear from start to end (step at half if step is TRUE)
+	int step;
+	double jitter_us;			// standard deviation of tap timing
+	double missed;				// probability of a missed tap
+	double doubled;				// probability of a double tap (bounce 60 ms after the tap)
+	double outlier;				// probability of a tap late by 30% of a beat
+} scenario_t;
+
+typedef struct {
+	double tempo_err;			// mean absolute error of tempo estimate after SETTLED beats, in %
+	double phase_err;			// rms phase error after SETTLED beats, in ms
+	double conv;				// mean convergence time, in beats
+	int not_conv;				// traces that never converged
+} result_t;
+
+static scenario_t scenario [] = {
+	{ "steady 120, jitter 5 ms", 120, 120, FALSE, 5000, 0, 0, 0 },
+	{ "steady 120, jitter 20 ms", 120, 120, FALSE, 20000, 0, 0, 0 },
+	{ "jitter 15 ms, 10% missed", 120, 120, FALSE, 15000, 0.10, 0, 0 },
+	{ "jitter 15 ms, 5% double, 5% late", 120, 120, FALSE, 15000, 0, 0.05, 0.05 },
+	{ "step 100 to 130, jitter 10 ms", 100, 130, TRUE, 10000, 0, 0, 0 },
+	{ "drift 110 to 125, jitter 10 ms", 110, 125, FALSE, 10000, 0, 0, 0 },
+};
+
+
+// gaussian random number (Box-Muller)
+static double gauss (unsigned short *seed)
+{
+	double u = erand48 (seed), v = erand48 (seed);
+
+	if (u < 1e-12) u = 1e-12;
+	return sqrt (-2.0 * log (u)) * cos (2.0 * M_PI * v);
+}
+
+
+// period of the drummer at beat n
+static double drummer_period (scenario_t *sc, int n)
+{
+	double bpm;
+
+	if (sc->step) bpm = (n < NB_BEATS / 2) ? sc->bpm_start : sc->bpm_end;
+	else bpm = sc->bpm_start + (sc->bpm_end - sc->bpm_start) * n / NB_BEATS;
+	return 60000000.0 / bpm;
+}
+
+
+// former beat_process: tempo set from the last interval alone, no phase correction
+static double old_tap (uint64_t t, double *period, uint64_t *prev)
+{
+	if (*prev == 0) *prev = t - (uint64_t) *period;
+	if ((double) (t - *prev) > *period * 1.75) *prev = 0;
+	else {
+		*period = (double) (t - *prev);
+		*prev = t;
+	}
+	return *period;
+}
+
+
+// replay one trace; player position is in beats of the song, advanced at the applied tempo
+static void run_trace (scenario_t *sc, int tracker, unsigned short *seed, result_t *res)
+{
+	tap_tracker_t tr;
+	double beat_t [NB_BEATS + 1], tap_t [2 * NB_BEATS];
+	double applied, target, pos, t, err_t, err_p, old_period;
+	uint64_t old_prev = 0, nudge_end = 0;
+	int n, i, nb_tap, next_beat, next_tap, good, conv, count;
+	int change = sc->step ? NB_BEATS / 2 : 0;		// beat of the tempo step
+
+	// beat times of the drummer, and taps with jitter, missed taps, double taps and late taps
+	beat_t [0] = 1000000.0;
+	for (n = 1; n <= NB_BEATS; n++) beat_t [n] = beat_t [n - 1] + drummer_period (sc, n - 1);
+	for (n = 0, nb_tap = 0; n < NB_BEATS; n++) {
+		if (erand48 (seed) < sc->missed) continue;
+		t = beat_t [n] + sc->jitter_us * gauss (seed);
+		if (erand48 (seed) < sc->outlier) t += 0.3 * drummer_period (sc, n);
+		tap_t [nb_tap++] = t;
+		if (erand48 (seed) < sc->doubled) tap_t [nb_tap++] = t + 60000.0;
+	}
+
+	init_tap (&tr, SONG_PERIOD);
+	applied = target = old_period = SONG_PERIOD;
+	pos = -2.0 - START_PHASE / SONG_PERIOD;
+	t = beat_t [0] - 2 * SONG_PERIOD;
+	next_beat = 0;
+	next_tap = 0;
+	good = 0;
+	conv = -1;
+	count = 0;
+
+	while (next_beat < NB_BEATS) {
+		// taps within this step
+		while ((next_tap < nb_tap) && (tap_t [next_tap] < t + STEP_US)) {
+			double tt = tap_t [next_tap++];
+			double p = pos + (tt - t) / applied;
+
+			if (tracker) {
+				i = tap (&tr, (uint64_t) tt);
+				if ((i != TAP_IGNORED) && (tr.locked >= 2)) {
+					if (i == TAP_OUTLIER) target = tr.period;
+					else {
+						target = nudge_period (tr.period, p - floor (p + 0.5));
+						nudge_end = (uint64_t) (tt + tr.period);
+					}
+					if (i == TAP_RELOCK) applied = tr.period;
+				}
+			}
+			else applied = old_tap ((uint64_t) tt, &old_period, &old_prev);
+		}
+
+		// beats of the drummer within this step: measure errors
+		while ((next_beat < NB_BEATS) && (beat_t [next_beat] < t + STEP_US)) {
+			double p = pos + (beat_t [next_beat] - t) / applied;
+
+			// phase error against the nearest beat of the player: taps give the beat, not the bar
+			err_p = (p - floor (p + 0.5)) * drummer_period (sc, next_beat);
+			// tempo error of the estimate; applied tempo also carries the phase nudge, which shows in the phase error
+			err_t = fabs ((tracker ? tr.period : old_period) - drummer_period (sc, next_beat)) / drummer_period (sc, next_beat);
+			if (next_beat >= SETTLED) {
+				res->tempo_err += 100.0 * err_t;
+				res->phase_err += (err_p / 1000.0) * (err_p / 1000.0);
+				count++;
+			}
+			// convergence is counted from the start, or from the tempo step
+			if ((next_beat == change) && (change != 0)) {
+				good = 0;
+				conv = -1;
+			}
+			if ((err_t < CONV_TEMPO) && (fabs (err_p) < CONV_PHASE)) {
+				if ((++good >= CONV_BEATS) && (conv < 0)) conv = next_beat - CONV_BEATS + 1 - change;
+			}
+			else good = 0;
+			next_beat++;
+		}
+
+		// advance player, then one step of tempo ramp
+		pos += STEP_US / applied;
+		t += STEP_US;
+		if (tracker) {
+			if ((nudge_end != 0) && (t >= nudge_end)) {
+				target = tr.period;
+				nudge_end = 0;
+			}
+			applied = ramp_period (applied, target);
+		}
+	}
+
+	res->phase_err /= (count > 0) ? count : 1;
+	res->tempo_err /= (count > 0) ? count : 1;
+	if (conv < 0) res->not_conv++;
+	else res->conv += conv;
+}
+
+
+// run all traces of a scenario with one algorithm, and print results
+static void run (scenario_t *sc, int tracker)
+{
+	result_t sum, r;
+	unsigned short seed [3];
+	int i, nb_conv;
+
+	memset (&sum, 0, sizeof (sum));
+	for (i = 0; i < NB_RUNS; i++) {
+		seed [0] = i;
+		seed [1] = 0x5EED;
+		seed [2] = 0x1234;
+		memset (&r, 0, sizeof (r));
+		run_trace (sc, tracker, seed, &r);
+		sum.tempo_err += r.tempo_err;
+		sum.phase_err += sqrt (r.phase_err);
+		sum.conv += r.conv;
+		sum.not_conv += r.not_conv;
+	}
+	nb_conv = NB_RUNS - sum.not_conv;
+
+	printf ("  %-8s tempo err %6.2f %%   phase err %7.1f ms   ", tracker ? "pll" : "single", sum.tempo_err / NB_RUNS, sum.phase_err / NB_RUNS);
+	if (nb_conv > 0) printf ("converged in %5.1f beats", sum.conv / nb_conv);
+	else printf ("never converged      ");
+	printf ("  (%d/%d not converged)\n", sum.not_conv, NB_RUNS);
+}
+
+
+int main (int argc, char *argv[])
+{
+	int i;
+
+	printf ("tap tempo: %d traces of %d beats per scenario; errors measured after %d beats\n", NB_RUNS, NB_BEATS, SETTLED);
+	printf ("converged: tempo within %.0f%% and phase within %.0f ms for %d beats\n", CONV_TEMPO * 100, CONV_PHASE / 1000, CONV_BEATS);
+
+	for (i = 0; i < (int) (sizeof (scenario) / sizeof (scenario_t)); i++) {
+		printf ("%s\n", scenario [i].name);
+		run (&scenario [i], FALSE);
+		run (&scenario [i], TRUE);
+	}
+
+	return 0;
+}
@@ -0,0 +1,136 @@
+/** @file chase.c
+ *
+ * @brief Chase of channel state: for each section, state of all midi channels (program, bank, controllers, pitch bend, tempo)
+ * is computed in advance from the event table of the song, so a jump restores it in a single batch before seeking.
+ *
+ */
+
+#include "types.h"
+#include "globals.h"
+#include "config.h"
+#include "process.h"
+#include "utils.h"
+#include "gpio.h"
+#include "smf.h"
+#include "chase.h"
+
+#define DEFAULT_TEMPO	500000		// default midi tempo: 120 BPM, in us per quarter note
+#define DEFAULT_BEND	8192		// default pitch bend: center
+#define DEFAULT_VOLUME	100			// default volume (CC7) of a channel
+#define DEFAULT_PAN		64			// default panning (CC10): center
+
+static fluid_midi_event_t *chase_event = NULL;		// midi event used to send snapshot to synth, allocated once
+
+
+// clear snapshot: no channel state set, default tempo
+static void clear_snapshot (snapshot_t *snap, uint32_t tick)
+{
+	memset (snap->program, 0xFF, sizeof (snap->program));
+	memset (snap->bend, 0xFF, sizeof (snap->bend));
+	memset (snap->cc, 0xFF, sizeof (snap->cc));
+	snap->tempo = DEFAULT_TEMPO;
+	snap->tick = tick;
+	snap->valid = FALSE;
+}
+
+
+// update snapshot with an event of the song
+static void chase (snapshot_t *snap, smf_event_t *ev)
+{
+	int chan = ev->status & 0x0F;
+
+	switch (ev->status & 0xF0) {
+		case 0xB0:
+			if (ev->data [0] < NB_CHASE_CC) snap->cc [chan] [ev->data [0]] = ev->data [1];
+			break;
+		case 0xC0:
+			snap->program [chan] = ev->data [0];
+			break;
+		case 0xE0:
+			snap->bend [chan] = (ev->data [1] << 7) | ev->data [0];
+			break;
+		case 0xF0:
+			// tempo meta event
+			if ((ev->status == 0xFF) && (ev->data [0] == 0x51) && (ev->len == 3))
+				snap->tempo = (ev->meta [0] << 16) | (ev->meta [1] << 8) | ev->meta [2];
+			break;
+	}
+}
+
+
+// compute state of all midi channels at tick: last program, controllers and pitch bend before tick
+// events at tick are not part of the snapshot, as they are played by the player after the seek
+void make_snapshot (smf_t *smf, uint32_t tick, snapshot_t *snap)
+{
+	int i, end;
+
+	clear_snapshot (snap, tick);
+	if (smf == NULL) return;
+
+	end = smf_find (smf, tick);
+	for (i = 0; i < end; i++) chase (snap, &smf->event [i]);
+	snap->valid = TRUE;
+}
+
+
+// compute snapshots of all sections of a list (sorted by tick) in a single pass over the events of the song
+void make_snapshots (smf_t *smf, section_list_t *list)
+{
+	snapshot_t snap;
+	int i, k;
+
+	clear_snapshot (&snap, 0);
+	for (i = 0, k = 0; k < list->nb; k++) {
+		if (smf == NULL) {
+			clear_snapshot (&list->section [k].snap, list->section [k].tick);
+			continue;
+		}
+		while ((i < smf->nb_event) && (smf->event [i].tick < list->section [k].tick)) chase (&snap, &smf->event [i++]);
+		list->section [k].snap = snap;
+		list->section [k].snap.tick = list->section [k].tick;
+		list->section [k].snap.valid = TRUE;
+	}
+}
+
+
+// send one channel event of the snapshot to the synth
+// it goes through the same path as events of the player, so volume and panning are ponderated by sliders and knobs
+static void send_event (int type, int chan, int key, int value)
+{
+	fluid_midi_event_set_type (chase_event, type);
+	fluid_midi_event_set_channel (chase_event, chan);
+	if (type == 0xE0) fluid_midi_event_set_pitch (chase_event, value);
+	else if (type == 0xC0) fluid_midi_event_set_program (chase_event, value);
+	else {
+		fluid_midi_event_set_control (chase_event, key);
+		fluid_midi_event_set_value (chase_event, value);
+	}
+	handle_midi_event_to_synth ((void *) synth, chase_event);
+}
+
+
+// restore state of all midi channels from a snapshot, in a single batch
+// notes of the previous position are released first; bank select controllers are sent before program change
+// controllers and pitch bend not set before the snapshot are reset to their defaults, so a jump backwards does not keep
+// values set later in the song: reset all controllers (CC121) first, then volume and panning, which it leaves as they are
+// tempo is not sent: the player restores its own tempo from the file when seeking, and tempo set by the user is kept
+void apply_snapshot (snapshot_t *snap)
+{
+	int chan, cc;
+
+	if (snap->valid == FALSE) return;
+	if ((chase_event == NULL) && ((chase_event = new_fluid_midi_event ()) == NULL)) return;
+
+	fluid_synth_all_notes_off (synth, -1);
+
+	for (chan = 0; chan < NB_MIDI_CHANNEL; chan++) {
+		send_event (0xB0, chan, 121, 0);
+		if (snap->cc [chan] [7] == 0xFF) send_event (0xB0, chan, 7, DEFAULT_VOLUME);
+		if (snap->cc [chan] [10] == 0xFF) send_event (0xB0, chan, 10, DEFAULT_PAN);
+		for (cc = 0; cc < NB_CHASE_CC; cc++) {
+			if (snap->cc [chan] [cc] != 0xFF) send_event (0xB0, chan, cc, snap->cc [chan] [cc]);
+		}
+		if (snap->program [chan] != 0xFF) send_event (0xC0, chan, 0, snap->program [chan]);
+		send_event (0xE0, chan, 0, (snap->bend [chan] != 0xFFFF) ? snap->bend [chan] : DEFAULT_BEND);
+	}
+}
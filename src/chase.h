@@ -0,0 +1,9 @@
+/** @file chase.h
+ *
+ * @brief This file defines prototypes of functions inside chase.c
+ *
+ */
+
+void make_snapshot (smf_t *, uint32_t, snapshot_t *);
+void make_snapshots (smf_t *, section_list_t *);
+void apply_snapshot (snapshot_t *);
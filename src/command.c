@@ -0,0 +1,109 @@
+/** @file command.c
+ *
+ * @brief Commands from other threads to the main loop: the main loop is the only thread that changes control state
+ * (controls, song numbers, bpm, volume, sections...). The midi driver thread and the synth thread only push fixed-size commands
+ * onto a lock-free ring (one ring per producer thread, so each ring has a single producer and a single consumer), and wake the
+ * main loop with an eventfd. They never block, and never wait for file or soundfont operations.
+ * Values read by the player thread (slider and knob values) are published with atomics (see types.h).
+ *
+ */
+
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include "types.h"
+#include "globals.h"
+#include "config.h"
+#include "process.h"
+#include "utils.h"
+#include "gpio.h"
+#include "loop.h"
+#include "cue.h"
+#include "command.h"
+
+static command_ring_t ring [NB_CMD_SOURCE];
+static int command_fd = -1;				// eventfd waking the main loop when commands are pushed
+
+
+// push a command from thread source (CMD_FROM_MIDI or CMD_FROM_SYNTH) to the main loop; data may be NULL
+// shall only be called from the thread of the source; never blocks
+// returns TRUE if OK, FALSE if ring is full (command is dropped)
+int push_command (int source, uint8_t type, uint8_t *data)
+{
+	command_ring_t *r = &ring [source];
+	unsigned int head, tail;
+	uint64_t one = 1;
+
+	head = atomic_load_explicit (&r->head, memory_order_relaxed);
+	tail = atomic_load_explicit (&r->tail, memory_order_acquire);
+	if (head - tail >= NB_COMMAND) {
+		atomic_fetch_add (&r->dropped, 1);
+		return FALSE;
+	}
+
+	r->command [head % NB_COMMAND].type = type;
+	if (data != NULL) memcpy (r->command [head % NB_COMMAND].data, data, 3);
+	// command is visible to the main loop once head has moved
+	atomic_store_explicit (&r->head, head + 1, memory_order_release);
+
+	write (command_fd, &one, sizeof (one));
+	return TRUE;
+}
+
+
+// execute commands of a ring
+static void drain (command_ring_t *r)
+{
+	unsigned int head, tail;
+	command_t *c;
+
+	head = atomic_load_explicit (&r->head, memory_order_acquire);
+	tail = atomic_load_explicit (&r->tail, memory_order_relaxed);
+	for (; tail != head; tail++) {
+		c = &r->command [tail % NB_COMMAND];
+		switch (c->type) {
+			case CMD_CONTROL:
+				dispatch_control (c->data);
+				break;
+			case CMD_SWITCH:
+				cue_switched ();
+				break;
+		}
+		// slot may be reused by the producer
+		atomic_store_explicit (&r->tail, tail + 1, memory_order_release);
+	}
+}
+
+
+// main loop handler for command eventfd: execute all pending commands
+int command_event (int fd)
+{
+	uint64_t count;
+	unsigned long dropped;
+	int i;
+
+	// acknowledge eventfd
+	read (fd, &count, sizeof (count));
+
+	// a switch to a cued song comes first: controls pushed meanwhile apply to the new song
+	drain (&ring [CMD_FROM_SYNTH]);
+	drain (&ring [CMD_FROM_MIDI]);
+
+	for (i = 0; i < NB_CMD_SOURCE; i++) {
+		if ((dropped = atomic_exchange (&ring [i].dropped, 0)) != 0) fprintf (stderr, "command ring %d full: %lu commands dropped\n", i, dropped);
+	}
+	return TRUE;
+}
+
+
+// create eventfd of commands, and register it to the main loop
+// shall be called before midi driver and players are started
+// returns TRUE if OK, FALSE otherwise
+int init_command ()
+{
+	command_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (command_fd < 0) {
+		fprintf (stderr, "command eventfd creation failed\n");
+		return FALSE;
+	}
+	return add_loop_fd (command_fd, command_event);
+}
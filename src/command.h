@@ -0,0 +1,9 @@
+/** @file command.h
+ *
+ * @brief This file defines prototypes of functions inside command.c
+ *
+ */
+
+int push_command (int, uint8_t, uint8_t *);
+int command_event (int);
+int init_command ();
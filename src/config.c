@@ -12,6 +12,62 @@
 #include "gpio.h"
 
 
+// shift state of controls that don't use any shift key
+static uint8_t no_shift = 0;
+
+
+// set dispatch table entry corresponding to the midi message of a control
+// control and action are given for both shift states (non-shift and shift), as well as the value of the key used as shift
+static void set_dispatch (uint8_t *message, uint8_t *shift, void *control0, int (*action0) (void*,uint8_t*), void *control1, int (*action1) (void*,uint8_t*))
+{
+	dispatch_t *d;
+
+	// index on status nibble (0x8 to 0xF) and controller number
+	d = &dispatch [(message [0] >> 4) & 0x07] [message [1] & 0x7F];
+
+	d->control [0] = control0;
+	d->action [0] = action0;
+	d->control [1] = control1;
+	d->action [1] = action1;
+	d->shift = shift;
+}
+
+
+// build dispatch table from the midi messages of the controls
+// this allows handle_midi_event_from_hw () to find the control corresponding to a midi message with a single indexed access
+static void build_dispatch (void)
+{
+	int i;
+
+	memset (dispatch, 0, NB_STATUS * NB_CONTROL * sizeof (dispatch_t));
+
+	// controls without shift
+	set_dispatch (play.message, &no_shift, &play, play.action, &play, play.action);
+	set_dispatch (stop.message, &no_shift, &stop, stop.action, &stop, stop.action);
+	set_dispatch (record.message, &no_shift, &record, record.action, &record, record.action);
+	set_dispatch (set.message, &no_shift, &set, set.action, &set, set.action);
+	set_dispatch (cycle.message, &no_shift, &cycle, cycle.action, &cycle, cycle.action);
+
+	// controls using cycle as shift key
+	set_dispatch (track_l[0].message, &cycle.value, &track_l[0], track_l[0].action, &track_l[1], track_l[1].action);
+	set_dispatch (track_r[0].message, &cycle.value, &track_r[0], track_r[0].action, &track_r[1], track_r[1].action);
+	set_dispatch (rwd[0].message, &cycle.value, &rwd[0], rwd[0].action, &rwd[1], rwd[1].action);
+	set_dispatch (fwd[0].message, &cycle.value, &fwd[0], fwd[0].action, &fwd[1], fwd[1].action);
+	set_dispatch (marker_l[0].message, &cycle.value, &marker_l[0], marker_l[0].action, &marker_l[1], marker_l[1].action);
+	set_dispatch (marker_r[0].message, &cycle.value, &marker_r[0], marker_r[0].action, &marker_r[1], marker_r[1].action);
+
+	// channel controls using rec as shift key
+	for (i = 0; i<NB_CHANNEL; i++) {
+		set_dispatch (channel[i][0].slider.message, &channel[i][0].rec.value, &channel[i][0].slider, channel[i][0].slider.action, &channel[i][1].slider, channel[i][1].slider.action);
+		set_dispatch (channel[i][0].knob.message, &channel[i][0].rec.value, &channel[i][0].knob, channel[i][0].knob.action, &channel[i][1].knob, channel[i][1].knob.action);
+		set_dispatch (channel[i][0].solo.message, &channel[i][0].rec.value, &channel[i][0].solo, channel[i][0].solo.action, &channel[i][1].solo, channel[i][1].solo.action);
+		set_dispatch (channel[i][0].mute.message, &channel[i][0].rec.value, &channel[i][0].mute, channel[i][0].mute.action, &channel[i][1].mute, channel[i][1].mute.action);
+		// REC: take only value 0 into account
+		set_dispatch (channel[i][0].rec.message, &no_shift, &channel[i][0].rec, channel[i][0].rec.action, &channel[i][0].rec, channel[i][0].rec.action);
+	}
+}
+
+
 /* This example reads the configuration file 'example.cfg' and displays
  * some of its contents.
  */
@@ -116,6 +172,28 @@ void read_config (void)
 		fwd[i].led_off [0] = 0xB0;
 		fwd[i].led_off [1] = 0x2C;
 		fwd[i].led_off [2] = 0x00;
+
+		// marker_l button
+		marker_l[i].message [0] = 0xB0;
+		marker_l[i].message [1] = 0x3D;
+		marker_l[i].action = (i==0) ? &process_marker_l : &process_marker_l_shift;
+		marker_l[i].led_on [0] = 0xB0;
+		marker_l[i].led_on [1] = 0x3D;
+		marker_l[i].led_on [2] = 0x7F;
+		marker_l[i].led_off [0] = 0xB0;
+		marker_l[i].led_off [1] = 0x3D;
+		marker_l[i].led_off [2] = 0x00;
+
+		// marker_r button
+		marker_r[i].message [0] = 0xB0;
+		marker_r[i].message [1] = 0x3E;
+		marker_r[i].action = (i==0) ? &process_marker_r : &process_marker_r_shift;
+		marker_r[i].led_on [0] = 0xB0;
+		marker_r[i].led_on [1] = 0x3E;
+		marker_r[i].led_on [2] = 0x7F;
+		marker_r[i].led_off [0] = 0xB0;
+		marker_r[i].led_off [1] = 0x3E;
+		marker_r[i].led_off [2] = 0x00;
 	}
 
 	// cycle button
@@ -173,25 +251,6 @@ void read_config (void)
 	set.led_off [1] = 0x3C;
 	set.led_off [2] = 0x00;
 
-	// marker_l button
-	marker_l.message [0] = 0xB0;
-	marker_l.message [1] = 0x3D;
-	marker_l.action = &process_marker_l;
-	marker_l.led_on [0] = 0xB0;
-	marker_l.led_on [1] = 0x3D;
-	marker_l.led_on [2] = 0x7F;
-	marker_l.led_off [0] = 0xB0;
-	marker_l.led_off [1] = 0x3D;
-	marker_l.led_off [2] = 0x00;
-
-	// marker_r button
-	marker_r.message [0] = 0xB0;
-	marker_r.message [1] = 0x3E;
-	marker_r.action = &process_marker_r;
-	marker_r.led_on [0] = 0xB0;
-	marker_r.led_on [1] = 0x3E;
-	marker_r.led_on [2] = 0x7F;
-	marker_r.led_off [0] = 0xB0;
-	marker_r.led_off [1] = 0x3E;
-	marker_r.led_off [2] = 0x00;
+	// build dispatch table of incoming midi messages
+	build_dispatch ();
 }
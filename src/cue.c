@@ -0,0 +1,257 @@
+/** @file cue.c
+ *
+ * @brief Gapless song-to-song transitions: next song is cued on a second, pre-loaded player,
+ * which takes over from the current player on the same synth at the end of the current song (or at next bar on request).
+ * Switch is done from the player tick callback, ie. in the synth thread, so it happens within one audio block:
+ * the synth thread only silences the current player and starts the cued one; the main loop, which owns control state,
+ * then swaps the song and applies its context (see cue_switched ()).
+ *
+ */
+
+#include <stdatomic.h>
+#include "types.h"
+#include "globals.h"
+#include "config.h"
+#include "process.h"
+#include "utils.h"
+#include "gpio.h"
+#include "loader.h"
+#include "library.h"
+#include "sfpool.h"
+#include "smf.h"
+#include "section.h"
+#include "command.h"
+#include "mixer.h"
+#include "tempomap.h"
+#include "engine.h"
+#include "cue.h"
+
+#define NB_RETIRED		4		// max number of retired players waiting to be deleted
+
+enum { CUE_NONE, CUE_END, CUE_BAR, CUE_SWITCHED };	// cue modes: nothing cued, switch at end of song, switch at next bar, cued song started
+
+static atomic_int cue_mode = CUE_NONE;
+static engine_t* cued_player = NULL;	// player of the cued song, ready to play
+static int cued_num;						// song number of the cued song
+static song_t cued_song;					// saved context of the cued song, applied just before switch
+static smf_t* cued_smf = NULL;				// event table of the cued song
+static section_list_t cued_sections;		// sections of the cued song, with their snapshots, built when cueing
+static uint32_t end_tick;					// tick at which current song ends
+static int last_tick;						// tick of the previous tick callback, used to detect bar boundaries
+
+// players that have been replaced by a cued player, with their event tables and sections; they are deleted once done
+static engine_t* retired [NB_RETIRED];
+static smf_t* retired_smf [NB_RETIRED];
+static section_list_t retired_sections [NB_RETIRED];
+
+
+// playback callback of a retired player: drop all its events
+// player is stopped at switch, but it may still be in the block that is being played
+static int drop_midi_event (void *data, fluid_midi_event_t *event)
+{
+	return FLUID_OK;
+}
+
+
+// switch from current player to cued player
+// called from the tick callback of the current player, ie. in the synth thread
+// current player is silenced and cued player is started; the rest of the switch is done by the main loop
+static void switch_player ()
+{
+	// retired player does not send anything to the synth anymore; it is stopped, and its notes are released before the cued player starts
+	engine_set_tick_callback (player, NULL, NULL);
+	engine_set_playback_callback (player, drop_midi_event, NULL);
+	engine_stop (player);
+	// changes scheduled for the retired song are dropped
+	drop_mixer ();
+
+	engine_play (cued_player);
+	atomic_store (&cue_mode, CUE_SWITCHED);
+	push_command (CMD_FROM_SYNTH, CMD_SWITCH, NULL);
+}
+
+
+// keep current player as a retired player, deleted once done (see reap_players ())
+// if all retired players are still there, the oldest one is deleted now: delete_engine () waits for the audio callback to leave it
+static void retire_player ()
+{
+	int i;
+
+	reap_players ();
+	if (retired [NB_RETIRED - 1] != NULL) {
+		delete_engine (retired [0]);
+		smf_free (retired_smf [0]);
+		free_sections (&retired_sections [0]);
+		memmove (&retired [0], &retired [1], (NB_RETIRED - 1) * sizeof (engine_t *));
+		memmove (&retired_smf [0], &retired_smf [1], (NB_RETIRED - 1) * sizeof (smf_t *));
+		memmove (&retired_sections [0], &retired_sections [1], (NB_RETIRED - 1) * sizeof (section_list_t));
+		retired [NB_RETIRED - 1] = NULL;
+	}
+
+	// retired players are kept in order of retirement, oldest first
+	for (i = 0; retired [i] != NULL; i++);
+	retired [i] = player;
+	retired_smf [i] = song_smf;
+	retired_sections [i] = sections;
+}
+
+
+// end of switch to the cued song, once it has been started by the synth thread: swap current song and apply its context
+// called in the main loop; ticks of the cued player are ignored until it becomes the current player here (see handle_tick ())
+void cue_switched ()
+{
+	int id;
+
+	if (atomic_load (&cue_mode) != CUE_SWITCHED) return;
+
+	// retired player is deleted once done, with its event table and sections
+	retire_player ();
+
+	// new soundfont has been made resident by the loader: only bank routing is changed
+	if (new_sf2_num != current_sf2_num) {
+		if ((id = select_sf2 (new_sf2_num)) >= 0) {
+			sf2_id = id;
+			current_sf2_num = new_sf2_num;
+		}
+	}
+
+	// apply channel state of the cued song
+	player = cued_player;
+	song_smf = cued_smf;
+	cued_player = NULL;
+	cued_smf = NULL;
+	reset_song_context ();
+	apply_song (&cued_song);
+	// sections of the cued song are swapped in; a new list is allocated for next cued song
+	sections = cued_sections;
+	memset (&cued_sections, 0, sizeof (section_list_t));
+	reset_song_volume ();
+	reset_song_panning ();
+	current_midi_num = cued_num;
+
+	atomic_store (&cue_mode, CUE_NONE);
+	printf ("cue: song %02X:%02X started\n", cued_num / 256, cued_num % 256);
+}
+
+
+// called at each tick callback of the current player (see handle_tick ()): when a song is cued, switch at end of song, or at next bar
+// bars are the ones of the time signatures of the song, from its tempo map
+int cue_tick (int tick)
+{
+	int mode = atomic_load (&cue_mode);
+	int bar, last_bar, beat;
+
+	if ((mode == CUE_NONE) || (mode == CUE_SWITCHED)) return FLUID_OK;
+
+	if ((mode == CUE_BAR) && (last_tick >= 0)) {
+		tick_to_bar (&player->map, tick, &bar, &beat);
+		tick_to_bar (&player->map, last_tick, &last_bar, &beat);
+	}
+	else bar = last_bar = 0;
+
+	if (((mode == CUE_END) && ((uint32_t) tick >= end_tick)) || (bar != last_bar)) {
+		switch_player ();
+		return FLUID_OK;
+	}
+
+	last_tick = tick;
+	return FLUID_OK;
+}
+
+
+// delete retired players once they are done
+// shall not be called from the synth thread
+void reap_players ()
+{
+	int i, n = 0;
+
+	// retired players that are still playing are packed at the start, in order of retirement
+	for (i = 0; i < NB_RETIRED; i++) {
+		if (retired [i] == NULL) continue;
+		if (engine_get_status (retired [i]) != ENGINE_PLAYING) {
+			delete_engine (retired [i]);
+			smf_free (retired_smf [i]);
+			free_sections (&retired_sections [i]);
+		}
+		else {
+			retired [n] = retired [i];
+			retired_smf [n] = retired_smf [i];
+			retired_sections [n] = retired_sections [i];
+			n++;
+		}
+	}
+	for (i = n; i < NB_RETIRED; i++) {
+		retired [i] = NULL;
+		retired_smf [i] = NULL;
+	}
+}
+
+
+// cancel cued song, when current player is not playing anymore (stopped before the switch)
+// returns cued player if it is the player of song number num, with its event table in smf (ownership is given to the caller), NULL otherwise
+engine_t* uncue (int num, smf_t **smf)
+{
+	engine_t* p = NULL;
+
+	*smf = NULL;
+	// a cued song that has been started is not cued anymore, even if the main loop has not swapped it in yet
+	if ((atomic_load (&cue_mode) == CUE_NONE) || (atomic_load (&cue_mode) == CUE_SWITCHED)) return NULL;
+	atomic_store (&cue_mode, CUE_NONE);
+
+	if (cued_num == num) {
+		p = cued_player;
+		*smf = cued_smf;
+	}
+	else {
+		delete_engine (cued_player);
+		smf_free (cued_smf);
+	}
+	cued_player = NULL;
+	cued_smf = NULL;
+
+	return p;
+}
+
+
+// return TRUE if a song is cued
+int is_cued ()
+{
+	return (atomic_load (&cue_mode) != CUE_NONE);
+}
+
+
+// cue selected song while current song is playing: it will start at the end of current song
+// if a song is already cued, its switch is brought forward to the next bar
+// returns TRUE if a song is cued
+int cue_next ()
+{
+	midi_info_t info;
+
+	if (atomic_load (&cue_mode) == CUE_END) {
+		atomic_store (&cue_mode, CUE_BAR);
+		printf ("cue: switch at next bar\n");
+		return TRUE;
+	}
+	if (atomic_load (&cue_mode) != CUE_NONE) return TRUE;
+
+	reap_players ();
+
+	// get player prepared by the loader, and context of the song
+	if ((cued_player = take_player (new_midi_num, &cued_smf)) == NULL) return FALSE;
+	cued_num = new_midi_num;
+	read_song (cued_num, &cued_song);
+
+	// sections of the cued song and their snapshots are built now, not in the synth thread at switch
+	build_sections (&cued_sections, cued_smf, &cued_song);
+	free (cued_song.mark);
+	cued_song.mark = NULL;
+
+	// end of current song, from the library index
+	if (get_song_info (current_midi_num, &info) == TRUE) end_tick = info.ticks;
+	else end_tick = engine_get_total_ticks (player);
+	last_tick = -1;
+
+	atomic_store (&cue_mode, CUE_END);
+	printf ("cue: song %02X:%02X at end of song\n", cued_num / 256, cued_num % 256);
+	return TRUE;
+}
@@ -0,0 +1,12 @@
+/** @file cue.h
+ *
+ * @brief This file defines prototypes of functions inside cue.c
+ *
+ */
+
+int cue_next ();
+engine_t* uncue (int, smf_t **);
+int is_cued ();
+void reap_players ();
+int cue_tick (int);
+void cue_switched ();
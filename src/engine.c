@@ -0,0 +1,427 @@
+/** @file engine.c
+ *
+ * @brief Song engine: built-in midi sequencer, in place of the fluidsynth player. The event table of a song (see smf.c) is copied once
+ * into flat arrays (ticks, packed messages) and a tempo map (see tempomap.c), when the song is prepared by the loader; nothing is parsed or allocated
+ * during playback.
+ * Engines are driven by the audio callback (see process_engines ()): the period is rendered block by block, and before each block of
+ * the synth, events that are due are sent through the playback callback, so they are applied at the block they fall in, on the sample
+ * clock. Position is kept in ticks and advanced by the frames rendered, at the tempo of the tempo map or at the tempo set by the user:
+ * tempo changes do not touch the events. Seek is a binary search in the tick array.
+ * Other threads only post requests (play, stop, seek, tempo) with atomics; they are applied by the audio thread at the next block.
+ *
+ */
+
+#include <stdatomic.h>
+#include <unistd.h>
+#include "types.h"
+#include "globals.h"
+#include "config.h"
+#include "process.h"
+#include "utils.h"
+#include "gpio.h"
+#include "smf.h"
+#include "tempomap.h"
+#include "engine.h"
+
+#define ENGINE_BLOCK	64			// internal block of the synth: events sent to the synth are applied at this resolution
+#define MAX_BUFFERS		32			// max audio and effect buffers given to the audio callback, for block by block rendering
+
+static _Atomic (engine_t *) engines [NB_ENGINE];	// engines alive, driven by the audio callback
+static atomic_int rendering = FALSE;		// TRUE while the audio callback goes through engines
+
+
+// index of the first value of a sorted array at or after tick (n if there is none)
+static int lower_bound (uint32_t *a, int n, uint32_t tick)
+{
+	int lo = 0, hi = n, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (a [mid] < tick) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+
+// copy channel and sysex events of the event table into flat arrays; meta events are left out (tempo is in the tempo map)
+// returns TRUE if OK, FALSE if out of memory
+static int build_events (engine_t *e, smf_t *smf)
+{
+	smf_event_t *ev;
+	uint32_t len;
+	int i, n, size = 0;
+
+	n = (smf != NULL) ? smf->nb_event : 0;
+	for (i = 0; i < n; i++) {
+		if ((smf->event [i].status == 0xF0) || (smf->event [i].status == 0xF7)) size += smf->event [i].len;
+	}
+	e->tick = malloc ((n + 1) * sizeof (uint32_t));
+	e->msg = malloc ((n + 1) * sizeof (uint32_t));
+	e->sysex = malloc ((n + 1) * sizeof (int));
+	e->sysex_data = malloc (size + 1);
+	if ((e->tick == NULL) || (e->msg == NULL) || (e->sysex == NULL) || (e->sysex_data == NULL)) return FALSE;
+
+	e->sysex [0] = 0;
+	for (i = 0; i < n; i++) {
+		ev = &smf->event [i];
+		if (ev->status == 0xFF) continue;
+
+		e->tick [e->nb_event] = ev->tick;
+		if ((ev->status == 0xF0) || (ev->status == 0xF7)) {
+			// sysex is given to the synth without its trailing F7, as the fluidsynth player does
+			len = ev->len;
+			if ((len > 0) && (ev->meta [len - 1] == 0xF7)) len--;
+			memcpy (e->sysex_data + e->sysex [e->nb_sysex], ev->meta, len);
+			e->sysex [e->nb_sysex + 1] = e->sysex [e->nb_sysex] + len;
+			e->msg [e->nb_event] = 0xF0 | (e->nb_sysex << 8);
+			e->nb_sysex++;
+		}
+		else e->msg [e->nb_event] = ev->status | (ev->data [0] << 8) | (ev->data [1] << 16);
+		e->nb_event++;
+	}
+	return TRUE;
+}
+
+
+// create engine playing the event table of a song (an empty song if smf is NULL); events are copied, smf may be freed afterwards
+// engine is driven by the audio callback as soon as it is played
+// returns engine, or NULL if it could not be created
+engine_t* new_engine (fluid_synth_t *s, smf_t *smf)
+{
+	engine_t *e, *empty;
+	int i;
+
+	if ((e = calloc (1, sizeof (engine_t))) == NULL) return NULL;
+	e->synth = s;
+	e->total_ticks = ((smf != NULL) && (smf->nb_event > 0)) ? smf->event [smf->nb_event - 1].tick : 0;
+	e->rate = 44100.0;
+	fluid_settings_getnum (settings, "synth.sample-rate", &e->rate);
+	e->last_tick = -1;
+	atomic_init (&e->status, ENGINE_READY);
+	atomic_init (&e->seek, -1);
+	atomic_init (&e->release, FALSE);
+	atomic_init (&e->cur_tick, 0);
+
+	if ((build_events (e, smf) == FALSE) || (build_tempo_map (&e->map, smf) == FALSE) || ((e->event = new_fluid_midi_event ()) == NULL)) {
+		fprintf (stderr, "song engine creation failed\n");
+		delete_engine (e);
+		return NULL;
+	}
+	atomic_init (&e->cur_tempo, e->map.seg [0].tempo);
+
+	// register engine, so it is driven by the audio callback
+	for (i = 0; i < NB_ENGINE; i++) {
+		empty = NULL;
+		if (atomic_compare_exchange_strong (&engines [i], &empty, e)) return e;
+	}
+	fprintf (stderr, "too many song engines\n");
+	delete_engine (e);
+	return NULL;
+}
+
+
+// delete engine; it is first removed from the engines driven by the audio callback
+// shall not be called from the audio thread
+void delete_engine (engine_t *e)
+{
+	engine_t *expected;
+	int i;
+
+	if (e == NULL) return;
+	for (i = 0; i < NB_ENGINE; i++) {
+		expected = e;
+		if (atomic_compare_exchange_strong (&engines [i], &expected, NULL)) {
+			// the audio callback may still be going through it: wait for the end of its pass
+			while (atomic_load (&rendering)) usleep (100);
+			break;
+		}
+	}
+
+	if (e->event != NULL) delete_fluid_midi_event (e->event);
+	free (e->tick);
+	free (e->msg);
+	free (e->sysex);
+	free (e->sysex_data);
+	free_tempo_map (&e->map);
+	free (e);
+}
+
+
+// start or resume playback, from the current position or from the tick set by engine_seek ()
+int engine_play (engine_t *e)
+{
+	if (e == NULL) return FLUID_FAILED;
+	atomic_store (&e->status, ENGINE_PLAYING);
+	return FLUID_OK;
+}
+
+
+// stop playback; notes that are on are released by the audio thread at the next block, as the fluidsynth player does
+int engine_stop (engine_t *e)
+{
+	if (e == NULL) return FLUID_FAILED;
+	atomic_store (&e->release, TRUE);
+	atomic_store (&e->status, ENGINE_DONE);
+	return FLUID_OK;
+}
+
+
+// go to tick: sounds are stopped, and playback goes on from the first event at or after tick, at the next block
+// channel state at tick is not restored here (see apply_snapshot ())
+int engine_seek (engine_t *e, int tick)
+{
+	if ((e == NULL) || (tick < 0)) return FLUID_FAILED;
+	atomic_store (&e->seek, tick);
+	return FLUID_OK;
+}
+
+
+// set tempo, in us per quarter note, instead of the tempo of the song; 0 to follow the tempo of the song again
+int engine_set_tempo (engine_t *e, double tempo)
+{
+	if ((e == NULL) || (tempo < 0.0)) return FLUID_FAILED;
+	atomic_store (&e->map.external, (int) (tempo + 0.5));
+	return FLUID_OK;
+}
+
+
+// set tempo, in beats per minute, instead of the tempo of the song
+int engine_set_bpm (engine_t *e, double bpm)
+{
+	if ((e == NULL) || (bpm <= 0.0)) return FLUID_FAILED;
+	return engine_set_tempo (e, 60000000.0 / bpm);
+}
+
+
+// set callback of events; events are sent to the synth directly if callback is NULL
+int engine_set_playback_callback (engine_t *e, handle_midi_event_func_t callback, void *data)
+{
+	if (e == NULL) return FLUID_FAILED;
+	e->playback = callback;
+	e->playback_data = data;
+	return FLUID_OK;
+}
+
+
+// set callback called once per block with the position of the song, after the events of the block have been dispatched
+int engine_set_tick_callback (engine_t *e, handle_midi_tick_func_t callback, void *data)
+{
+	if (e == NULL) return FLUID_FAILED;
+	e->on_tick = callback;
+	e->tick_data = data;
+	return FLUID_OK;
+}
+
+
+// status of engine: ENGINE_READY, ENGINE_PLAYING or ENGINE_DONE
+int engine_get_status (engine_t *e)
+{
+	if (e == NULL) return ENGINE_DONE;
+	return atomic_load (&e->status);
+}
+
+
+// position of the song, in ticks
+int engine_get_current_tick (engine_t *e)
+{
+	int seek;
+
+	if (e == NULL) return FLUID_FAILED;
+	seek = atomic_load (&e->seek);
+	return (seek >= 0) ? seek : atomic_load (&e->cur_tick);
+}
+
+
+// length of the song, in ticks
+int engine_get_total_ticks (engine_t *e)
+{
+	if (e == NULL) return FLUID_FAILED;
+	return e->total_ticks;
+}
+
+
+// ticks per quarter note of the song
+int engine_get_division (engine_t *e)
+{
+	if (e == NULL) return FLUID_FAILED;
+	return e->map.division;
+}
+
+
+// tempo played, in us per quarter note: tempo set by the user, or tempo of the song at current position
+int engine_get_midi_tempo (engine_t *e)
+{
+	int tempo;
+
+	if (e == NULL) return FLUID_FAILED;
+	tempo = atomic_load (&e->map.external);
+	return (tempo > 0) ? tempo : atomic_load (&e->cur_tempo);
+}
+
+
+// tempo played, in beats per minute
+int engine_get_bpm (engine_t *e)
+{
+	int tempo;
+
+	if ((tempo = engine_get_midi_tempo (e)) <= 0) return FLUID_FAILED;
+	return (int) (60000000.0 / tempo);
+}
+
+
+// length of the song, in us, at the tempo played
+double engine_get_duration_us (engine_t *e)
+{
+	if (e == NULL) return 0.0;
+	return tick_to_us (&e->map, e->total_ticks);
+}
+
+
+// send event i to the playback callback, or to the synth
+static void dispatch_event (engine_t *e, int i)
+{
+	uint32_t m = e->msg [i];
+	int k;
+
+	fluid_midi_event_set_type (e->event, m & 0xF0);
+	if ((m & 0xFF) == 0xF0) {
+		k = m >> 8;
+		fluid_midi_event_set_sysex (e->event, e->sysex_data + e->sysex [k], e->sysex [k + 1] - e->sysex [k], FALSE);
+	}
+	else {
+		fluid_midi_event_set_channel (e->event, m & 0x0F);
+		// pitch bend is a single 14-bit value; for other events, data bytes are the two parameters of the midi event
+		if ((m & 0xF0) == 0xE0) fluid_midi_event_set_pitch (e->event, ((m >> 8) & 0x7F) | (((m >> 16) & 0x7F) << 7));
+		else {
+			fluid_midi_event_set_key (e->event, (m >> 8) & 0x7F);
+			fluid_midi_event_set_velocity (e->event, (m >> 16) & 0x7F);
+		}
+	}
+
+	if (e->playback != NULL) e->playback (e->playback_data, e->event);
+	else fluid_synth_handle_midi_event (e->synth, e->event);
+}
+
+
+// advance position by a number of frames, at the tempo set by the user or along the tempo map
+static void advance (engine_t *e, double frames)
+{
+	tempo_map_t *map = &e->map;
+	double tpf;
+	uint32_t next;
+	int external = atomic_load (&map->external);
+
+	while (frames > 0.0) {
+		// ticks per frame at current tempo
+		tpf = map->division * 1000000.0 / ((double) ((external > 0) ? external : map->seg [e->segment].tempo) * e->rate);
+
+		// next tempo change of the song is reached within the frames: go to it, and go on at its tempo
+		if (e->segment + 1 < map->nb) {
+			next = map->seg [e->segment + 1].tick;
+			if (e->pos + frames * tpf >= next) {
+				frames -= (next - e->pos) / tpf;
+				e->pos = next;
+				e->segment++;
+				continue;
+			}
+		}
+		e->pos += frames * tpf;
+		frames = 0.0;
+	}
+	atomic_store (&e->cur_tempo, map->seg [e->segment].tempo);
+}
+
+
+// play one block of frames: apply seek, dispatch events due at current position, call tick callback, then advance position
+// called by the audio thread, before the block is rendered
+static void run_engine (engine_t *e, int frames)
+{
+	int seek, tick;
+
+	// go to tick requested by engine_seek (); notes of the previous position are stopped, as the fluidsynth player does
+	if ((seek = atomic_exchange (&e->seek, -1)) >= 0) {
+		fluid_synth_all_sounds_off (e->synth, -1);
+		e->pos = seek;
+		e->next = lower_bound (e->tick, e->nb_event, seek);
+		e->segment = find_tempo_segment (&e->map, seek);
+		e->last_tick = -1;
+	}
+
+	// events at or before current position
+	tick = (int) e->pos;
+	while ((e->next < e->nb_event) && (e->tick [e->next] <= (uint32_t) tick)) dispatch_event (e, e->next++);
+	atomic_store (&e->cur_tick, tick);
+
+	if ((e->on_tick != NULL) && (tick != e->last_tick)) {
+		e->last_tick = tick;
+		e->on_tick (e->tick_data, tick);
+		// stopped by its tick callback (cued song switch): notes are released now, before the engine started by the callback plays
+		if (atomic_load (&e->status) != ENGINE_PLAYING) {
+			if (atomic_exchange (&e->release, FALSE)) fluid_synth_all_notes_off (e->synth, -1);
+			return;
+		}
+	}
+
+	// end of song: last event has been played
+	if ((e->next >= e->nb_event) && ((uint32_t) tick >= e->total_ticks)) {
+		atomic_store (&e->status, ENGINE_DONE);
+		return;
+	}
+	advance (e, frames);
+}
+
+
+// render len frames of the synth, and play engines that are playing
+// while an engine plays, the period is rendered block by block and events are dispatched before the block they fall in;
+// otherwise it is rendered at once
+// called by the audio callback, in place of fluid_synth_process () (same arguments)
+int process_engines (fluid_synth_t *s, int len, int nfx, float *fx [], int nout, float *out [])
+{
+	float *fx_block [MAX_BUFFERS], *out_block [MAX_BUFFERS];
+	float **fxp = fx, **outp = out;
+	engine_t *e;
+	int i, k, n, done, playing, split, res = FLUID_OK;
+
+	// no effect buffers (eg. ALSA driver): effects are mixed into the dry buffers, as fluidsynth drivers do
+	// with nfx = 0, fluid_synth_process () would not render reverb and chorus at all
+	if (fx == NULL) {
+		nfx = nout;
+		fx = fxp = out;
+	}
+
+	// more buffers than expected: period is not split, and events are dispatched once per period
+	split = (nfx <= MAX_BUFFERS) && (nout <= MAX_BUFFERS);
+
+	atomic_store (&rendering, TRUE);
+	for (done = 0; done < len; done += n) {
+		playing = FALSE;
+		for (i = 0; i < NB_ENGINE; i++) {
+			e = atomic_load (&engines [i]);
+			if ((e != NULL) && (atomic_load (&e->status) == ENGINE_PLAYING)) playing = TRUE;
+		}
+		n = (playing && split && (len - done > ENGINE_BLOCK)) ? ENGINE_BLOCK : len - done;
+
+		// engines stopped since the last block: release their notes, before other engines dispatch the events of the block
+		for (i = 0; i < NB_ENGINE; i++) {
+			e = atomic_load (&engines [i]);
+			if ((e != NULL) && atomic_exchange (&e->release, FALSE)) fluid_synth_all_notes_off (e->synth, -1);
+		}
+
+		// a tick callback may start another engine (cued song): it is played from the next block
+		for (i = 0; playing && (i < NB_ENGINE); i++) {
+			e = atomic_load (&engines [i]);
+			if ((e != NULL) && (atomic_load (&e->status) == ENGINE_PLAYING)) run_engine (e, n);
+		}
+
+		if (split) {
+			for (k = 0; k < nfx; k++) fx_block [k] = fx [k] + done;
+			for (k = 0; k < nout; k++) out_block [k] = out [k] + done;
+			fxp = (nfx > 0) ? fx_block : NULL;
+			outp = out_block;
+		}
+		if (fluid_synth_process (s, n, nfx, fxp, nout, outp) != FLUID_OK) res = FLUID_FAILED;
+	}
+	atomic_store (&rendering, FALSE);
+	return res;
+}
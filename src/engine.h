@@ -0,0 +1,23 @@
+/** @file engine.h
+ *
+ * @brief This file defines prototypes of functions inside engine.c
+ *
+ */
+
+engine_t* new_engine (fluid_synth_t *, smf_t *);
+void delete_engine (engine_t *);
+int engine_play (engine_t *);
+int engine_stop (engine_t *);
+int engine_seek (engine_t *, int);
+int engine_set_tempo (engine_t *, double);
+int engine_set_bpm (engine_t *, double);
+int engine_set_playback_callback (engine_t *, handle_midi_event_func_t, void *);
+int engine_set_tick_callback (engine_t *, handle_midi_tick_func_t, void *);
+int engine_get_status (engine_t *);
+int engine_get_current_tick (engine_t *);
+int engine_get_total_ticks (engine_t *);
+int engine_get_division (engine_t *);
+int engine_get_midi_tempo (engine_t *);
+int engine_get_bpm (engine_t *);
+double engine_get_duration_us (engine_t *);
+int process_engines (fluid_synth_t *, int, int, float *[], int, float *[]);
@@ -10,7 +10,7 @@
 extern fluid_settings_t* settings;
 extern fluid_synth_t* synth;
 extern fluid_midi_driver_t* mdriver;
-extern fluid_player_t* player;
+extern engine_t* player;		// song engine of the current song (see engine.c)
 extern fluid_audio_driver_t* adriver;
 
 
@@ -22,23 +22,32 @@ extern uint64_t previous_led;  // time when switch was set as on
 /* load (midi and SF2 files) & play (midi file) globals */
 extern int midi_load, sf2_load;
 // file number for midi and sf2 files
-extern uint8_t new_midi_num, new_sf2_num;				// new file number to be loaded
-extern uint8_t current_midi_num, current_sf2_num;		// current file number that is currently loaded
+extern int new_midi_num;							// new song number to be loaded (bank * 256 + index in bank)
+extern uint8_t new_sf2_num;						// new soundfont number to be loaded
+extern int current_midi_num;						// current song number that is currently loaded
+extern uint8_t current_sf2_num;					// current soundfont number that is currently loaded
 
 extern int sf2_id;		// id of sf2 file currently loaded
 
+/* latency instrumentation */
+extern _Atomic uint64_t play_us;		// time when play was pressed; 0 once first note has been played
+
 /* volume and BPM */
 extern int bpm;
 extern int initial_bpm;
 extern int volume;
 
+/* mixer: CC7 and CC10 of the song weighted by slider and knob position, indexed on [slider or knob][CC value] (see mixer.c) */
+extern uint8_t volume_lut [128][128];
+extern uint8_t panning_lut [128][128];
+
 /* beat */
 extern uint64_t now;       // time now
 extern uint64_t previous;  // time when "beat" key was last pressed
 
 /* markers */
-extern int marker [NB_MARKER];     // table of time markers in the song
-extern int marker_pos;             // position of marker selected by < > in the table
+extern section_list_t sections;    // sections of current song (midi file markers and time markers set by the user), sorted by tick
+extern smf_t *song_smf;            // event table of current song (NULL if not available)
 
 /* definition of the MIDI controler controls */
 extern channel_t channel [NB_CHANNEL] [NB_RECSHIFT];		// 8 channel control * 2 (without shift and with shift; REC key)
@@ -48,4 +57,9 @@ extern button_t track_r [NB_CYCSHIFT];			// track right button; could be used wi
 extern button_t rwd [NB_CYCSHIFT];			    // rewind: could be used with shift
 extern button_t fwd [NB_CYCSHIFT];			    // forward: could be used with shift
 extern button_t play, stop, record;
-extern button_t set, marker_l, marker_r;
+extern button_t set;
+extern button_t marker_l [NB_CYCSHIFT];			// marker left: could be used with shift (cycle) for previous bank
+extern button_t marker_r [NB_CYCSHIFT];			// marker right: could be used with shift (cycle) for next bank
+
+/* dispatch table of incoming midi messages, indexed on status nibble and controller number */
+extern dispatch_t dispatch [NB_STATUS] [NB_CONTROL];
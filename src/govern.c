@@ -0,0 +1,215 @@
+/** @file govern.c
+ *
+ * @brief CPU governor: synth cpu load, active voices and thermal state of the SoC are sampled periodically from the main loop.
+ * Under sustained load, synthesis quality is lowered one level at a time (linear interpolation, chorus off, reverb off, reduced polyphony);
+ * it is restored one level at a time once headroom has come back for a while, and if what it costs fits in the headroom. Each change of level is logged with the song being played.
+ * The load profile of a song (see profile.c) gives its polyphony and a minimum quality level up front, when the song is loaded.
+ *
+ */
+
+#include <stdatomic.h>
+#include <sys/timerfd.h>
+#include "types.h"
+#include "globals.h"
+#include "config.h"
+#include "process.h"
+#include "utils.h"
+#include "gpio.h"
+#include "loop.h"
+#include "govern.h"
+
+#define GOV_SAMPLE_MS	250			// sampling period of the governor, in ms
+#define GOV_HIGH		80.0		// cpu load (%) above which quality is lowered...
+#define GOV_LOWER_MS	750			// ...if it has stayed there for this time, in ms: a single spike does not lower quality
+#define GOV_LOW			50.0		// cpu load (%) below which quality may be restored...
+#define GOV_RESTORE_S	10			// ...if it has stayed there for this time, in seconds
+#define GOV_TEMP_HIGH	80000		// SoC temperature (millidegree) above which quality is lowered; firmware soft limit is 80 C on Pi 3
+#define GOV_TEMP_LOW	75000		// SoC temperature below which quality may be restored
+#define GOV_POLY		0.6			// polyphony of reduced levels, as a ratio of full polyphony
+#define THERMAL_FILE	"/sys/class/thermal/thermal_zone0/temp"
+#define THROTTLE_FILE	"/sys/devices/platform/soc/soc:firmware/get_throttled"
+#define THROTTLE_NOW	0xF			// under-voltage, frequency capped, throttled or soft temperature limit, right now
+
+// degradation levels: each level keeps the degradations of the previous ones
+// chorus and reverb are a fixed cost per block, which is shed without cutting notes: they go before polyphony
+enum { GOV_FULL, GOV_LINEAR, GOV_NOCHORUS, GOV_NOREVERB, GOV_POLYPHONY, NB_GOV_LEVEL };
+static char *level_name [NB_GOV_LEVEL] = { "full quality", "linear interpolation", "chorus off", "reverb off", "reduced polyphony" };
+
+static int level = GOV_FULL;		// current degradation level
+static int min_level = GOV_FULL;	// level given by the profile of the song: quality is not restored above it
+static atomic_int pending = -1;		// profile of a new song (polyphony * 16 + level), applied at next sample; -1 if none
+static int full_polyphony = 256;	// polyphony of full quality
+static int chorus = TRUE;			// chorus and reverb of full quality
+static int reverb = TRUE;
+static int low_samples = 0;			// consecutive samples with headroom
+static int high_samples = 0;		// consecutive samples over the limits
+static double shed [NB_GOV_LEVEL];	// cpu load (%) shed by chorus off and reverb off, measured on the sample after the change
+static double load_before = 0.0;	// cpu load on the sample a level was lowered, and that level (GOV_FULL if none)
+static int lowered = GOV_FULL;
+static int gov_timer = -1;
+
+
+// read an integer from a sysfs file; base is 10 or 16
+// returns TRUE if OK, FALSE if file is not available (eg. not a Pi)
+static int read_sys (char *name, int base, long *value)
+{
+	FILE *fp;
+	char s [32];
+
+	if ((fp = fopen (name, "rt")) == NULL) return FALSE;
+	if (fgets (s, sizeof (s), fp) == NULL) {
+		fclose (fp);
+		return FALSE;
+	}
+	fclose (fp);
+	*value = strtol (s, NULL, base);
+	return TRUE;
+}
+
+
+// set synthesis quality of a level
+static void set_level (int l)
+{
+	fluid_synth_set_interp_method (synth, -1, (l >= GOV_LINEAR) ? FLUID_INTERP_LINEAR : FLUID_INTERP_DEFAULT);
+	fluid_synth_set_polyphony (synth, (l >= GOV_POLYPHONY) ? (int) (full_polyphony * GOV_POLY) : full_polyphony);
+	fluid_synth_chorus_on (synth, -1, (l >= GOV_NOCHORUS) ? FALSE : chorus);
+	fluid_synth_reverb_on (synth, -1, (l >= GOV_NOREVERB) ? FALSE : reverb);
+	level = l;
+}
+
+
+// apply profile of a song: polyphony of full quality (0 for the polyphony of settings), and minimum quality level
+// level of the profile is a ceiling of quality: a lower quality reached under load is kept, and restored with headroom as usual
+static void apply_profile (int polyphony, int l)
+{
+	if (polyphony <= 0) fluid_settings_getint (settings, "synth.polyphony", &polyphony);
+	full_polyphony = polyphony;
+	min_level = l;
+	set_level ((level > l) ? level : l);
+}
+
+
+// main loop handler for governor timer: sample load and thermal state, change level if required
+int governor_event (int fd)
+{
+	uint64_t expirations;
+	double load;
+	long temp = 0, throttled = 0;
+	int voices, high, low, l;
+	char *reason = "";
+
+	// acknowledge timer
+	read (fd, &expirations, sizeof (expirations));
+
+	// profile of a new song
+	if ((l = atomic_exchange (&pending, -1)) >= 0) {
+		apply_profile (l / 16, l % 16);
+		low_samples = high_samples = 0;
+		lowered = GOV_FULL;
+		printf ("governor: song %03X, polyphony %d, %s\n", current_midi_num, fluid_synth_get_polyphony (synth), level_name [level]);
+	}
+
+	load = fluid_synth_get_cpu_load (synth);
+	voices = fluid_synth_get_active_voice_count (synth);
+	read_sys (THERMAL_FILE, 10, &temp);
+	read_sys (THROTTLE_FILE, 16, &throttled);
+
+	high = (load > GOV_HIGH) || (temp > GOV_TEMP_HIGH) || (throttled & THROTTLE_NOW);
+	low = (load < GOV_LOW) && (temp < GOV_TEMP_LOW) && !(throttled & THROTTLE_NOW);
+
+	// load shed by the effect switched off on the previous sample
+	if (lowered != GOV_FULL) shed [lowered] = (load_before > load) ? load_before - load : 0.0;
+	lowered = GOV_FULL;
+
+	// polyphony is restored only if the voices that would come back fit in the headroom
+	if (low && (level == GOV_POLYPHONY) && (voices >= (int) (full_polyphony * GOV_POLY)))
+		low = (load / GOV_POLY < GOV_HIGH);
+	// chorus and reverb only if their cost fits in the headroom: otherwise they would be switched on and off again and again
+	if (low && ((level == GOV_NOCHORUS) || (level == GOV_NOREVERB)))
+		low = (load + shed [level] < GOV_HIGH);
+
+	// one level down once over the limits for GOV_LOWER_MS; the next level down needs as long again
+	l = level;
+	if (!high) high_samples = 0;
+	else if ((++high_samples >= GOV_LOWER_MS / GOV_SAMPLE_MS) && (level < NB_GOV_LEVEL - 1)) {
+		l = level + 1;
+		reason = (throttled & THROTTLE_NOW) ? "throttled" : ((temp > GOV_TEMP_HIGH) ? "temperature" : "cpu load");
+		high_samples = 0;
+		if ((l == GOV_NOCHORUS) || (l == GOV_NOREVERB)) {
+			load_before = load;
+			lowered = l;
+		}
+	}
+	if (high || !low) low_samples = 0;
+	else if ((++low_samples >= GOV_RESTORE_S * 1000 / GOV_SAMPLE_MS) && (level > min_level)) {
+		l = level - 1;
+		reason = "headroom";
+		low_samples = 0;
+	}
+
+	if (l != level) {
+		set_level (l);
+		printf ("governor: %s (%s: cpu load %.0f%%, %d voices, %ld.%ld C, throttled 0x%lx), song %03X, soundfont %02X\n",
+			level_name [l], reason, load, voices, temp / 1000, (temp % 1000) / 100, throttled, current_midi_num, current_sf2_num);
+	}
+	return TRUE;
+}
+
+
+// start governor: full quality is the quality set in settings when the synth has been created
+// returns TRUE if OK, FALSE otherwise
+int init_governor ()
+{
+	struct itimerspec its;
+
+	full_polyphony = fluid_synth_get_polyphony (synth);
+	fluid_settings_getint (settings, "synth.chorus.active", &chorus);
+	fluid_settings_getint (settings, "synth.reverb.active", &reverb);
+	level = GOV_FULL;
+	min_level = GOV_FULL;
+	low_samples = high_samples = 0;
+	memset (shed, 0, sizeof (shed));
+	lowered = GOV_FULL;
+
+	gov_timer = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (gov_timer < 0) {
+		fprintf (stderr, "governor timer creation failed\n");
+		return FALSE;
+	}
+	memset (&its, 0, sizeof (its));
+	its.it_value.tv_nsec = GOV_SAMPLE_MS * 1000000L;
+	its.it_interval.tv_nsec = GOV_SAMPLE_MS * 1000000L;
+	timerfd_settime (gov_timer, 0, &its, NULL);
+	return add_loop_fd (gov_timer, governor_event);
+}
+
+
+// set polyphony of full quality (0 for the polyphony of settings) and degradation level, right now
+// level is also the minimum quality level, until next call
+// returns TRUE if OK, FALSE if level does not exist
+int set_governor_level (int polyphony, int l)
+{
+	if ((l < GOV_FULL) || (l >= NB_GOV_LEVEL)) return FALSE;
+	if (polyphony <= 0) fluid_settings_getint (settings, "synth.polyphony", &polyphony);
+	full_polyphony = polyphony;
+	min_level = l;
+	set_level (l);
+	return TRUE;
+}
+
+
+// set profile of the song being loaded: polyphony (0 for the polyphony of settings) and minimum quality level
+// may be called from any thread; profile is applied by the governor at its next sample
+void set_governor_profile (int polyphony, int l)
+{
+	if (polyphony < 0) polyphony = 0;
+	if ((l < GOV_FULL) || (l >= NB_GOV_LEVEL)) l = GOV_FULL;
+	atomic_store (&pending, polyphony * 16 + l);
+}
+
+
+// current degradation level, 0 for full quality
+int get_governor_level ()
+{
+	return level;
+}
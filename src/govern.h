@@ -0,0 +1,11 @@
+/** @file govern.h
+ *
+ * @brief This file defines prototypes of functions inside govern.c
+ *
+ */
+
+int governor_event (int);
+int init_governor ();
+int set_governor_level (int, int);
+void set_governor_profile (int, int);
+int get_governor_level ();
@@ -1,15 +1,73 @@
 /** @file gpio.c
  *
  * @brief This is the file driven gpio / tap-tempo / beat switch related functions.
+ * Switch and LED are driven by a backend: pigpiod (callback_ex ticks), Linux GPIO character device (libgpiod v2, kernel time stamps and debounce),
+ * or a simulation replaying a trace file. All backends give presses of the switch time stamped in us, on the same clock as micros ().
  *
  */
 
+#define _GNU_SOURCE		// for pipe2
+#include <fcntl.h>
+#include <sys/timerfd.h>
 #include "types.h"
 #include "globals.h"
 #include "config.h"
 #include "process.h"
 #include "utils.h"
 #include "gpio.h"
+#include "loop.h"
+#include "engine.h"
+#include "tempo.h"
+#ifdef USE_GPIOD
+#include <gpiod.h>
+#endif
+
+
+static gpio_backend_t *backend = NULL;	// backend in use; NULL if GPIO is not available
+static int led_timer = -1;		// timerfd used to turn LED off after TIMEON_US
+static uint64_t last_edge = 0;	// time stamp of the last press taken into account, for anti-bouncing
+
+
+/*******************/
+/* pigpiod backend */
+/*******************/
+
+#ifndef NO_PIGPIO
+
+static int switch_pipe [2] = { -1, -1 };	// pigpiod callback thread writes switch edges to [1], main loop reads them from [0]
+static int switch_cb = -1;		// id of pigpiod callback on the switch pin
+static uint64_t ref_us;			// time (micros ()) corresponding to pigpiod tick ref_tick
+static uint32_t ref_tick;
+
+
+// pigpiod callback, called from pigpiod thread every time switch goes to LOW (ie. is pressed)
+// only forward the edge tick to the main loop, all processing is done there
+static void switch_callback (int pi, unsigned gpio, unsigned level, uint32_t tick, void *userdata)
+{
+	// pigpiod also calls back with level 2 on watchdog timeout: ignore it
+	if (level != 0) return;
+	write (switch_pipe [1], &tick, sizeof (tick));
+}
+
+
+// find correspondence between pigpiod ticks and micros (): keep the sample with the shortest round trip to the deamon
+static void sync_pigpiod_clock ()
+{
+	uint64_t a, b, best = (uint64_t) -1;
+	uint32_t tick;
+	int i;
+
+	for (i = 0; i < 5; i++) {
+		a = micros ();
+		tick = get_current_tick (gpio_deamon);
+		b = micros ();
+		if (b - a < best) {
+			best = b - a;
+			ref_us = (a + b) / 2;
+			ref_tick = tick;
+		}
+	}
+}
 
 
 // you need to have root priviledges for it to work
@@ -33,13 +91,22 @@ int init_gpio ()
 }
 */
 
-int init_gpio ()
+// close both ends of the switch pipe
+static void close_pipe ()
+{
+	if (switch_pipe [0] >= 0) close (switch_pipe [0]);
+	if (switch_pipe [1] >= 0) close (switch_pipe [1]);
+	switch_pipe [0] = switch_pipe [1] = -1;
+}
+
+
+static int pigpiod_open (char *arg)
 {
 	gpio_deamon = pigpio_start(0,0);		// connect to localhost on port 8888
 
 	if (gpio_deamon < 0) {
     	fprintf(stderr, "pigpio initialisation failed\n");
-    	return OFF;
+    	return -1;
 	}
 
 	/* Set GPIO modes */
@@ -49,7 +116,48 @@ int init_gpio ()
 	set_mode (gpio_deamon, SWITCH_GPIO, PI_INPUT);
 	set_pull_up_down (gpio_deamon, SWITCH_GPIO, PI_PUD_UP);	// Sets a pull-up
 	// benefits of pull-up is that way, no voltage are input in the pins; pins are only put to GND
-	return ON;
+	// level shall be steady for DEBOUNCE_US before an edge is reported: contact bounces are filtered by the deamon
+	set_glitch_filter (gpio_deamon, SWITCH_GPIO, DEBOUNCE_US);
+
+	// switch edges are notified by pigpiod and forwarded to the main loop through a pipe
+	if (pipe2 (switch_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+		fprintf(stderr, "switch pipe creation failed\n");
+		pigpio_stop (gpio_deamon);
+		return -1;
+	}
+
+	sync_pigpiod_clock ();
+	switch_cb = callback_ex (gpio_deamon, SWITCH_GPIO, FALLING_EDGE, switch_callback, NULL);
+	if (switch_cb < 0) {
+		fprintf(stderr, "pigpio callback initialisation failed\n");
+		pigpio_stop (gpio_deamon);
+		close_pipe ();
+		return -1;
+	}
+	return switch_pipe [0];
+}
+
+
+// edge tick is the time of the level change seen by the deamon, in us; convert it to micros () clock
+static int pigpiod_read_edge (uint64_t *t)
+{
+	uint32_t tick;
+
+	if (read (switch_pipe [0], &tick, sizeof (tick)) != sizeof (tick)) return FALSE;
+
+	// ticks wrap every 72 minutes: correspondence is refreshed if it is too old to compute a signed difference
+	if (micros () - ref_us > 30 * 60 * 1000000ULL) sync_pigpiod_clock ();
+	*t = ref_us + (int32_t) (tick - ref_tick);
+	ref_us = *t;
+	ref_tick = tick;
+	return TRUE;
+}
+
+
+static void pigpiod_led (int on)
+{
+//	gpioWrite (LED_GPIO, on);
+	gpio_write (gpio_deamon, LED_GPIO, on);
 }
 
 
@@ -62,40 +170,316 @@ int kill_gpio ()
 }
 */
 
+static void pigpiod_close ()
+{
+	if (switch_cb >= 0) callback_cancel (switch_cb);
+	switch_cb = -1;
+	// pipe is closed once the deamon connection is stopped: the callback thread does not write to it anymore
+	pigpio_stop (gpio_deamon);
+	close_pipe ();
+}
+
+static gpio_backend_t pigpiod_backend = { "pigpiod", pigpiod_open, pigpiod_read_edge, pigpiod_led, pigpiod_close };
+
+#endif
+
+
+/*****************************************/
+/* GPIO character device backend (gpiod) */
+/*****************************************/
+
+#ifdef USE_GPIOD
+
+#define GPIOD_CHIP		"/dev/gpiochip0"
+#define NB_GPIOD_EVENTS	16
+
+static struct gpiod_chip *chip = NULL;
+static struct gpiod_line_request *request = NULL;
+static struct gpiod_edge_event_buffer *events = NULL;
+static int nb_events = 0;		// events read in buffer
+static int next_event = 0;		// next event of buffer to be returned
+
+
+// request switch line with falling edge detection, kernel debounce and time stamps on CLOCK_MONOTONIC, and LED line as output
+// arg is the path of the gpio chip (GPIOD_CHIP if NULL)
+static int gpiod_open (char *arg)
+{
+	struct gpiod_line_settings *in = NULL, *out = NULL;
+	struct gpiod_line_config *config = NULL;
+	struct gpiod_request_config *req_config = NULL;
+	unsigned int switch_line = SWITCH_GPIO, led_line = LED_GPIO;
+
+	if ((chip = gpiod_chip_open ((arg != NULL) ? arg : GPIOD_CHIP)) == NULL) {
+		fprintf (stderr, "gpio chip %s cannot be opened\n", (arg != NULL) ? arg : GPIOD_CHIP);
+		return -1;
+	}
+
+	in = gpiod_line_settings_new ();
+	out = gpiod_line_settings_new ();
+	config = gpiod_line_config_new ();
+	req_config = gpiod_request_config_new ();
+	events = gpiod_edge_event_buffer_new (NB_GPIOD_EVENTS);
+	if ((in == NULL) || (out == NULL) || (config == NULL) || (req_config == NULL) || (events == NULL)) goto error;
+
+	gpiod_line_settings_set_direction (in, GPIOD_LINE_DIRECTION_INPUT);
+	gpiod_line_settings_set_bias (in, GPIOD_LINE_BIAS_PULL_UP);
+	gpiod_line_settings_set_edge_detection (in, GPIOD_LINE_EDGE_FALLING);
+	gpiod_line_settings_set_debounce_period_us (in, DEBOUNCE_US);
+	gpiod_line_settings_set_event_clock (in, GPIOD_LINE_CLOCK_MONOTONIC);
+
+	gpiod_line_settings_set_direction (out, GPIOD_LINE_DIRECTION_OUTPUT);
+	gpiod_line_settings_set_output_value (out, GPIOD_LINE_VALUE_INACTIVE);		// at start, LED is off
+
+	if (gpiod_line_config_add_line_settings (config, &switch_line, 1, in) < 0) goto error;
+	if (gpiod_line_config_add_line_settings (config, &led_line, 1, out) < 0) goto error;
+	gpiod_request_config_set_consumer (req_config, "syntwo");
+
+	request = gpiod_chip_request_lines (chip, req_config, config);
+	if (request == NULL) goto error;
+
+	gpiod_line_settings_free (in);
+	gpiod_line_settings_free (out);
+	gpiod_line_config_free (config);
+	gpiod_request_config_free (req_config);
+	return gpiod_line_request_get_fd (request);
+
+error:
+	fprintf (stderr, "gpio lines request failed\n");
+	gpiod_line_settings_free (in);
+	gpiod_line_settings_free (out);
+	gpiod_line_config_free (config);
+	gpiod_request_config_free (req_config);
+	gpiod_edge_event_buffer_free (events);
+	events = NULL;
+	gpiod_chip_close (chip);
+	chip = NULL;
+	return -1;
+}
+
+
+// edge time stamp is given by the kernel, in ns on CLOCK_MONOTONIC
+static int gpiod_read_edge (uint64_t *t)
+{
+	struct gpiod_edge_event *ev;
+
+	while (1) {
+		// read new events only if some are pending, so the main loop never blocks here
+		if (next_event >= nb_events) {
+			if (gpiod_line_request_wait_edge_events (request, 0) <= 0) return FALSE;
+			nb_events = gpiod_line_request_read_edge_events (request, events, NB_GPIOD_EVENTS);
+			next_event = 0;
+			if (nb_events <= 0) return FALSE;
+		}
+		ev = gpiod_edge_event_buffer_get_event (events, next_event++);
+		if (gpiod_edge_event_get_event_type (ev) == GPIOD_EDGE_EVENT_FALLING_EDGE) {
+			*t = gpiod_edge_event_get_timestamp_ns (ev) / 1000;
+			return TRUE;
+		}
+	}
+}
+
+
+static void gpiod_led (int on)
+{
+	gpiod_line_request_set_value (request, LED_GPIO, on ? GPIOD_LINE_VALUE_ACTIVE : GPIOD_LINE_VALUE_INACTIVE);
+}
+
+
+static void gpiod_close ()
+{
+	if (request != NULL) gpiod_line_request_release (request);
+	if (events != NULL) gpiod_edge_event_buffer_free (events);
+	if (chip != NULL) gpiod_chip_close (chip);
+	request = NULL;
+	events = NULL;
+	chip = NULL;
+}
+
+static gpio_backend_t gpiod_backend = { "gpiod", gpiod_open, gpiod_read_edge, gpiod_led, gpiod_close };
+
+#endif
+
+
+/**********************/
+/* simulation backend */
+/**********************/
+
+static uint64_t *trace = NULL;		// times of presses, in us from start of simulation
+static int nb_trace = 0;
+static int next_trace = 0;
+static uint64_t trace_start;		// start of simulation (micros ())
+static int trace_timer = -1;		// timerfd expiring at next press of the trace
+
+
+// arm trace timer at next press of the trace (absolute time on CLOCK_MONOTONIC, same clock as micros ())
+// returns TRUE if OK, FALSE if timer could not be set
+static int arm_trace ()
+{
+	struct itimerspec its;
+	uint64_t t;
+
+	memset (&its, 0, sizeof (its));
+	if (next_trace < nb_trace) {
+		t = trace_start + trace [next_trace];
+		its.it_value.tv_sec = t / 1000000;
+		its.it_value.tv_nsec = (t % 1000000) * 1000;
+	}
+	return (timerfd_settime (trace_timer, TFD_TIMER_ABSTIME, &its, NULL) == 0);
+}
+
+
+// arg is the trace file: one press per line, time in us from start of simulation (increasing); lines starting with # are comments
+static int sim_open (char *arg)
+{
+	FILE *fp;
+	char line [100];
+	uint64_t *p;
+
+	if ((arg == NULL) || ((fp = fopen (arg, "rt")) == NULL)) {
+		fprintf (stderr, "gpio trace file cannot be opened\n");
+		return -1;
+	}
+	while (fgets (line, sizeof (line), fp) != NULL) {
+		if ((line [0] == '#') || (line [0] == '\n')) continue;
+		if ((nb_trace % 256) == 0) {
+			if ((p = realloc (trace, (nb_trace + 256) * sizeof (uint64_t))) == NULL) break;
+			trace = p;
+		}
+		trace [nb_trace++] = strtoull (line, NULL, 10);
+	}
+	fclose (fp);
+
+	trace_start = micros ();
+	next_trace = 0;
+	trace_timer = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if ((trace_timer < 0) || (arm_trace () == FALSE)) {
+		fprintf (stderr, "gpio trace timer creation failed\n");
+		if (trace_timer >= 0) close (trace_timer);
+		free (trace);
+		trace = NULL;
+		nb_trace = 0;
+		trace_timer = -1;
+		return -1;
+	}
+	printf ("gpio: replaying %d presses from %s\n", nb_trace, arg);
+	return trace_timer;
+}
+
+
+// presses of the trace are time stamped with their exact time in the trace
+static int sim_read_edge (uint64_t *t)
+{
+	uint64_t expirations;
+
+	read (trace_timer, &expirations, sizeof (expirations));
+	if ((next_trace < nb_trace) && (trace_start + trace [next_trace] <= micros ())) {
+		*t = trace_start + trace [next_trace++];
+		return TRUE;
+	}
+	arm_trace ();
+	return FALSE;
+}
+
+
+static void sim_led (int on)
+{
+}
+
+
+static void sim_close ()
+{
+	if (trace_timer >= 0) close (trace_timer);
+	free (trace);
+	trace = NULL;
+	trace_timer = -1;
+}
+
+static gpio_backend_t sim_backend = { "sim", sim_open, sim_read_edge, sim_led, sim_close };
+
+
+/***************/
+/* GPIO layer  */
+/***************/
+
+// init backend given by spec: "pigpiod", "gpiod[:chip]" or "sim:trace_file" (NULL for default, pigpiod)
+// returns ON if GPIO is available, OFF otherwise
+int init_gpio (char *spec)
+{
+	char name [20];
+	char *arg = NULL;
+	int fd;
+
+	strcpy (name, "pigpiod");
+	if (spec != NULL) {
+		strncpy (name, spec, sizeof (name) - 1);
+		name [sizeof (name) - 1] = 0;
+		if (strchr (name, ':') != NULL) *strchr (name, ':') = 0;
+		if (strchr (spec, ':') != NULL) arg = strchr (spec, ':') + 1;
+	}
+
+	backend = NULL;
+#ifndef NO_PIGPIO
+	if (strcmp (name, pigpiod_backend.name) == 0) backend = &pigpiod_backend;
+#endif
+#ifdef USE_GPIOD
+	if (strcmp (name, gpiod_backend.name) == 0) backend = &gpiod_backend;
+#endif
+	if (strcmp (name, sim_backend.name) == 0) backend = &sim_backend;
+	if (backend == NULL) {
+		fprintf (stderr, "gpio backend %s not available\n", name);
+		return OFF;
+	}
+
+	// LED is turned off by a timer; this way the main loop sleeps until something actually happens
+	if ((fd = backend->open (arg)) < 0) {
+		backend = NULL;
+		return OFF;
+	}
+	led_timer = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (led_timer < 0) {
+		fprintf(stderr, "LED timer creation failed\n");
+		backend->close ();
+		backend = NULL;
+		return OFF;
+	}
+	add_loop_fd (fd, switch_event);
+	add_loop_fd (led_timer, led_event);
+	return ON;
+}
+
+
 int kill_gpio ()
 {
 	gpio_state = OFF;
-	pigpio_stop (gpio_deamon);
+	if (backend != NULL) backend->close ();
+	backend = NULL;
 }
 
 
-// process managing external switch and LED
-int gpio_process () {
+// process a press of external switch, time stamped in us: turn LED on
+// returns TRUE if press is taken into account, FALSE if it is a bounce
+int gpio_process (uint64_t t) {
 
-	// get current time
-	now = micros ();
+	struct itimerspec its;
 
 	// test if GPIO is enabled
 	if (gpio_state == ON) {
 
-		// test switch value; if switch is pressed then value is LOW
-//		if (gpioRead (SWITCH_GPIO) == OFF) {
-		if (gpio_read (gpio_deamon, SWITCH_GPIO) == OFF) {
-			// anti_bounce mechanism: make sure the switch is not "bouncing", causing repeated ON-OFF in a short period
-			// no bounce if previous is 0
-			if ((previous == 0) || ((now-previous) >= ANTIBOUNCE_US))
-			{
-				previous_led = now;			// set time when led has been put on
-//				gpioWrite (LED_GPIO, ON);	// turn LED ON
-				gpio_write (gpio_deamon, LED_GPIO, ON);	// turn LED ON
-				return TRUE;				// switch pressed, no bounce : exit function with press	OK
-			}
-		}
+		// anti_bounce mechanism: make sure the switch is not "bouncing", causing repeated ON-OFF in a short period
+		// presses are time stamped by the backend, so the window only needs to cover bounces left by the backend filter
+		if ((last_edge == 0) || ((t - last_edge) >= ANTIBOUNCE_US))
+		{
+			last_edge = t;
+			previous_led = t;			// set time when led has been put on
+			backend->led (ON);			// turn LED ON
+
+			// arm one-shot timer to turn LED off after TIMEON_US
+			memset (&its, 0, sizeof (its));
+			its.it_value.tv_sec = TIMEON_US / 1000000;
+			its.it_value.tv_nsec = (TIMEON_US % 1000000) * 1000;
+			timerfd_settime (led_timer, 0, &its, NULL);
 
-		// check when to turn LED off : it is turned off when led is on for more than TIMEON_US
-	    if ((now - previous_led) > TIMEON_US) {
-//			gpioWrite (LED_GPIO, OFF);	// turn LED OFF
-			gpio_write (gpio_deamon, LED_GPIO, OFF);	// turn LED OFF
+			return TRUE;				// switch pressed, no bounce : exit function with press	OK
 		}
 	}
 
@@ -103,43 +487,44 @@ int gpio_process () {
 }
 
 
-// process callback called to process press on "beat" pad/switch 
-int beat_process () {
+// main loop handler for switch edges: process beat for each press given by the backend
+int switch_event (int fd) {
 
-	uint64_t tempo_us;						// for beat management
+	uint64_t t;
 
-	// get current time
-	now = micros ();
+	while ((backend != NULL) && (backend->read_edge (&t) == TRUE)) {
+		if (gpio_process (t) == TRUE) beat_process (t);
+	}
+	return TRUE;
+}
 
-	tempo_us = fluid_player_get_midi_tempo (player);	// get tempo per quarter note
 
-	// proceed only if we have a valid tempo; otherwise do nothing
-	if (tempo_us != FLUID_FAILED) {
+// main loop handler for LED timer: LED has been on for more than TIMEON_US, turn it off
+int led_event (int fd) {
 
-		// check if previous time is set; if not, set to a default value corresponding to current BPM
-		// fluid_player_get_midi_tempo () returns current tempo of player in us per quarter note (ie per beat)
-		if (previous == 0) {
-			// we are here when this is the first time we press the beat button
-			// take advantage to note the initial BPM of the file, just in case
-			if (initial_bpm == -1) {
-				initial_bpm = (fluid_player_get_bpm (player) == FLUID_FAILED) ? 0 : fluid_player_get_bpm (player);
-			}
+	uint64_t expirations;
 
-			previous = now - tempo_us;						// set value of previous according to tempo
-		} 
+	// acknowledge timer
+	read (fd, &expirations, sizeof (expirations));
 
-		// check that time between previous and now is not too long...
-		// in some case, we miss a beat keypress, we must accomodate for this
-		// to check this, we make sure that time difference is < than 1.75 x current tempo
-		// if it is >, then likely a keypress has been mised: do not change tempo then
-		if ((now-previous) > tempo_us + (tempo_us >> 1) + (tempo_us >>2)) {
-			previous = 0;
-		}
-		else {
-			// set new tempo
-			fluid_player_set_tempo (player, FLUID_PLAYER_TEMPO_EXTERNAL_MIDI, (double)(now-previous));
-			previous = now;
-		}
+	if ((gpio_state == ON) && (backend != NULL)) {
+		backend->led (OFF);	// turn LED OFF
 	}
+	return TRUE;
 }
 
+
+// process callback called to process press on "beat" pad/switch, at time t (in us)
+// tempo and phase of the player are tracked from the taps by tempo_tap ()
+int beat_process (uint64_t t) {
+
+	now = t;
+
+	// first press of the beat button for this song: take advantage to note the initial BPM of the file, just in case
+	if ((previous == 0) && (initial_bpm == -1)) {
+		initial_bpm = (engine_get_bpm (player) == FLUID_FAILED) ? 0 : engine_get_bpm (player);
+	}
+
+	tempo_tap (now);
+	return TRUE;
+}
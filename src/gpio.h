@@ -4,9 +4,11 @@
  *
  */
 
-int init_gpio ();
+int init_gpio (char *);
 int kill_gpio ();
-int gpio_process ();
-int beat_process ();
+int gpio_process (uint64_t);
+int switch_event (int);
+int led_event (int);
+int beat_process (uint64_t);
 
 
@@ -0,0 +1,494 @@
+/** @file library.c
+ *
+ * @brief In-memory index of songs and soundfonts: maps file number to file name, built once at startup and kept current with inotify.
+ * Information about midi files (format, tracks, PPQ, tempo, duration, channels) is cached, and persisted to an index file keyed by mtime/size.
+ *
+ * Songs are organised in banks of 256 songs; song number is bank * 256 + index in bank.
+ * Bank 00 is made of the files in ./songs/; bank XX (01 to FF) is either the sub-directory ./songs/XX_name/,
+ * or the setlist file ./songs/XX_name.set (one song path per line, relative to ./songs/), sub-directory first.
+ * In a sub-directory, file number is given by the first 2 characters of the file name; in a setlist, by the line order.
+ *
+ */
+
+#include <ctype.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include "types.h"
+#include "globals.h"
+#include "utils.h"
+#include "smf.h"
+#include "loop.h"
+#include "library.h"
+
+#define NB_FILES		256		// file numbers go from 00 to FF in each bank
+#define NB_BANKS		256		// bank numbers go from 00 to FF
+#define NB_LIBRARY		2		// songs and soundfonts
+#define NAME_LEN		256		// max length of a file name (relative to library directory)
+#define INOTIFY_MASK	(IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE)
+#define SETLIST_EXT		".set"	// extension of setlist files
+
+typedef struct {				// structure for each file of the library
+	char name [NAME_LEN];			// file name relative to library directory; empty if there is no file for this number
+	time_t mtime;					// modification time and size of the file: used to check whether cached info is still valid
+	off_t size;
+	int has_info;					// TRUE if info has been read from the file
+	midi_info_t info;				// information about midi file (songs only)
+} lib_entry_t;
+
+typedef struct {				// structure for each bank of the library
+	lib_entry_t entry [NB_FILES];	// files indexed on file number in the bank
+	int16_t next [NB_FILES];		// next existing file number in the bank; -1 if none
+	int16_t prev [NB_FILES];		// previous existing file number in the bank; -1 if none
+	int first;						// first existing file number in the bank; -1 if bank is empty
+} bank_t;
+
+typedef struct {				// structure for each directory of the library
+	char *dir;						// directory, including trailing '/'
+	char *index_file;				// file where index is persisted; NULL if index is not persisted
+	int banked;						// TRUE if sub-directories and setlists are used as banks
+	bank_t *bank [NB_BANKS];		// banks indexed on bank number; NULL if bank does not exist
+	int16_t next_bank [NB_BANKS];	// next existing bank number; -1 if none
+	int16_t prev_bank [NB_BANKS];	// previous existing bank number; -1 if none
+} library_t;
+
+static library_t library [NB_LIBRARY] = {
+	{ "./songs/", "./songs/.index", TRUE },
+	{ "./soundfonts/", NULL, FALSE }
+};
+
+static pthread_mutex_t library_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int inotify_id = -1;
+static int soundfont_wd = -1;		// inotify watch descriptor of soundfont directory; all other watches are song directories
+
+
+// get file number from the first 2 characters of the file name (hexadecimal, lower or upper case)
+// returns -1 if file name does not start with a number
+static int file_number (char *name)
+{
+	if (!isxdigit ((unsigned char) name [0]) || !isxdigit ((unsigned char) name [1])) return -1;
+	return (int) strtol ((char []) { name [0], name [1], 0 }, NULL, 16);
+}
+
+
+// check whether file name is a setlist
+static int is_setlist (char *name)
+{
+	int len = strlen (name);
+
+	return (len > strlen (SETLIST_EXT)) && (strcmp (name + len - strlen (SETLIST_EXT), SETLIST_EXT) == 0);
+}
+
+
+// get bank of library, allocating it if needed; returns NULL if out of memory
+static bank_t* get_bank (bank_t **bank, int num)
+{
+	if (bank [num] == NULL) bank [num] = calloc (1, sizeof (bank_t));
+	return bank [num];
+}
+
+
+// free all banks of a bank table
+static void free_banks (bank_t **bank)
+{
+	int i;
+
+	for (i = 0; i < NB_BANKS; i++) {
+		free (bank [i]);
+		bank [i] = NULL;
+	}
+}
+
+
+// load persisted index into the library, as a cache of file information
+static void load_index (library_t *lib)
+{
+	FILE *fp;
+	lib_entry_t e;
+	bank_t *b;
+	long mtime, size;
+	unsigned int bank, num;
+
+	if ((lib->index_file == NULL) || ((fp = fopen (lib->index_file, "rt")) == NULL)) return;
+
+	memset (&e, 0, sizeof (e));
+	while (fscanf (fp, "%02x\t%02x\t%255[^\t]\t%ld\t%ld\t%d\t%d\t%d\t%d\t%u\t%u\t%hx\n", &bank, &num, e.name, &mtime, &size, &e.info.format,
+			&e.info.ntracks, &e.info.division, &e.info.tempo, &e.info.ticks, &e.info.duration_ms, &e.info.channels) == 12) {
+		if ((bank >= NB_BANKS) || (num >= NB_FILES) || ((b = get_bank (lib->bank, bank)) == NULL)) continue;
+		e.mtime = mtime;
+		e.size = size;
+		e.has_info = TRUE;
+		b->entry [num] = e;
+	}
+	fclose (fp);
+}
+
+
+// persist index of the library, with file information
+static void save_index (library_t *lib)
+{
+	FILE *fp;
+	lib_entry_t *e;
+	int i, j;
+
+	if ((lib->index_file == NULL) || ((fp = fopen (lib->index_file, "wt")) == NULL)) return;
+
+	for (j = 0; j < NB_BANKS; j++) {
+		if (lib->bank [j] == NULL) continue;
+		for (i = 0; i < NB_FILES; i++) {
+			e = &lib->bank [j]->entry [i];
+			if ((e->name [0] == 0) || (e->has_info == FALSE)) continue;
+			fprintf (fp, "%02x\t%02x\t%s\t%ld\t%ld\t%d\t%d\t%d\t%d\t%u\t%u\t%04x\n", j, i, e->name, (long) e->mtime, (long) e->size, e->info.format,
+				e->info.ntracks, e->info.division, e->info.tempo, e->info.ticks, e->info.duration_ms, e->info.channels);
+		}
+	}
+	fclose (fp);
+}
+
+
+// add file (name relative to library directory) to a bank as file number num
+// cached information is reused if file has not changed since the previous scan; returns TRUE if file information has changed
+static int add_file (library_t *lib, bank_t *bank, int bank_num, int num, char *name)
+{
+	struct stat st;
+	char path [NAME_LEN + 50];
+	lib_entry_t *e, *old;
+
+	if ((bank->entry [num].name [0] != 0) || (strlen (name) >= NAME_LEN)) return FALSE;
+
+	sprintf (path, "%s%s", lib->dir, name);
+	if ((stat (path, &st) != 0) || !S_ISREG (st.st_mode)) return FALSE;
+
+	e = &bank->entry [num];
+	strcpy (e->name, name);
+	e->mtime = st.st_mtime;
+	e->size = st.st_size;
+
+	// reuse cached information if file has not changed
+	old = (lib->bank [bank_num] != NULL) ? &lib->bank [bank_num]->entry [num] : NULL;
+	if ((old != NULL) && (strcmp (old->name, e->name) == 0) && (old->mtime == e->mtime) && (old->size == e->size)) {
+		e->has_info = old->has_info;
+		e->info = old->info;
+		return FALSE;
+	}
+
+	if (lib->index_file != NULL) e->has_info = smf_info (path, &e->info);
+	return TRUE;
+}
+
+
+// scan directory (relative to library directory; empty for library directory itself) into a bank
+// if several files start with the same number, the first one in alphabetical order is used
+// returns TRUE if file information has changed
+static int scan_bank (library_t *lib, bank_t *bank, int bank_num, char *subdir)
+{
+	struct dirent **list;
+	char dir [NAME_LEN + 50], name [NAME_LEN + 50];
+	int i, n, changed = FALSE;
+
+	sprintf (dir, "%s%s", lib->dir, subdir);
+	if ((n = scandir (dir, &list, NULL, alphasort)) < 0) {
+		fprintf (stderr, "Directory %s not found.\n", dir);
+		return FALSE;
+	}
+
+	// watch sub-directories as well (same watch descriptor is returned if already watched)
+	if ((subdir [0] != 0) && (inotify_id >= 0)) inotify_add_watch (inotify_id, dir, INOTIFY_MASK);
+
+	for (i = 0; i < n; i++) {
+		// skip hidden files (including index file), setlists of a banked library, and files not starting with a number
+		if ((list [i]->d_name [0] != '.') && (file_number (list [i]->d_name) != -1) && !((lib->banked) && is_setlist (list [i]->d_name))) {
+			sprintf (name, "%s%s", subdir, list [i]->d_name);
+			changed |= add_file (lib, bank, bank_num, file_number (list [i]->d_name), name);
+		}
+		free (list [i]);
+	}
+	free (list);
+
+	return changed;
+}
+
+
+// read setlist file (name relative to library directory) into a bank: one song path per line, relative to library directory
+// returns TRUE if file information has changed
+static int scan_setlist (library_t *lib, bank_t *bank, int bank_num, char *setlist)
+{
+	FILE *fp;
+	char path [NAME_LEN + 50], line [NAME_LEN + 2];
+	int num = 0, len, changed = FALSE;
+
+	sprintf (path, "%s%s", lib->dir, setlist);
+	if ((fp = fopen (path, "rt")) == NULL) return FALSE;
+
+	while ((num < NB_FILES) && (fgets (line, sizeof (line), fp) != NULL)) {
+		// remove end of line; skip empty lines and comments
+		len = strlen (line);
+		while ((len > 0) && ((line [len - 1] == '\n') || (line [len - 1] == '\r'))) line [--len] = 0;
+		if ((len == 0) || (line [0] == '#')) continue;
+
+		changed |= add_file (lib, bank, bank_num, num++, line);
+	}
+	fclose (fp);
+
+	return changed;
+}
+
+
+// link existing files of a bank (and existing banks of a library) so browsing is done in constant time
+static void link_bank (bank_t *bank)
+{
+	int i, last = -1;
+
+	bank->first = -1;
+	for (i = 0; i < NB_FILES; i++) {
+		bank->prev [i] = last;
+		if (bank->entry [i].name [0] != 0) {
+			if (bank->first == -1) bank->first = i;
+			last = i;
+		}
+	}
+	last = -1;
+	for (i = NB_FILES - 1; i >= 0; i--) {
+		bank->next [i] = last;
+		if (bank->entry [i].name [0] != 0) last = i;
+	}
+}
+
+
+// scan library directory, its sub-directories and setlists, and update index
+// file information is read again only for new or modified files
+static void scan_library (library_t *lib)
+{
+	struct dirent **list;
+	struct stat st;
+	bank_t *bank [NB_BANKS] = { NULL };
+	char path [NAME_LEN + 50];
+	int i, j, n, num, len, last, changed = FALSE;
+
+	// bank 00: library directory itself
+	if (get_bank (bank, 0) == NULL) return;
+	changed |= scan_bank (lib, bank [0], 0, "");
+
+	// other banks: sub-directories first, then setlists
+	if ((lib->banked) && ((n = scandir (lib->dir, &list, NULL, alphasort)) >= 0)) {
+		for (j = 0; j < 2; j++) {
+			for (i = 0; i < n; i++) {
+				num = file_number (list [i]->d_name);
+				if ((list [i]->d_name [0] == '.') || (num <= 0) || (bank [num] != NULL)) continue;
+				sprintf (path, "%s%s", lib->dir, list [i]->d_name);
+				if (stat (path, &st) != 0) continue;
+				len = strlen (list [i]->d_name);
+
+				if ((j == 0) && S_ISDIR (st.st_mode) && (len < NAME_LEN - 1) && (get_bank (bank, num) != NULL)) {
+					sprintf (path, "%s/", list [i]->d_name);
+					changed |= scan_bank (lib, bank [num], num, path);
+				}
+				if ((j == 1) && S_ISREG (st.st_mode) && is_setlist (list [i]->d_name) && (get_bank (bank, num) != NULL)) {
+					changed |= scan_setlist (lib, bank [num], num, list [i]->d_name);
+				}
+			}
+		}
+		for (i = 0; i < n; i++) free (list [i]);
+		free (list);
+	}
+
+	// banks and files may also have been removed
+	for (j = 0; j < NB_BANKS; j++) {
+		if (lib->bank [j] == NULL) continue;
+		for (i = 0; i < NB_FILES; i++) {
+			if ((lib->bank [j]->entry [i].name [0] != 0) && ((bank [j] == NULL) || (bank [j]->entry [i].name [0] == 0))) changed = TRUE;
+		}
+	}
+
+	// link files and banks for browsing
+	for (j = 0; j < NB_BANKS; j++) {
+		if (bank [j] != NULL) link_bank (bank [j]);
+	}
+
+	pthread_mutex_lock (&library_mutex);
+	last = -1;
+	for (j = 0; j < NB_BANKS; j++) {
+		lib->prev_bank [j] = last;
+		if ((bank [j] != NULL) && (bank [j]->first != -1)) last = j;
+	}
+	last = -1;
+	for (j = NB_BANKS - 1; j >= 0; j--) {
+		lib->next_bank [j] = last;
+		if ((bank [j] != NULL) && (bank [j]->first != -1)) last = j;
+	}
+	// swap new banks in, free old ones
+	for (j = 0; j < NB_BANKS; j++) {
+		free (lib->bank [j]);
+		lib->bank [j] = bank [j];
+	}
+	pthread_mutex_unlock (&library_mutex);
+
+	if (changed) save_index (lib);
+}
+
+
+// build index of songs and soundfonts, and watch their directories for changes
+// returns TRUE if OK, FALSE if directories cannot be watched (index is built anyway)
+int init_library ()
+{
+	int i;
+
+	inotify_id = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+	if (inotify_id < 0) fprintf (stderr, "inotify initialisation failed\n");
+	else {
+		inotify_add_watch (inotify_id, library [0].dir, INOTIFY_MASK);
+		soundfont_wd = inotify_add_watch (inotify_id, library [1].dir, INOTIFY_MASK);
+	}
+
+	for (i = 0; i < NB_LIBRARY; i++) {
+		load_index (&library [i]);
+		scan_library (&library [i]);
+	}
+
+	if (inotify_id < 0) return FALSE;
+	return add_loop_fd (inotify_id, library_event);
+}
+
+
+// main loop handler for inotify: rescan libraries in which files have changed
+int library_event (int fd)
+{
+	char buf [4096] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+	struct inotify_event *ev;
+	ssize_t len;
+	char *p;
+	int rescan [NB_LIBRARY] = { FALSE };
+
+	while ((len = read (fd, buf, sizeof (buf))) > 0) {
+		for (p = buf; p < buf + len; p += sizeof (struct inotify_event) + ev->len) {
+			ev = (struct inotify_event *) p;
+			// ignore hidden files, such as index file written by ourselves
+			if ((ev->len > 0) && (ev->name [0] == '.')) continue;
+			rescan [(ev->wd == soundfont_wd) ? 1 : 0] = TRUE;
+		}
+	}
+
+	if (rescan [0]) scan_library (&library [0]);
+	if (rescan [1]) scan_library (&library [1]);
+	return TRUE;
+}
+
+
+// find library corresponding to directory
+static library_t* find_library (char *directory)
+{
+	int i;
+
+	for (i = 0; i < NB_LIBRARY; i++) {
+		if (strcmp (library [i].dir, directory) == 0) return &library [i];
+	}
+	return NULL;
+}
+
+
+// get library entry of file number (bank * 256 + index in bank); NULL if there is no such file
+// shall be called with library mutex locked
+static lib_entry_t* find_entry (library_t *lib, int number)
+{
+	bank_t *b;
+
+	if ((number < 0) || (number >= NB_BANKS * NB_FILES)) return NULL;
+	b = lib->bank [number / NB_FILES];
+	if ((b == NULL) || (b->entry [number % NB_FILES].name [0] == 0)) return NULL;
+	return &b->entry [number % NB_FILES];
+}
+
+
+// in the given directory, get full name (including directory) of file number, from the index
+// returns FALSE if no file found, TRUE if file is found
+int lookup_library (char *name, int number, char *directory)
+{
+	library_t *lib;
+	lib_entry_t *e;
+	int found = FALSE;
+
+	if ((lib = find_library (directory)) == NULL) return FALSE;
+
+	pthread_mutex_lock (&library_mutex);
+	if ((e = find_entry (lib, number)) != NULL) {
+		strcpy (name, directory);
+		strcat (name, e->name);
+		found = TRUE;
+	}
+	pthread_mutex_unlock (&library_mutex);
+
+	return found;
+}
+
+
+// get cached information about song number
+// returns FALSE if there is no such song, or no information about it
+int get_song_info (int number, midi_info_t *info)
+{
+	lib_entry_t *e;
+	int found = FALSE;
+
+	pthread_mutex_lock (&library_mutex);
+	if (((e = find_entry (&library [0], number)) != NULL) && (e->has_info)) {
+		*info = e->info;
+		found = TRUE;
+	}
+	pthread_mutex_unlock (&library_mutex);
+
+	return found;
+}
+
+
+// get song number next to (direction 1) or previous to (direction -1) song number, in the same bank
+// returns song number unchanged if there is no such song
+int step_song (int number, int direction)
+{
+	bank_t *b;
+	int i = -1;
+
+	if ((number < 0) || (number >= NB_BANKS * NB_FILES)) return number;
+
+	pthread_mutex_lock (&library_mutex);
+	if ((b = library [0].bank [number / NB_FILES]) != NULL) {
+		i = (direction > 0) ? b->next [number % NB_FILES] : b->prev [number % NB_FILES];
+	}
+	pthread_mutex_unlock (&library_mutex);
+
+	return (i == -1) ? number : (number / NB_FILES) * NB_FILES + i;
+}
+
+
+// get first song of the bank next to (direction 1) or previous to (direction -1) the bank of song number
+// returns song number unchanged if there is no such bank
+int step_bank (int number, int direction)
+{
+	int bank, res = number;
+
+	if ((number < 0) || (number >= NB_BANKS * NB_FILES)) return number;
+
+	pthread_mutex_lock (&library_mutex);
+	bank = (direction > 0) ? library [0].next_bank [number / NB_FILES] : library [0].prev_bank [number / NB_FILES];
+	if (bank != -1) res = bank * NB_FILES + library [0].bank [bank]->first;
+	pthread_mutex_unlock (&library_mutex);
+
+	return res;
+}
+
+
+// print name and information of song number, when browsing through songs
+void print_song (int number)
+{
+	char name [NAME_LEN + 50];
+	midi_info_t info;
+
+	if (lookup_library (name, number, "./songs/") == FALSE) {
+		printf ("song %02X:%02X: none\n", number / NB_FILES, number % NB_FILES);
+		return;
+	}
+	if (get_song_info (number, &info) == FALSE) {
+		printf ("song %02X:%02X: %s\n", number / NB_FILES, number % NB_FILES, name);
+		return;
+	}
+	printf ("song %02X:%02X: %s %u:%02u %d BPM, format %d, %d tracks, %d PPQ\n", number / NB_FILES, number % NB_FILES, name,
+		info.duration_ms / 60000, (info.duration_ms / 1000) % 60, (info.tempo > 0) ? 60000000 / info.tempo : 0, info.format, info.ntracks, info.division);
+}
@@ -0,0 +1,13 @@
+/** @file library.h
+ *
+ * @brief This file defines prototypes of functions inside library.c
+ *
+ */
+
+int init_library ();
+int lookup_library (char *, int, char *);
+int get_song_info (int, midi_info_t *);
+int step_song (int, int);
+int step_bank (int, int);
+void print_song (int);
+int library_event (int);
@@ -0,0 +1,176 @@
+/** @file loader.c
+ *
+ * @brief Background loader: prepares midi player and soundfont as soon as a new file number is selected, so that PLAY only swaps them in.
+ * Soundfonts are loaded into the soundfont pool (see sfpool.c), where they stay resident until evicted.
+ *
+ */
+
+#include <pthread.h>
+#include "types.h"
+#include "globals.h"
+#include "config.h"
+#include "process.h"
+#include "utils.h"
+#include "gpio.h"
+#include "loader.h"
+#include "sfpool.h"
+#include "smf.h"
+#include "optimize.h"
+#include "engine.h"
+
+
+static pthread_t loader_thread;
+static pthread_mutex_t loader_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t loader_cond = PTHREAD_COND_INITIALIZER;
+
+static int pending = FALSE;				// a new file number has been selected and shall be prepared
+static int busy = FALSE;				// loader thread is preparing files
+
+// prepared player: file number is -1 if nothing is prepared; player is NULL if file number does not exist
+static engine_t* ready_player = NULL;
+static int ready_midi_num = -1;
+static smf_t* ready_smf = NULL;			// event table of prepared player
+
+
+// create a new song engine (see engine.c) with midi file number (bank * 256 + index in bank)
+// file is parsed into an event table, returned in smf, from which the engine copies its events
+// returns NULL if file does not exist or is not a midi file
+static engine_t* prepare_player (int num, smf_t **smf)
+{
+	char name [310], opt [310];
+	engine_t* p;
+	double duration;
+	uint64_t start;
+
+	*smf = NULL;
+	if (get_full_filename (name, num, "./songs/") == FALSE) return NULL;
+	if (!fluid_is_midifile (name)) return NULL;
+
+	// optimized form of the file is played instead, if it has been imported since the file was last changed (see optimize.c)
+	start = micros ();
+	if (use_optimized (name, opt)) strcpy (name, opt);
+
+	// parse file once into an event table: events of the engine, and chase of channel state at markers
+	if ((*smf = smf_read (name)) == NULL) return NULL;
+	if ((p = new_engine (synth, *smf)) == NULL) {
+		smf_free (*smf);
+		*smf = NULL;
+		return NULL;
+	}
+
+	// assign a callback function for midi events going to the synth
+	engine_set_playback_callback (p, handle_midi_event_to_synth, (void *) synth);
+	// assign a callback function called at each audio block, for loop wrap and cued song switch
+	engine_set_tick_callback (p, handle_tick, (void *) p);
+
+	duration = engine_get_duration_us (p) / 1000000.0;
+	printf ("midi:%s prepared in %llu ms: %d events, %d tempo segments, %d:%02d\n", name, (unsigned long long) (micros () - start) / 1000,
+		p->nb_event, p->map.nb, (int) duration / 60, (int) duration % 60);
+	return p;
+}
+
+
+// loader thread: wait for a new selection, then prepare corresponding files
+static void* loader (void *arg)
+{
+	int midi_num;
+	uint8_t sf2_num;
+	engine_t* p;
+	smf_t* smf;
+
+	pthread_mutex_lock (&loader_mutex);
+	while (1) {
+		while (pending == FALSE) pthread_cond_wait (&loader_cond, &loader_mutex);
+		pending = FALSE;
+		busy = TRUE;
+		midi_num = new_midi_num;
+		sf2_num = new_sf2_num;
+		pthread_mutex_unlock (&loader_mutex);
+
+		// prepare midi file, if not already current or prepared
+		if ((midi_num != current_midi_num) && (midi_num != ready_midi_num)) {
+			p = prepare_player (midi_num, &smf);
+			pthread_mutex_lock (&loader_mutex);
+			// forget previously prepared player that has not been used
+			delete_engine (ready_player);
+			smf_free (ready_smf);
+			ready_player = p;
+			ready_smf = smf;
+			ready_midi_num = midi_num;
+			pthread_mutex_unlock (&loader_mutex);
+		}
+
+		// make sf2 file resident in soundfont pool (loaded hidden), if not already current
+		if (sf2_num != current_sf2_num) acquire_sf2 (sf2_num);
+
+		pthread_mutex_lock (&loader_mutex);
+		busy = FALSE;
+		pthread_cond_broadcast (&loader_cond);
+	}
+
+	return NULL;
+}
+
+
+// start loader thread
+// returns TRUE if OK, FALSE otherwise
+int init_loader ()
+{
+	if (pthread_create (&loader_thread, NULL, loader, NULL) != 0) {
+		fprintf (stderr, "loader thread creation failed\n");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+
+// notify loader that new_midi_num or new_sf2_num has changed
+// this does not block: can be called from midi driver thread
+void request_load ()
+{
+	pthread_mutex_lock (&loader_mutex);
+	pending = TRUE;
+	pthread_cond_broadcast (&loader_cond);
+	pthread_mutex_unlock (&loader_mutex);
+}
+
+
+// wait until loader is idle (in case PLAY is pressed while file is still being prepared)
+static void wait_loader ()
+{
+	while ((pending == TRUE) || (busy == TRUE)) pthread_cond_wait (&loader_cond, &loader_mutex);
+}
+
+
+// get prepared player for midi file number, and its event table in smf; ownership of both is given to the caller
+// returns NULL if no player could be prepared for this number
+engine_t* take_player (int num, smf_t **smf)
+{
+	engine_t* p = NULL;
+
+	*smf = NULL;
+	pthread_mutex_lock (&loader_mutex);
+	wait_loader ();
+	if (ready_midi_num == num) {
+		p = ready_player;
+		*smf = ready_smf;
+		ready_player = NULL;
+		ready_smf = NULL;
+		ready_midi_num = -1;
+	}
+	pthread_mutex_unlock (&loader_mutex);
+
+	return p;
+}
+
+
+// select soundfont for sf2 file number in soundfont pool: its presets become visible
+// returns soundfont id, or -1 if no soundfont could be loaded for this number
+int take_sf2 (uint8_t num)
+{
+	pthread_mutex_lock (&loader_mutex);
+	wait_loader ();
+	pthread_mutex_unlock (&loader_mutex);
+
+	return select_sf2 (num);
+}
@@ -0,0 +1,10 @@
+/** @file loader.h
+ *
+ * @brief This file defines prototypes of functions inside loader.c
+ *
+ */
+
+int init_loader ();
+void request_load ();
+engine_t* take_player (int, smf_t **);
+int take_sf2 (uint8_t);
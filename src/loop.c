@@ -0,0 +1,87 @@
+/** @file loop.c
+ *
+ * @brief Event-driven main loop: sleeps in epoll until one of the registered file descriptors is ready.
+ *
+ */
+
+#include <sys/epoll.h>
+#include "types.h"
+#include "globals.h"
+#include "config.h"
+#include "process.h"
+#include "utils.h"
+#include "gpio.h"
+#include "loop.h"
+
+#define NB_LOOP_FD	16		// max number of file descriptors watched by the main loop
+
+// table of file descriptors and handlers watched by the main loop
+static struct {
+	int fd;
+	int (*handler) (int);		// function to be called when fd is ready for reading
+} loop_fd [NB_LOOP_FD];
+
+static int nb_loop_fd = 0;
+static int epoll_id = -1;
+
+
+// create the epoll instance used by the main loop
+// returns TRUE if OK, FALSE otherwise
+int init_loop ()
+{
+	epoll_id = epoll_create1 (EPOLL_CLOEXEC);
+	if (epoll_id < 0) {
+		fprintf (stderr, "epoll initialisation failed\n");
+		return FALSE;
+	}
+
+	nb_loop_fd = 0;
+	return TRUE;
+}
+
+
+// register a file descriptor to the main loop; handler is called with fd as parameter every time fd is readable
+// returns TRUE if OK, FALSE otherwise
+int add_loop_fd (int fd, int (*handler) (int))
+{
+	struct epoll_event ev;
+
+	if ((epoll_id < 0) || (nb_loop_fd >= NB_LOOP_FD)) return FALSE;
+
+	loop_fd [nb_loop_fd].fd = fd;
+	loop_fd [nb_loop_fd].handler = handler;
+
+	// the index in the table is given back by epoll when fd is ready
+	ev.events = EPOLLIN;
+	ev.data.u32 = nb_loop_fd;
+	if (epoll_ctl (epoll_id, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		fprintf (stderr, "could not add file descriptor to main loop\n");
+		return FALSE;
+	}
+
+	nb_loop_fd++;
+	return TRUE;
+}
+
+
+// wait (without consuming any CPU) until at least one file descriptor is ready, then call the corresponding handlers
+int process_loop ()
+{
+	struct epoll_event ev [NB_LOOP_FD];
+	int i, n;
+
+	// no timeout: we only wake up on switch edge, timer expiry or control command
+	n = epoll_wait (epoll_id, ev, NB_LOOP_FD, -1);
+	if (n < 0) {
+		// interrupted by a signal: just go back to sleep
+		if (errno == EINTR) return TRUE;
+		fprintf (stderr, "epoll wait failed\n");
+		return FALSE;
+	}
+
+	for (i = 0; i < n; i++) {
+		loop_fd [ev[i].data.u32].handler (loop_fd [ev[i].data.u32].fd);
+	}
+
+	return TRUE;
+}
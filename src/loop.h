@@ -0,0 +1,9 @@
+/** @file loop.h
+ *
+ * @brief This file defines prototypes of functions inside loop.c
+ *
+ */
+
+int init_loop ();
+int add_loop_fd (int, int (*) (int));
+int process_loop ();
@@ -10,6 +10,17 @@
 #include "process.h"
 #include "utils.h"
 #include "gpio.h"
+#include "loop.h"
+#include "loader.h"
+#include "sfpool.h"
+#include "library.h"
+#include "tempo.h"
+#include "audio.h"
+#include "govern.h"
+#include "command.h"
+#include "mixer.h"
+#include "schedule.h"
+#include "engine.h"
 
 
 /*************/
@@ -35,12 +46,12 @@ static void init_globals ( )
 	memset (&stop, 0, sizeof (button_t));
 	memset (&record, 0, sizeof (button_t));
 	memset (&set, 0, sizeof (button_t));
-	memset (&marker_l, 0, sizeof (button_t));
-	memset (&marker_r, 0, sizeof (button_t));
+	memset (marker_l, 0, NB_CYCSHIFT * sizeof (button_t));
+	memset (marker_r, 0, NB_CYCSHIFT * sizeof (button_t));
 
 	// clear load/play flags
 	// is_load = TRUE allows to load default files (00_*) at startup
-	new_midi_num = 0;		// file 00 as default for both midi and sf2
+	new_midi_num = 0;		// file 00 (of bank 00) as default for both midi and sf2
 	new_sf2_num = 0;
 	current_midi_num = 1;		// set current file at 01 to force loading of files number 0 at startup
 	current_sf2_num = 1;
@@ -59,10 +70,11 @@ static void init_globals ( )
 	now = 0;			// used for automated tempo adjustment (at press of switch)
 	previous = 0;
 	previous_led = 0;	// time when LED was turned ON
+	play_us = 0;		// no play pressed yet
 
-	// clear table of time markers... this is a bit useless as we do this at every new load of a song
-	memset (&marker [0], 0, sizeof (int) * NB_MARKER);
-	marker_pos = 0;
+	// clear index of sections... this is a bit useless as we do this at every new load of a song
+	memset (&sections, 0, sizeof (section_list_t));
+	song_smf = NULL;
 }
 
 
@@ -70,8 +82,8 @@ static void signal_handler ( int sig )
 {
 	kill_gpio ();
 
-    // wait for playback termination
-    fluid_player_join(player);
+    // stop playback
+    engine_stop(player);
 
 
 	// for fluidsynth to stop properly, one must do these steps backwards
@@ -83,9 +95,10 @@ static void signal_handler ( int sig )
  	// 6. create audio driver
  	// 7. create midi driver
 
-	delete_fluid_player(player);
+	delete_engine(player);
 	delete_fluid_midi_driver(mdriver);
 	delete_fluid_audio_driver(adriver);
+	kill_schedule ();
 	delete_fluid_synth(synth);
 	delete_fluid_settings(settings);
 
@@ -99,6 +112,16 @@ static void signal_handler ( int sig )
 int main ( int argc, char *argv[] )
 {
 	int i,j;
+	int opt;
+	int sf2_pool_mb = 0;		// memory budget of soundfont pool in MB; 0 for default
+	char *gpio_spec = NULL;		// gpio backend of beat switch; NULL for default (pigpiod)
+	char *audio_profile = NULL;	// audio buffer profile; NULL for default (standard)
+	int extra_latency_us = 0;	// latency of the sound card, added to the latency of the audio buffer
+	int cpu_cores = 1;			// cpu cores rendering voices; 0 for all online cores
+	char *volume_curve = NULL;	// response curve of sliders; NULL for default (linear)
+	char *panning_curve = NULL;	// response curve of knobs; NULL for default (linear)
+	char *quantize = NULL;		// quantization of solo and mute to the song; NULL for default (none)
+	int default_sf2_id = -1;
 	char audio_device [50];
 	char midi_device [50];
 
@@ -106,25 +129,75 @@ int main ( int argc, char *argv[] )
 	strcpy (audio_device, AUDIODEVICE);
 	strcpy (midi_device, MIDIDEVICE);
 
+	// process options
+	// usage: syntwo [-m sf2_pool_MB] [-g pigpiod|gpiod[:chip]|sim:trace_file] [-a standard|low|PxN|auto|tune] [-l extra_latency_us] [-c cpu_cores] [-v linear|db] [-p linear|power] [-q none|beat|bar] audio_device midi_device
+	while ((opt = getopt (argc, argv, "m:g:a:l:c:v:p:q:")) != -1) {
+		switch (opt) {
+			case 'm':
+				sf2_pool_mb = atoi (optarg);
+				break;
+			case 'g':
+				gpio_spec = optarg;
+				break;
+			case 'a':
+				audio_profile = optarg;
+				break;
+			case 'l':
+				extra_latency_us = atoi (optarg);
+				break;
+			case 'c':
+				cpu_cores = atoi (optarg);
+				break;
+			case 'v':
+				volume_curve = optarg;
+				break;
+			case 'p':
+				panning_curve = optarg;
+				break;
+			case 'q':
+				quantize = optarg;
+				break;
+			default:
+				fprintf (stderr, "usage: syntwo [-m sf2_pool_MB] [-g pigpiod|gpiod[:chip]|sim:trace_file] [-a standard|low|PxN|auto|tune] [-l extra_latency_us] [-c cpu_cores] [-v linear|db] [-p linear|power] [-q none|beat|bar] audio_device midi_device\n");
+				exit (0);
+		}
+	}
+
 	// process argc argv
 	// usage: syntwo audio_device midi_device
-	if (argc >=2) {
-		if (strlen (argv [1]) > 45) {
+	if (argc - optind >= 1) {
+		if (strlen (argv [optind]) > 45) {
 			fprintf (stderr, "audio device name too long\n");
 			exit (0);
 		}
-		strcpy (audio_device, argv [1]);
+		strcpy (audio_device, argv [optind]);
 	}
-	if (argc >=3) {
-		if (strlen (argv [2]) > 45) {
+	if (argc - optind >= 2) {
+		if (strlen (argv [optind + 1]) > 45) {
 			fprintf (stderr, "midi device name too long\n");
 			exit (0);
 		}
-		strcpy (midi_device, argv [2]);
+		strcpy (midi_device, argv [optind + 1]);
 	}
 
+	// mixer tables: response curves of sliders and knobs on volume and panning of the song
+	if (init_mixer (volume_curve, panning_curve) == FALSE) exit (0);
+
+	// init event-driven main loop; this shall be done before init GPIO, as GPIO registers its events to the loop
+	if (init_loop () == FALSE) exit (0);
+
+	// commands from the midi driver and synth threads to the main loop, which owns control state
+	// this shall be done before midi driver and players are created
+	if (init_command () == FALSE) exit (0);
+
+	// build index of songs and soundfonts, kept current by the main loop
+	init_library ();
+
 	// init GPIO to enable external "beat" switch (tap tempo)
-	gpio_state = init_gpio ();
+	gpio_state = init_gpio (gpio_spec);
+
+	// init tap tempo, which ramps tempo of the player from a main loop timer
+	init_tempo ();
 
 
 	// install a signal handler to properly quit
@@ -161,8 +234,14 @@ int main ( int argc, char *argv[] )
 
 	// settings for fluidsynth midi and audio
 	fluid_settings_setint(settings, "audio.realtime-prio", 90);		// increase priority for getting more processing power - default is 60
-	fluid_settings_setint(settings, "audio.period-size", 128);		// default is 64
-	fluid_settings_setint(settings, "audio.periods", 16);		// default is 16
+	// audio buffer: period size and number of periods are given by the audio profile (standard is 128 x 16; fluidsynth default is 64 x 16)
+	// auto and tune profiles are tuned when audio driver is started, once soundfont is loaded
+	if (set_audio_profile (audio_profile, extra_latency_us) == FALSE) exit (0);
+
+	// voices are rendered in parallel on several cpu cores: fluidsynth splits voices over helper threads, and mixes them in the audio callback
+	// 1 core is the former behaviour; channels are not split over several synths, so soundfonts are loaded once and CC routing is unchanged
+	if (cpu_cores <= 0) cpu_cores = sysconf (_SC_NPROCESSORS_ONLN);
+	fluid_settings_setint(settings, "synth.cpu-cores", cpu_cores);
 
 	fluid_settings_setstr(settings, "audio.driver", "alsa");
 	fluid_settings_setstr(settings, "audio.alsa.device", audio_device);
@@ -173,21 +252,35 @@ int main ( int argc, char *argv[] )
 	// create synth
 	synth = new_fluid_synth(settings);
 
+	// live changes (CC of controls, tempo) are scheduled through a sequencer driven by the synth, so their latency is fixed
+	if (init_schedule (quantize) == FALSE) exit (0);
+
 	// load default soundfont
 	// default soundfont will always be in memory and will never be unloaded
 	// to avoid sound issues
 	if (fluid_is_soundfont(DEFAULT_SF2)) {
-		fluid_synth_sfload(synth, DEFAULT_SF2, TRUE);
+		default_sf2_id = fluid_synth_sfload(synth, DEFAULT_SF2, TRUE);
 	}
 
+	// init soundfont pool; default soundfont is pinned in it
+	init_sfpool (sf2_pool_mb, default_sf2_id);
+
 	// start audio driver
-	adriver = new_fluid_audio_driver(settings, synth);
+	// synth is rendered from our own callback, to know output latency and count xruns
+	adriver = start_audio ();
+
+	// start cpu governor: synthesis quality is lowered under load or when the SoC gets hot, and restored afterwards
+	init_governor ();
 
 	// start midi driver
     mdriver = new_fluid_midi_driver(settings, handle_midi_event_from_hw, (void *) synth);		// callback called every time a midi event is received from HW device
 
-	// create new player, but don't load anything for now
-	player = new_fluid_player(synth);
+	// create new song engine, but don't load anything for now: it plays an empty song
+	player = new_engine(synth, NULL);
+
+	// start background loader, and prepare default midi and sf2 files
+	if (init_loader () == FALSE) exit (0);
+	request_load ();
 
 	// load default midi and sf2 files before main loop
 	load_midi_sf2 ();
@@ -199,17 +292,11 @@ int main ( int argc, char *argv[] )
 	// at start, we use default volume (2); light on the volume pads to indicate this to the user
 	// also light to indicate we are at standard bpm
 
+	// main loop sleeps until an event occurs: external beat switch pressed, LED timer expired...
+	// no busy polling, so no CPU is taken away from fluidsynth audio thread
 	while (1)
 	{
-		// process external beat switch by checking if pressed or not
-		if (gpio_process () == TRUE) beat_process ();
-
-
-#ifdef WIN32
-//		Sleep ( 1000 );
-#else
-//		sleep ( 1 );
-#endif
+		process_loop ();
 	}
 
 	// terminate
@@ -13,7 +13,7 @@
 fluid_settings_t* settings;
 fluid_synth_t* synth;
 fluid_midi_driver_t* mdriver;
-fluid_player_t* player;
+engine_t* player;
 fluid_audio_driver_t* adriver;
 
 
@@ -25,23 +25,32 @@ uint64_t previous_led;  // time when switch was set as on
 // file number for midi and sf2 files
 uint8_t midi_num, sf2_num;
 /* load (midi and SF2 files) & play (midi file) globals */
-uint8_t new_midi_num, new_sf2_num;				// new file number to be loaded
-uint8_t current_midi_num, current_sf2_num;		// current file number that is currently loaded
+int new_midi_num;							// new song number to be loaded (bank * 256 + index in bank)
+uint8_t new_sf2_num;						// new soundfont number to be loaded
+int current_midi_num;						// current song number that is currently loaded
+uint8_t current_sf2_num;					// current soundfont number that is currently loaded
 
 int sf2_id;		// id of sf2 file currently loaded
 
+/* latency instrumentation */
+_Atomic uint64_t play_us;		// time when play was pressed; 0 once first note has been played
+
 /* volume and BPM */
 int bpm;
 int initial_bpm;
 int volume;
 
+/* mixer: CC7 and CC10 of the song weighted by slider and knob position, indexed on [slider or knob][CC value] (see mixer.c) */
+uint8_t volume_lut [128][128];
+uint8_t panning_lut [128][128];
+
 /* beat */
 uint64_t now;       // time now
 uint64_t previous;  // time when "beat" key was last pressed
 
 /* markers */
-int marker [NB_MARKER];     // table of time markers in the song
-int marker_pos;             // position of marker selected by < > in the table
+section_list_t sections;    // sections of current song (midi file markers and time markers set by the user), sorted by tick
+smf_t *song_smf;            // event table of current song (NULL if not available)
 
 /* definition of the MIDI controler controls */
 channel_t channel [NB_CHANNEL] [NB_RECSHIFT];		// 8 channel control * 2 (without shift and with shift; REC key)
@@ -51,4 +60,9 @@ button_t track_r [NB_CYCSHIFT];			// track right button; could be used with shif
 button_t rwd [NB_CYCSHIFT];			    // rewind: could be used with shift
 button_t fwd [NB_CYCSHIFT];			    // forward : could be used with shift
 button_t play, stop, record;
-button_t set, marker_l, marker_r;
+button_t set;
+button_t marker_l [NB_CYCSHIFT];			// marker left: could be used with shift (cycle) for previous bank
+button_t marker_r [NB_CYCSHIFT];			// marker right: could be used with shift (cycle) for next bank
+
+/* dispatch table of incoming midi messages, indexed on status nibble and controller number */
+dispatch_t dispatch [NB_STATUS] [NB_CONTROL];
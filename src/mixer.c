@@ -0,0 +1,203 @@
+/** @file mixer.c
+ *
+ * @brief Mixer stage between the song and the synth: CC7 (volume) and CC10 (panning) of the song are weighted by slider and knob position.
+ * Response curves are computed once at startup into lookup tables indexed on [slider or knob position][CC value],
+ * so the player thread does a single table access per event, with no arithmetic.
+ * Volume curves: linear (slider scales CC7) or dB taper (slider attenuates linearly in dB, down to -48 dB, then mute).
+ * Panning curves: linear (knob offsets CC10) or equal power (knob is a balance: the opposite side is attenuated with a cosine law).
+ * Changes of sliders and knobs are not sent to the synth right away: the channel is flagged, and the audio callback sends one CC
+ * per flagged channel at the start of each period, with the latest position. A fader sweep or a solo loop is then a single batch,
+ * and the synth api lock is taken by the audio thread only. CC are scheduled one period after the latest change of the channel
+ * (see schedule.c); CC of solo and mute may be quantized to the next beat or bar.
+ * A slider position only applies to the CC7 of the song once its scheduled CC7 has taken effect (value_applied), so a quantized solo
+ * or mute is not heard early through the song's own volume changes.
+ *
+ */
+
+#include <stdatomic.h>
+
+#include "types.h"
+#include "globals.h"
+#include "config.h"
+#include "process.h"
+#include "utils.h"
+#include "gpio.h"
+#include "schedule.h"
+#include "mixer.h"
+
+#define TAPER_DB	48.0		// range of the dB taper slider, from full scale to the lowest position before mute
+#define CENTER		0x40		// center position of knobs
+#define PAN_FLAG	16			// bit of the panning flag of a channel, above the volume flags
+#define QUANT_FLAG	32			// bit of the quantization flag of a CC, above its flag
+
+static atomic_ullong pending = 0;		// channels whose CC7 (bits 0-15) or CC10 (bits 16-31) shall be sent at next period;
+										// bits 32-63: CC to be quantized to next beat or bar
+static _Atomic uint64_t stamp [QUANT_FLAG];	// time of the latest change of each flag, in us
+static atomic_ulong nb_posted = 0;		// changes flagged by controls
+static atomic_ulong nb_sent = 0;		// CC sent to synth by flush_mixer ()
+
+
+// linear volume: slider scales CC7 (former adjust_volume ())
+static uint8_t linear_volume (int sld, int vol)
+{
+	return (uint8_t) ((sld / 127.0f) * vol);
+}
+
+
+// dB taper volume: slider position gives an attenuation in dB, added to the level given by CC7
+// fluidsynth maps CC7 to a level of 40 * log10 (CC7 / 127) dB, so an attenuation of a dB is a factor of 10 ^ (a / 40) on CC7
+// also used by bench_mixer, to compare the curve computed for each event with the table
+uint8_t db_volume (int sld, int vol)
+{
+	if (sld == 0) return 0;
+	return (uint8_t) (vol * pow (10.0, -TAPER_DB * (1.0 - sld / 127.0) / 40.0) + 0.5);
+}
+
+
+// linear panning: knob offsets CC10, clamped (former adjust_panning ())
+static uint8_t linear_panning (int knb, int pan)
+{
+	int a;
+
+	a = knb - CENTER + pan;
+	if (a < 0) a = 0;
+	if (a > 0x7F) a = 0x7F;
+	return (uint8_t) a;
+}
+
+
+// equal power panning: song panning is an angle (left and right gains are cos and sin), knob is a balance attenuating the opposite side
+// panning of the result is the angle of the attenuated gains; knob at center leaves song panning unchanged
+// also used by bench_mixer, to compare the curve computed for each event with the table
+uint8_t power_panning (int knb, int pan)
+{
+	double a, b, left, right;
+
+	b = (knb >= CENTER) ? (knb - CENTER) / (127.0 - CENTER) : (knb - CENTER) / (double) CENTER;
+	a = pan / 127.0 * M_PI / 2.0;
+	left = cos (a) * ((b > 0) ? cos (b * M_PI / 2.0) : 1.0);
+	right = sin (a) * ((b < 0) ? cos (b * M_PI / 2.0) : 1.0);
+	if ((left <= 0.0) && (right <= 0.0)) return (uint8_t) pan;
+	return (uint8_t) (atan2 (right, left) / (M_PI / 2.0) * 127.0 + 0.5);
+}
+
+
+// build mixer tables with response curves: volume "linear" or "db", panning "linear" or "power"; NULL for linear
+// shall be called before players and controls are started
+// returns TRUE if OK, FALSE if a curve is unknown
+int init_mixer (char *volume_curve, char *panning_curve)
+{
+	uint8_t (*vol) (int, int) = linear_volume;
+	uint8_t (*pan) (int, int) = linear_panning;
+	int i, j;
+
+	if ((volume_curve != NULL) && (strcmp (volume_curve, "db") == 0)) vol = db_volume;
+	else if ((volume_curve != NULL) && (strcmp (volume_curve, "linear") != 0)) {
+		fprintf (stderr, "unknown volume curve %s\n", volume_curve);
+		return FALSE;
+	}
+	if ((panning_curve != NULL) && (strcmp (panning_curve, "power") == 0)) pan = power_panning;
+	else if ((panning_curve != NULL) && (strcmp (panning_curve, "linear") != 0)) {
+		fprintf (stderr, "unknown panning curve %s\n", panning_curve);
+		return FALSE;
+	}
+
+	for (i = 0; i < 128; i++) {
+		for (j = 0; j < 128; j++) {
+			volume_lut [i][j] = vol (i, j);
+			panning_lut [i][j] = pan (i, j);
+		}
+	}
+	return TRUE;
+}
+
+
+// raise flag of a CC, with the time of the change
+static void post (int flag, int q)
+{
+	atomic_store (&stamp [flag], micros ());
+	atomic_fetch_or (&pending, (1ull << flag) | (q ? 1ull << (QUANT_FLAG + flag) : 0));
+	atomic_fetch_add (&nb_posted, 1);
+}
+
+
+// flag CC7 of midi channel, to be sent at next audio period with the latest slider position
+void post_volume (int ch)
+{
+	post (ch & 0x0F, FALSE);
+}
+
+
+// flag CC7 of midi channel changed by solo or mute: as post_volume (), and quantized to next beat or bar if set (see schedule.c)
+void post_switch (int ch)
+{
+	post (ch & 0x0F, TRUE);
+}
+
+
+// flag CC10 of midi channel, to be sent at next audio period with the latest knob position
+void post_panning (int ch)
+{
+	post (PAN_FLAG + (ch & 0x0F), FALSE);
+}
+
+
+// send flagged CC7 and CC10 to synth, ponderated by slider and knob positions as they are now, at the time given by the scheduler
+// called by the audio callback before rendering a period; flags raised while sending are kept for next period
+// returns the number of CC sent
+int flush_mixer ()
+{
+	channel_t *chan;
+	uint64_t p;
+	int k, n = 0;
+
+	if ((p = atomic_exchange (&pending, 0)) == 0) return 0;
+
+	for (k = 0; k < NB_MIDI_CHANNEL; k++) {
+		// k is the channel number
+		chan = &channel [k & 0x07][k >> 3];
+		if (p & (1ull << k)) {
+			schedule_volume (k, chan->slider.value, stamp [k], (p >> (QUANT_FLAG + k)) & 1);
+			n++;
+		}
+		if (p & (1ull << (PAN_FLAG + k))) {
+			schedule_cc (k, 10, adjust_panning (chan->knob.value, chan->knob.value_rt), stamp [PAN_FLAG + k], FALSE);
+			n++;
+		}
+	}
+	atomic_fetch_add (&nb_sent, n);
+	return n;
+}
+
+
+// apply slider position sld to midi channel ch: it weights CC7 of the song from now on, and CC7 is sent, ponderated by it
+// called at the time of the scheduled change (see schedule_volume ()), ie. in the synth thread
+void apply_volume (int ch, uint8_t sld)
+{
+	channel_t *chan = &channel [ch & 0x07][(ch >> 3) & 0x01];
+
+	chan->slider.value_applied = sld;
+	fluid_synth_cc (synth, ch, 7, adjust_volume (sld, chan->slider.value_rt));
+}
+
+
+// drop changes in flight (playback stopped, or switched to another song): CC scheduled and not yet applied are removed,
+// and slider positions are applied as they are, without sending anything
+void drop_mixer ()
+{
+	int i, j;
+
+	cancel_schedule ();
+	for (j = 0; j < NB_RECSHIFT; j++) {
+		for (i = 0; i < NB_CHANNEL; i++) channel [i][j].slider.value_applied = channel [i][j].slider.value;
+	}
+}
+
+
+// number of changes flagged by controls, and of CC actually sent to synth, since start
+// the difference is the number of changes coalesced
+void get_mixer_stats (unsigned long *posted, unsigned long *sent)
+{
+	*posted = atomic_load (&nb_posted);
+	*sent = atomic_load (&nb_sent);
+}
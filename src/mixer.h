@@ -0,0 +1,16 @@
+/** @file mixer.h
+ *
+ * @brief This file defines prototypes of functions inside mixer.c
+ *
+ */
+
+uint8_t db_volume (int, int);
+uint8_t power_panning (int, int);
+int init_mixer (char *, char *);
+void post_volume (int);
+void post_switch (int);
+void post_panning (int);
+int flush_mixer ();
+void apply_volume (int, uint8_t);
+void drop_mixer ();
+void get_mixer_stats (unsigned long *, unsigned long *);
@@ -0,0 +1,315 @@
+/** @file optimize.c
+ *
+ * @brief Import of midi files into an optimized form: tracks are merged into a single track (SMF type 0), controller, program and tempo
+ * changes to the value already set are removed, ramps of continuous controllers and pitch bend are thinned to a tolerance, and meta events
+ * that are meaningless once tracks are merged are dropped. Every event removed is one less call of the playback callback and of the synth.
+ * The optimized file is cached next to the original, as a hidden file (eg. ./songs/.01 song.mid.opt), so it is ignored by the library;
+ * the loader plays it instead of the original as long as it is not older than the original.
+ * Thinning never moves a controller further than the tolerance from its original value, and the last point of each ramp is kept,
+ * so controllers end on the same values; state of all channels at any tick is otherwise the same as with the original.
+ *
+ */
+
+#include <unistd.h>
+#include <sys/stat.h>
+#include "types.h"
+#include "globals.h"
+#include "config.h"
+#include "process.h"
+#include "utils.h"
+#include "gpio.h"
+#include "smf.h"
+#include "optimize.h"
+
+#define NB_KEY			(NB_MIDI_CHANNEL * 130)	// controllers of each channel, and pitch bend (128) and channel pressure (129)
+#define RAMP_GAP		8		// a point is within a ramp if the next point of the same controller is less than 1/8 of a beat away
+
+typedef struct {				// file being written
+	uint8_t *buf;
+	size_t len, size;
+} out_t;
+
+
+// continuous controllers whose ramps may be thinned: modulation, breath, foot, volume, pan, expression, brightness
+static int is_continuous (int cc)
+{
+	return (cc == 1) || (cc == 2) || (cc == 4) || (cc == 7) || (cc == 10) || (cc == 11) || (cc == 74);
+}
+
+
+// controllers that are always kept: data entry, increment and decrement, (N)RPN selection (their effect depends on other
+// controllers, not on their own value), and channel mode messages
+static int is_always_kept (int cc)
+{
+	return (cc == 6) || (cc == 38) || ((cc >= 96) && (cc <= 101)) || (cc >= 120);
+}
+
+
+// key of the controller set by an event (channel and controller number, or pitch bend, or channel pressure); -1 if none
+static int event_key (smf_event_t *ev)
+{
+	switch (ev->status & 0xF0) {
+		case 0xB0: return (ev->status & 0x0F) * 130 + (ev->data [0] & 0x7F);
+		case 0xE0: return (ev->status & 0x0F) * 130 + 128;
+		case 0xD0: return (ev->status & 0x0F) * 130 + 129;
+	}
+	return -1;
+}
+
+
+// value set by an event: 7 bits for controllers and channel pressure, 14 bits for pitch bend
+static int event_value (smf_event_t *ev)
+{
+	if ((ev->status & 0xF0) == 0xE0) return (ev->data [0] & 0x7F) | ((ev->data [1] & 0x7F) << 7);
+	if ((ev->status & 0xF0) == 0xD0) return ev->data [0] & 0x7F;
+	return ev->data [1] & 0x7F;
+}
+
+
+// append bytes to file being written
+static int put (out_t *o, uint8_t *p, size_t n)
+{
+	uint8_t *b;
+
+	if (o->len + n > o->size) {
+		o->size = (o->size + n) * 2;
+		if ((b = realloc (o->buf, o->size)) == NULL) return FALSE;
+		o->buf = b;
+	}
+	memcpy (o->buf + o->len, p, n);
+	o->len += n;
+	return TRUE;
+}
+
+
+// append a variable-length quantity
+static int put_vlq (out_t *o, uint32_t v)
+{
+	uint8_t b [5];
+	int n = 4;
+
+	b [4] = v & 0x7F;
+	while ((v >>= 7) != 0) b [--n] = 0x80 | (v & 0x7F);
+	return put (o, b + n, 5 - n);
+}
+
+
+// append a big-endian value of n bytes
+static int put_be (out_t *o, uint32_t v, int n)
+{
+	uint8_t b [4];
+	int i;
+
+	for (i = n - 1; i >= 0; i--, v >>= 8) b [i] = v & 0xFF;
+	return put (o, b, n);
+}
+
+
+// write events flagged in keep into a type 0 midi file, with running status; division is the one of the original file
+static int write_type0 (out_t *o, smf_t *smf, uint8_t *keep, int division)
+{
+	smf_event_t *ev;
+	uint32_t tick = 0, end;
+	size_t trk;
+	uint8_t running = 0;
+	int i, ok;
+
+	ok = put (o, (uint8_t *) "MThd", 4) && put_be (o, 6, 4) && put_be (o, 0, 2) && put_be (o, 1, 2) && put_be (o, division, 2);
+	ok = ok && put (o, (uint8_t *) "MTrk", 4) && put_be (o, 0, 4);
+	trk = o->len;
+
+	for (i = 0; ok && (i < smf->nb_event); i++) {
+		if (!keep [i]) continue;
+		ev = &smf->event [i];
+		ok = put_vlq (o, ev->tick - tick);
+		tick = ev->tick;
+
+		if (ev->status == 0xFF) {
+			ok = ok && put (o, &ev->status, 1) && put (o, ev->data, 1) && put_vlq (o, ev->len) && put (o, ev->meta, ev->len);
+			running = 0;
+		}
+		else if ((ev->status == 0xF0) || (ev->status == 0xF7)) {
+			ok = ok && put (o, &ev->status, 1) && put_vlq (o, ev->len) && put (o, ev->meta, ev->len);
+			running = 0;
+		}
+		else {
+			if (ev->status != running) ok = ok && put (o, &ev->status, 1);
+			running = ev->status;
+			// program change and channel pressure have a single data byte
+			ok = ok && put (o, ev->data, (((ev->status & 0xF0) == 0xC0) || ((ev->status & 0xF0) == 0xD0)) ? 1 : 2);
+		}
+	}
+
+	// single end of track, at the tick of the last event of the original, which may be the end of track of its longest track
+	end = (smf->nb_event > 0) ? smf->event [smf->nb_event - 1].tick : 0;
+	ok = ok && put_vlq (o, end - tick) && put (o, (uint8_t *) "\xFF\x2F\x00", 3);
+	if (!ok) return FALSE;
+
+	// track length
+	for (i = 0; i < 4; i++) o->buf [trk - 4 + i] = ((o->len - trk) >> (8 * (3 - i))) & 0xFF;
+	return TRUE;
+}
+
+
+// name of the optimized file of a midi file: hidden file in the same directory, eg. "./songs/.01 song.mid.opt"
+void optimized_name (char *opt, char *name)
+{
+	char *s;
+
+	s = strrchr (name, '/');
+	if (s == NULL) sprintf (opt, ".%s.opt", name);
+	else sprintf (opt, "%.*s.%s.opt", (int) (s - name + 1), name, s + 1);
+}
+
+
+// TRUE if optimized file of a midi file exists and is not older than the midi file
+int use_optimized (char *name, char *opt)
+{
+	struct stat st, st_opt;
+
+	optimized_name (opt, name);
+	if ((stat (name, &st) != 0) || (stat (opt, &st_opt) != 0)) return FALSE;
+	return (st_opt.st_mtime >= st.st_mtime);
+}
+
+
+// select events of the optimized form, flagged in keep; counts of events removed are added to result
+// returns FALSE if out of memory
+static int select_events (smf_t *smf, uint8_t *keep, int cc_tol, int bend_tol, optimize_t *result)
+{
+	smf_event_t *ev;
+	int *next;
+	int last [NB_KEY], value [NB_KEY];
+	int program [NB_MIDI_CHANNEL], bank [NB_MIDI_CHANNEL];
+	uint32_t gap;
+	int i, k, v, ch, tol, tempo = -1;
+
+	if ((next = malloc ((smf->nb_event + 1) * sizeof (int))) == NULL) return FALSE;
+	gap = smf->division / RAMP_GAP;
+
+	// next event setting the same controller, for each event (backward pass)
+	for (k = 0; k < NB_KEY; k++) last [k] = -1;
+	for (i = smf->nb_event - 1; i >= 0; i--) {
+		if ((k = event_key (&smf->event [i])) < 0) continue;
+		next [i] = last [k];
+		last [k] = i;
+	}
+
+	// value of each controller as set by the events kept so far; -1 if unknown
+	for (k = 0; k < NB_KEY; k++) value [k] = -1;
+	for (ch = 0; ch < NB_MIDI_CHANNEL; ch++) program [ch] = bank [ch] = -1;
+
+	for (i = 0; i < smf->nb_event; i++) {
+		ev = &smf->event [i];
+		keep [i] = TRUE;
+		ch = ev->status & 0x0F;
+
+		// meta events: end of track is written once at the end; channel prefix and port only apply to the track they are in
+		if (ev->status == 0xFF) {
+			if ((ev->data [0] == 0x2F) || (ev->data [0] == 0x20) || (ev->data [0] == 0x21)) {
+				keep [i] = FALSE;
+				result->meta++;
+			}
+			// tempo change to the current tempo
+			else if ((ev->data [0] == 0x51) && (ev->len == 3)) {
+				v = (ev->meta [0] << 16) | (ev->meta [1] << 8) | ev->meta [2];
+				if (v == tempo) {
+					keep [i] = FALSE;
+					result->redundant++;
+				}
+				tempo = v;
+			}
+			continue;
+		}
+
+		// program change to the current program, with no bank select since
+		if ((ev->status & 0xF0) == 0xC0) {
+			if ((program [ch] == ev->data [0]) && (bank [ch] == FALSE)) {
+				keep [i] = FALSE;
+				result->redundant++;
+			}
+			program [ch] = ev->data [0];
+			bank [ch] = FALSE;
+			continue;
+		}
+
+		if ((k = event_key (ev)) < 0) continue;
+		v = event_value (ev);
+
+		if ((ev->status & 0xF0) == 0xB0) {
+			if (is_always_kept (ev->data [0])) {
+				// reset all controllers: values are unknown again
+				if (ev->data [0] == 121) for (k = ch * 130; k < (ch + 1) * 130; k++) value [k] = -1;
+				continue;
+			}
+			if (((ev->data [0] == 0) || (ev->data [0] == 32)) && (v != value [k])) bank [ch] = TRUE;
+		}
+
+		// change to the current value
+		if (v == value [k]) {
+			keep [i] = FALSE;
+			result->redundant++;
+			continue;
+		}
+
+		// point of a ramp, close enough to the last point kept: the ramp goes on shortly after, and its last point is always kept
+		tol = ((ev->status & 0xF0) == 0xE0) ? bend_tol : cc_tol;
+		if ((((ev->status & 0xF0) != 0xB0) || is_continuous (ev->data [0])) && (value [k] != -1) && (abs (v - value [k]) <= tol) &&
+			(next [i] != -1) && (smf->event [next [i]].tick - ev->tick <= gap)) {
+			keep [i] = FALSE;
+			result->thinned++;
+			continue;
+		}
+		value [k] = v;
+	}
+
+	for (i = 0; i < smf->nb_event; i++) result->kept += keep [i];
+	free (next);
+	return TRUE;
+}
+
+
+// import midi file into its optimized form, cached next to it (see optimized_name ())
+// cc_tol and bend_tol are the tolerances of thinning of controller (0-127) and pitch bend (0-16383) ramps; 0 keeps all ramp points
+// counts of events are returned in result
+// returns TRUE if OK, FALSE if file could not be read or written, or is not a midi file
+int optimize_song (char *name, int cc_tol, int bend_tol, optimize_t *result)
+{
+	FILE *fp;
+	smf_t *smf;
+	uint8_t *keep;
+	char opt [400], tmp [410];
+	out_t o;
+	int ok;
+
+	memset (result, 0, sizeof (optimize_t));
+	memset (&o, 0, sizeof (out_t));
+
+	// events of all tracks, merged in tick order
+	if ((smf = smf_read (name)) == NULL) return FALSE;
+	result->size = smf->len;
+	result->tracks = (smf->buf [10] << 8) | smf->buf [11];
+	result->events = smf->nb_event;
+
+	// division of the original file is kept as is, even if SMPTE
+	keep = malloc (smf->nb_event + 1);
+	ok = (keep != NULL) && select_events (smf, keep, cc_tol, bend_tol, result) && write_type0 (&o, smf, keep, (smf->buf [12] << 8) | smf->buf [13]);
+	result->opt_size = o.len;
+	free (keep);
+	smf_free (smf);
+
+	// write to a temporary file, then rename it, so the loader never reads a partly written file
+	if (ok) {
+		optimized_name (opt, name);
+		sprintf (tmp, "%s.tmp", opt);
+		if ((fp = fopen (tmp, "wb")) == NULL) ok = FALSE;
+		else {
+			ok = (fwrite (o.buf, 1, o.len, fp) == o.len);
+			ok = (fclose (fp) == 0) && ok;
+			if (ok) ok = (rename (tmp, opt) == 0);
+			if (!ok) unlink (tmp);
+		}
+	}
+	free (o.buf);
+	return ok;
+}
@@ -0,0 +1,9 @@
+/** @file optimize.h
+ *
+ * @brief This file defines prototypes of functions inside optimize.c
+ *
+ */
+
+void optimized_name (char *, char *);
+int use_optimized (char *, char *);
+int optimize_song (char *, int, int, optimize_t *);
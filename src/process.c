@@ -10,6 +10,18 @@
 #include "process.h"
 #include "utils.h"
 #include "gpio.h"
+#include "loader.h"
+#include "library.h"
+#include "cue.h"
+#include "smf.h"
+#include "section.h"
+#include "abloop.h"
+#include "command.h"
+#include "mixer.h"
+#include "tempomap.h"
+#include "engine.h"
+
+static int set_combo = FALSE;		// TRUE if a marker button has been pressed while SET is held
 
 // generic process function called everytime a known midi command is received
 int process (void *control, uint8_t *data)
@@ -25,20 +37,16 @@ int process_slider (void *control, uint8_t *data)
 
 	slider_t *ctrl;
 	ctrl = control;
-	uint8_t vol;
 
 //	printf ("SLIDER: %02X %02X %02X\n", data[0], data [1], data [2]);
 
 	// get new slider value from the midi control
 	ctrl->value = data[2];
 
-	// ponderate real-time volume value according to slider position
-	vol = adjust_volume (ctrl->value, ctrl->value_rt);
-
 	// send CC7 (sound control) to synthetizer
 	// data[1] is the channel number
-	// we send the current channel volume to synth
-	fluid_synth_cc (synth, data[1], 7, vol);
+	// CC7 is sent once per audio period, ponderated by the latest slider position (see mixer.c)
+	post_volume (data[1]);
 
 	return FLUID_OK;
 }
@@ -48,20 +56,16 @@ int process_slider_shift (void *control, uint8_t *data)
 {
 	slider_t *ctrl;
 	ctrl = control;
-	uint8_t vol;
 
 //	printf ("SLIDER_SHIFT: %02X %02X %02X\n", data[0], data [1], data [2]);
 
 	// get value from the midi control
 	ctrl->value = data[2];
 
-	// ponderate real-time volume value according to slider position
-	vol = adjust_volume (ctrl->value, ctrl->value_rt);
-	
 	// send CC7 (sound control) to synthetizer
 	// data[1]+0x08 is the channel number
-	// we send the current channel volume to synth
-	fluid_synth_cc (synth, data[1]+0x08, 7, vol);
+	// CC7 is sent once per audio period, ponderated by the latest slider position (see mixer.c)
+	post_volume (data[1]+0x08);
 
 	return FLUID_OK;
 }
@@ -71,20 +75,16 @@ int process_knob (void *control, uint8_t *data)
 {
 	knob_t *ctrl;
 	ctrl = control;
-	uint8_t pan;
 
 //	printf ("KNOB: %02X %02X %02X\n", data[0], data [1], data [2]);
 
 	// get value from the midi control
 	ctrl->value = data[2];
 
-	// ponderate real-time panning value according to knob position
-	pan = adjust_panning (ctrl->value, ctrl->value_rt);
-
 	// send CC10 (panning) to synthetizer
 	// data[1]-0x10 is the channel number
-	// we send the current channel panning to synth
-	fluid_synth_cc (synth, data[1]-0x10, 10, pan);
+	// CC10 is sent once per audio period, ponderated by the latest knob position (see mixer.c)
+	post_panning (data[1]-0x10);
 
 	return FLUID_OK;
 }
@@ -94,20 +94,16 @@ int process_knob_shift (void *control, uint8_t *data)
 {
 	knob_t *ctrl;
 	ctrl = control;
-	uint8_t pan;
 
 //	printf ("KNOB_SHIFT: %02X %02X %02X\n", data[0], data [1], data [2]);
 
 	// get value from the midi control
 	ctrl->value = data[2];
 
-	// ponderate real-time panning value according to knob position
-	pan = adjust_panning (ctrl->value, ctrl->value_rt);
-
 	// send CC10 (panning) to synthetizer
 	// data[1]-0x10+0x08 is the channel number
-	// we send the current channel panning to synth
-	fluid_synth_cc (synth, data[1]-0x10+0x08, 10, pan);
+	// CC10 is sent once per audio period, ponderated by the latest knob position (see mixer.c)
+	post_panning (data[1]-0x10+0x08);
 
 	return FLUID_OK;
 }
@@ -119,7 +115,6 @@ int process_solo (void *control, uint8_t *data)
 	int i, j, k, cc, ch;
 	button_t *ctrl;
 	ctrl = control;
-	uint8_t vol;
 
 //	printf ("SOLO: %02X %02X %02X\n", data[0], data [1], data [2]);
 
@@ -147,13 +142,11 @@ int process_solo (void *control, uint8_t *data)
 				if (ch != k) {
 					// set slider value to 0 to mute the channel
 					channel[i][j].slider.value = 0x00;
-					// ponderate real-time volume value according to slider position
-					vol = adjust_volume (channel[i][j].slider.value, channel[i][j].slider.value_rt);
 					// send CC7 (sound control) to synthetizer to mute the channel
 					// k is the channel number
 					// use real-time volume value as value of CC7
 					// channel will be muted as slider value has been forced to 0
-					fluid_synth_cc (synth, k, 7, vol);
+					post_switch (k);
 				}
 			}
 		}
@@ -170,13 +163,11 @@ int process_solo (void *control, uint8_t *data)
 				if (ch != k) {
 					// get current slider value from the corresponding slider value_s
 					channel[i][j].slider.value = channel[i][j].slider.value_s;
-					// ponderate real-time volume value according to slider position
-					vol = adjust_volume (channel[i][j].slider.value, channel[i][j].slider.value_rt);
 					// send CC7 (sound control) to synthetizer to unmute the channel
 					// k is the channel number
 					// use real-time volume value as value of CC7
 					// channel will be unmuted as slider value has been restored
-					fluid_synth_cc (synth, k, 7, vol);
+					post_switch (k);
 				}
 			}
 		}
@@ -192,7 +183,6 @@ int process_solo_shift (void *control, uint8_t *data)
 	int i, j, k, cc, ch;
 	button_t *ctrl;
 	ctrl = control;
-	uint8_t vol;
 
 //	printf ("SOLO_SHIFT: %02X %02X %02X\n", data[0], data [1], data [2]);
 
@@ -220,14 +210,11 @@ int process_solo_shift (void *control, uint8_t *data)
 				if (ch != k) {
 					// set slider value to 0 to mute the channel
 					channel[i][j].slider.value = 0x00;
-					// ponderate real-time volume value according to slider position
-					vol = adjust_volume (channel[i][j].slider.value, channel[i][j].slider.value_rt);
-
 					// send CC7 (sound control) to synthetizer to mute the channel
 					// k is the channel number
 					// use real-time volume value as value of CC7
 					// channel will be muted as slider value has been forced to 0
-					fluid_synth_cc (synth, k, 7, vol);
+					post_switch (k);
 				}
 			}
 		}
@@ -244,13 +231,11 @@ int process_solo_shift (void *control, uint8_t *data)
 				if (ch != k) {
 					// get current slider value from the corresponding slider value_s
 					channel[i][j].slider.value = channel[i][j].slider.value_s;
-					// ponderate real-time volume value according to slider position
-					vol = adjust_volume (channel[i][j].slider.value, channel[i][j].slider.value_rt);
 					// send CC7 (sound control) to synthetizer to unmute the channel
 					// k is the channel number
 					// use real-time volume value as value of CC7
 					// channel will be unmuted as slider value has been restored
-					fluid_synth_cc (synth, k, 7, vol);
+					post_switch (k);
 				}
 			}
 		}
@@ -266,7 +251,6 @@ int process_mute (void *control, uint8_t *data)
 	int i;
 	button_t *ctrl;
 	ctrl = control;
-	uint8_t vol;
 	
 //	printf ("MUTE: %02X %02X %02X\n", data[0], data [1], data [2]);
 	// get channel number
@@ -284,24 +268,20 @@ int process_mute (void *control, uint8_t *data)
 		channel[i][0].slider.value_m = channel[i][0].slider.value;
 		// set slider value to 0 to mute the channel
 		channel[i][0].slider.value = 0x00;
-		// ponderate real-time volume value according to slider position
-		vol = adjust_volume (channel[i][0].slider.value, channel[i][0].slider.value_rt);
 		// send CC7 (sound control) to synthetizer to mute the channel
 		// i is the channel number
 		// use real-time volume value as value of CC7
 		// channel will be muted as slider value has been forced to 0
-		fluid_synth_cc (synth, i, 7, vol);
+		post_switch (i);
 	}
 	else {
 		// mute OFF
 		// get current slider value from the corresponding slider value_m
 		channel[i][0].slider.value = channel[i][0].slider.value_m;
-		// ponderate real-time volume value according to slider position
-		vol = adjust_volume (channel[i][0].slider.value, channel[i][0].slider.value_rt);
 		// send CC7 (sound control) to synthetizer to unmute the channel
 		// i is the channel number
 		// use real-time volume value as value of CC7
-		fluid_synth_cc (synth, i, 7, vol);
+		post_switch (i);
 	}
 
 	return FLUID_OK;
@@ -314,7 +294,6 @@ int process_mute_shift (void *control, uint8_t *data)
 	int i;
 	button_t *ctrl;
 	ctrl = control;
-	uint8_t vol;
 	
 //	printf ("MUTE_SHIFT: %02X %02X %02X\n", data[0], data [1], data [2]);
 	// get channel number
@@ -332,24 +311,20 @@ int process_mute_shift (void *control, uint8_t *data)
 		channel[i-0x08][1].slider.value_m = channel[i-0x08][1].slider.value;
 		// set slider value to 0 to mute the channel
 		channel[i-0x08][1].slider.value = 0x00;
-		// ponderate real-time volume value according to slider position
-		vol = adjust_volume (channel[i-0x08][1].slider.value, channel[i-0x08][1].slider.value_rt);
 		// send CC7 (sound control) to synthetizer to mute the channel
 		// i is the channel number
 		// use real-time volume value as value of CC7
 		// channel will be muted as slider value has been forced to 0
-		fluid_synth_cc (synth, i, 7, vol);
+		post_switch (i);
 	}
 	else {
 		// mute OFF
 		// get current slider value from the corresponding slider value_m
 		channel[i-0x08][1].slider.value = channel[i-0x08][1].slider.value_m;
-		// ponderate real-time volume value according to slider position
-		vol = adjust_volume (channel[i-0x08][1].slider.value, channel[i-0x08][1].slider.value_rt);
 		// send CC7 (sound control) to synthetizer to unmute the channel
 		// i is the channel number
 		// use real-time volume value as value of CC7
-		fluid_synth_cc (synth, i, 7, vol);
+		post_switch (i);
 	}
 
 	return FLUID_OK;
@@ -400,8 +375,11 @@ int process_track_l (void *control, uint8_t *data)
 
 	// do something only if button is pressed (but don't do anything if released)
 	if (data [2] != 0) {
-		// decrease midi file number until it reaches 0
-		if (new_midi_num > 0) new_midi_num--; 
+		// go to previous song in the bank, if any
+		new_midi_num = step_song (new_midi_num, -1);
+		print_song (new_midi_num);
+		// start preparing new file in background
+		request_load ();
 	}
 
 	// no need to update value of ctrl (it is not used)
@@ -421,8 +399,11 @@ int process_track_r (void *control, uint8_t *data)
 
 	// do something only if button is pressed (but don't do anything if released)
 	if (data [2] != 0) {
-		// increase midi file number until it reaches FF
-		if (new_midi_num < 0xFF) new_midi_num++; 
+		// go to next song in the bank, if any
+		new_midi_num = step_song (new_midi_num, 1);
+		print_song (new_midi_num);
+		// start preparing new file in background
+		request_load ();
 	}
 
 	// no need to update value of ctrl (it is not used)
@@ -443,7 +424,9 @@ int process_track_l_shift (void *control, uint8_t *data)
 	// do something only if button is pressed (but don't do anything if released)
 	if (data [2] != 0) {
 		// decrease sf2 file number until it reaches 0
-		if (new_sf2_num > 0) new_sf2_num--; 
+		if (new_sf2_num > 0) new_sf2_num--;
+		// start preparing new file in background
+		request_load ();
 	}
 
 	// no need to update value of ctrl (it is not used)
@@ -464,7 +447,9 @@ int process_track_r_shift (void *control, uint8_t *data)
 	// do something only if button is pressed (but don't do anything if released)
 	if (data [2] != 0) {
 		// increase soundfont file number until it reaches FF
-		if (new_sf2_num < 0xFF) new_sf2_num++; 
+		if (new_sf2_num < 0xFF) new_sf2_num++;
+		// start preparing new file in background
+		request_load ();
 	}
 
 	// no need to update value of ctrl (it is not used)
@@ -486,15 +471,15 @@ int process_rwd (void *control, uint8_t *data)
 	if (data [2] != 0) {
 		// get initial BPM, in case we don't have it yet
 		if (initial_bpm == -1) {
-			initial_bpm = (fluid_player_get_bpm (player) == FLUID_FAILED) ? 0 : fluid_player_get_bpm (player);
+			initial_bpm = (engine_get_bpm (player) == FLUID_FAILED) ? 0 : engine_get_bpm (player);
 		}
 
 		// get bpm of the file
-		bpm = (fluid_player_get_bpm (player) == FLUID_FAILED) ? 0 : fluid_player_get_bpm (player);
+		bpm = (engine_get_bpm (player) == FLUID_FAILED) ? 0 : engine_get_bpm (player);
 
 		// adjust tempo: decrements until is reaches 0
 		bpm = (bpm <= 0) ? 0 : (bpm - 2);
-		fluid_player_set_tempo (player, FLUID_PLAYER_TEMPO_EXTERNAL_BPM, bpm);
+		engine_set_bpm (player, bpm);
 
 		// this part is useless as we cannot control the leds for now
 		// if bpm == 0, then light on bpm down pad to indicate we have reached the lower limit
@@ -534,15 +519,15 @@ int process_fwd (void *control, uint8_t *data)
 	if (data [2] != 0) {
 		// get initial BPM, in case we don't have it yet
 		if (initial_bpm == -1) {
-			initial_bpm = (fluid_player_get_bpm (player) == FLUID_FAILED) ? 0 : fluid_player_get_bpm (player);
+			initial_bpm = (engine_get_bpm (player) == FLUID_FAILED) ? 0 : engine_get_bpm (player);
 		}
 
 		// get bpm of the file
-		bpm = (fluid_player_get_bpm (player) == FLUID_FAILED) ? 0 : fluid_player_get_bpm (player);
+		bpm = (engine_get_bpm (player) == FLUID_FAILED) ? 0 : engine_get_bpm (player);
 
 		// adjust tempo: increments until it reaches 60000000
 		bpm = (bpm >= 60000000) ? 60000000 : (bpm + 2);
-		fluid_player_set_tempo (player, FLUID_PLAYER_TEMPO_EXTERNAL_BPM, bpm);
+		engine_set_bpm (player, bpm);
 
 		// this part is useless as we cannot control the leds for now
 		// if bpm == 60000000, then light on bpm up pad to indicate we have reached the higher limit
@@ -662,13 +647,21 @@ int process_play (void *control, uint8_t *data)
 
 	// do something only if button is pressed (but don't do anything if released)
 	if (data [2] != 0) {
-		// load new midi file and new sf2, if required
+		// another song has been selected while playing: cue it, so it starts without gap at the end of current song
+		// pressing play again brings the switch forward to the next bar
+		if ((engine_get_status (player) == ENGINE_PLAYING) && ((new_midi_num != current_midi_num) || is_cued ())) {
+			cue_next ();
+			return FLUID_OK;
+		}
+
+		// note time when play is pressed, to measure latency until first note is played
+		play_us = micros ();
+
+		// swap in new midi file and new sf2, if required
 		load_midi_sf2 ();
-		
-		// reset marker position
-		marker_pos = 0;
+
 		// rewind to the beggining of the file
-		fluid_player_seek (player, 0);
+		engine_seek (player, 0);
 
 		// set channels' real-time volume to max 
 		set_volume_value (0x7F);
@@ -679,7 +672,7 @@ int process_play (void *control, uint8_t *data)
 		reset_song_panning ();
 
 		// play the midi files, if any
-		fluid_player_play (player);
+		engine_play (player);
 	}
 
 	// no need to update value of ctrl (it is not used)
@@ -693,14 +686,20 @@ int process_play (void *control, uint8_t *data)
 int process_stop (void *control, uint8_t *data)
 {
 	button_t *ctrl;
+	char pos [80];
 	ctrl = control;
 
 //	printf ("STOP: %02X %02X %02X\n", data[0], data [1], data [2]);
 
 	// do something only if button is pressed (but don't do anything if released)
 	if (data [2] != 0) {
-		// stop playing the midi file, if any
-		fluid_player_stop (player);
+		// stop playing the midi file, if any, and tell where it has been stopped
+		if (engine_get_status (player) == ENGINE_PLAYING) {
+			printf ("stop at %s\n", position_string (&player->map, engine_get_current_tick (player), engine_get_total_ticks (player), pos));
+		}
+		engine_stop (player);
+		// solo, mute and slider changes not yet applied are dropped
+		drop_mixer ();
 	}
 
 	// no need to update value of ctrl (it is not used)
@@ -722,7 +721,7 @@ int process_record (void *control, uint8_t *data)
 	if (data [2] != 0) {
 
 		// make sure no file is playing to allow save !
-		if ((fluid_player_get_status (player)== FLUID_PLAYER_DONE) || (fluid_player_get_status (player)== FLUID_PLAYER_READY)) save_song (new_midi_num);
+		if ((engine_get_status (player)== ENGINE_DONE) || (engine_get_status (player)== ENGINE_READY)) save_song (new_midi_num);
 	}
 
 	// no need to update value of ctrl (it is not used)
@@ -731,33 +730,33 @@ int process_record (void *control, uint8_t *data)
 	return FLUID_OK;
 }
 
-// process function called everytime set button is pressed
+// process function called everytime set button is pressed or released
 // MOMENTARY MODE ON
+// SET held with marker < or > sets the ends of the loop; SET alone adds a time marker at the time of press, or clears the loop
 int process_set (void *control, uint8_t *data)
 {
-	int mark, i;
+	static int set_tick;		// tick when set was pressed
 	button_t *ctrl;
 	ctrl = control;
 
 //	printf ("SET: %02X %02X %02X\n", data[0], data [1], data [2]);
 
-	// do something only if button is pressed (but don't do anything if released)
+	// button pressed: note current tick, action is done at release
 	if (data [2] != 0) {
-		// get current tick
-		mark = fluid_player_get_current_tick (player);
-		// save it to the table at the first available (ie. non-0) position
-		// also make sure mark is not 0 (meaning : we are at the beginning of the file)
-		if (mark != 0) {
-			for (i = 0; i < NB_MARKER; i++) {
-				if (marker [i] == 0) {
-					marker [i] = mark;		// free slot found in marker table: store marker in table
-//					printf ("set mark %d at tick %d\n", i, mark);
-					break;					// and leave loop
-				}
-			}
-		}
+		set_tick = engine_get_current_tick (player);
+		set_combo = FALSE;
 	}
-	// no need to update value of ctrl (it is not used)
+	// button released, and not used with a marker button
+	else if ((ctrl->value != 0) && (set_combo == FALSE)) {
+		if (is_looping ()) clear_loop ();
+		// add tick to the sections of the song, at its place in time
+		// mark is not added if 0 (meaning : we are at the beginning of the file)
+		else add_mark (set_tick);
+//		printf ("set mark at tick %d\n", set_tick);
+	}
+
+	// value of ctrl tells if set is held
+	ctrl->value = data [2];
 	// no need to set any led (no led for this control)
 
 	return FLUID_OK;
@@ -774,15 +773,14 @@ int process_marker_l (void *control, uint8_t *data)
 
 	// do something only if button is pressed (but don't do anything if released)
 	if (data [2] != 0) {
-		// leaves if no marker is set for current position
-		if (marker [marker_pos] == 0) return FLUID_OK;
-
-		// decrement position in marker table
-		if (marker_pos > 0) marker_pos--;
-
-		// seek position in the file set by the marker
-		fluid_player_seek (player, marker [marker_pos]);
-//		printf ("marker left, index %d tick %d\n", marker_pos, marker [marker_pos]);
+		// SET held: loop start at start of current section (or previous section if loop already starts there)
+		if (set.value != 0) {
+			set_combo = TRUE;
+			set_loop_start (engine_get_current_tick (player));
+			return FLUID_OK;
+		}
+		// restore channel state at previous section of the song, and seek to it (nothing is done if there is none)
+		seek_section (prev_section (engine_get_current_tick (player)));
 	}
 
 	// no need to update value of ctrl (it is not used)
@@ -802,18 +800,62 @@ int process_marker_r (void *control, uint8_t *data)
 
 	// do something only if button is pressed (but don't do anything if released)
 	if (data [2] != 0) {
-		// leaves if no marker is set for current position
-		if (marker [marker_pos] == 0) return FLUID_OK;
+		// SET held: loop current section (or extend loop to next section if loop is already active)
+		if (set.value != 0) {
+			set_combo = TRUE;
+			set_loop_end (engine_get_current_tick (player));
+			return FLUID_OK;
+		}
+		// restore channel state at next section of the song, and seek to it (nothing is done if there is none)
+		seek_section (next_section (engine_get_current_tick (player)));
+	}
+
+	// no need to update value of ctrl (it is not used)
+	// no need to set any led (no led for this control)
+
+	return FLUID_OK;
+}
+
+// process function called everytime marker_l button is pressed and shift is ON
+// MOMENTARY MODE ON
+int process_marker_l_shift (void *control, uint8_t *data)
+{
+	button_t *ctrl;
+	ctrl = control;
+
+//	printf ("MARKER_L_SHIFT: %02X %02X %02X\n", data[0], data [1], data [2]);
+
+	// do something only if button is pressed (but don't do anything if released)
+	if (data [2] != 0) {
+		// go to first song of previous bank, if any
+		new_midi_num = step_bank (new_midi_num, -1);
+		print_song (new_midi_num);
+		// start preparing new file in background
+		request_load ();
+	}
+
+	// no need to update value of ctrl (it is not used)
+	// no need to set any led (no led for this control)
+
+	return FLUID_OK;
+}
 
-		// increment position in marker table
-		if (marker_pos < (NB_MARKER - 1)) marker_pos++;
+// process function called everytime marker_r button is pressed and shift is ON
+// MOMENTARY MODE ON
+int process_marker_r_shift (void *control, uint8_t *data)
+{
+	button_t *ctrl;
+	ctrl = control;
 
-		// in case there is no marker on new position, go back to old position
-		if (marker [marker_pos] == 0) marker_pos--;
+//	printf ("MARKER_R_SHIFT: %02X %02X %02X\n", data[0], data [1], data [2]);
 
-		// seek position in the file set by the marker
-		fluid_player_seek (player, marker [marker_pos]);
-//		printf ("marker right, index %d tick %d\n", marker_pos, marker [marker_pos]);
+	// do something only if button is pressed (but don't do anything if released)
+	if (data [2] != 0) {
+		// go to first song of next bank, if any
+		new_midi_num = step_bank (new_midi_num, 1);
+		print_song (new_midi_num);
+		// start preparing new file in background
+		request_load ();
 	}
 
 	// no need to update value of ctrl (it is not used)
@@ -823,15 +865,10 @@ int process_marker_r (void *control, uint8_t *data)
 }
 
 // fluid callback called every time a MIDI message is received from hardware device
+// called in the midi driver thread: the message of a control is only pushed to the main loop, which owns control state
 int handle_midi_event_from_hw(void* data, fluid_midi_event_t* event)
 {
-	fluid_synth_t* s;
-	int i;
-	channel_t *chan;			// intermediate struct to simplify code lisibility
 	uint8_t mididata[3];		// one single structure regardless of midi event type
-	
-		// define data as being a pointer to fluid_synth_t structure
-	s = (fluid_synth_t*) data;
 
 	// fill mididata as per midi event type
 	mididata[0] = fluid_midi_event_get_type(event);
@@ -847,63 +884,49 @@ int handle_midi_event_from_hw(void* data, fluid_midi_event_t* event)
 		mididata[2] = fluid_midi_event_get_value(event);
 	}
 
-	// PLAY
-	if (memcmp (play.message, mididata, 2)==0) return play.action (&play, mididata);
-	// STOP
-	if (memcmp (stop.message, mididata, 2)==0) return stop.action (&stop, mididata);
-	// RECORD
-	if (memcmp (record.message, mididata, 2)==0) return record.action (&record, mididata);
-
-	// SET
-	if (memcmp (set.message, mididata, 2)==0) return set.action (&set, mididata);
-	// MARKER_L
-	if (memcmp (marker_l.message, mididata, 2)==0) return marker_l.action (&marker_l, mididata);
-	// MARKER_R
-	if (memcmp (marker_r.message, mididata, 2)==0) return marker_r.action (&marker_r, mididata);
-
-	// CYCLE
-	if (memcmp (cycle.message, mididata, 2)==0) return cycle.action (&cycle, mididata);
-
-	// TRACK_L
-	if (memcmp (track_l[cycle.value].message, mididata, 2)==0) return track_l[cycle.value].action (&track_l[cycle.value], mididata);
-	// TRACK_R
-	if (memcmp (track_r[cycle.value].message, mididata, 2)==0) return track_r[cycle.value].action (&track_r[cycle.value], mididata);
-	// RWD
-	if (memcmp (rwd[cycle.value].message, mididata, 2)==0) return rwd[cycle.value].action (&rwd[cycle.value], mididata);
-	// FWD
-	if (memcmp (fwd[cycle.value].message, mididata, 2)==0) return fwd[cycle.value].action (&fwd[cycle.value], mididata);
-
-	// CHANNELS
-	// check whether received event correponds to a channel event
-	for (i = 0; i<NB_CHANNEL; i++) {
-		chan = & (channel[i][channel[i][0].rec.value & 0x01]);
-		// SLIDER
-		if (memcmp (chan->slider.message, mididata, 2)==0) return chan->slider.action (&(chan->slider), mididata);
-		// KNOB
-		if (memcmp (chan->knob.message, mididata, 2)==0) return chan->knob.action (&(chan->knob), mididata);
-		// SOLO
-		if (memcmp (chan->solo.message, mididata, 2)==0) return chan->solo.action (&(chan->solo), mididata);
-		// MUTE
-		if (memcmp (chan->mute.message, mididata, 2)==0) return chan->mute.action (&(chan->mute), mididata);
-		// REC: take only value 0 into account
-		chan = & (channel[i][0]);
-		if (memcmp (chan->rec.message, mididata, 2)==0) return chan->rec.action (&(chan->rec), mididata);
-	}
+	// leave if midi message is not assigned to any control (dispatch table is not changed once built)
+	if (dispatch [(mididata[0] >> 4) & 0x07] [mididata[1] & 0x7F].action [0] == NULL) return FLUID_OK;
 
+	push_command (CMD_FROM_MIDI, CMD_CONTROL, mididata);
 	return FLUID_OK;
 }
 
 
-// fluid callback called every time a MIDI message is to be sent to the synth
+// execute the action of the control corresponding to a midi message received from hardware device
+// called in the main loop (see command.c)
+int dispatch_control (uint8_t *mididata)
+{
+	dispatch_t *d;				// dispatch table entry of the midi message
+	uint8_t shift;
+
+	// find control in dispatch table, indexed on status nibble and controller number
+	d = &dispatch [(mididata[0] >> 4) & 0x07] [mididata[1] & 0x7F];
+
+	// leave if midi message is not assigned to any control
+	if (d->action [0] == NULL) return FLUID_OK;
+
+	// call action of the control according to the state of its shift key (cycle, rec...)
+	shift = *(d->shift) & 0x01;
+	return d->action [shift] (d->control [shift], mididata);
+}
+
+
+// callback called by the song engine every time a MIDI message is to be sent to the synth
 // we use this call to intercept Volume and panning CC, so the requested vol and pan values are ponderated by
 // corresponding slider and knob position
 // to activate this callback, use the statement:
-// fluid_player_set_playback_callback (player, handle_midi_event_to_synth, (void *) synth);
+// engine_set_playback_callback (player, handle_midi_event_to_synth, (void *) synth);
 int handle_midi_event_to_synth(void* data, fluid_midi_event_t* event)
 {
 	channel_t *chan;			// intermediate struct to simplify code lisibility
 	uint8_t echannel, econtrol, evalue;
 
+	// latency instrumentation: time between press on PLAY and first note sent to synth
+	if ((play_us != 0) && (fluid_midi_event_get_type(event) == 0x90) && (fluid_midi_event_get_velocity(event) != 0)) {
+		printf ("play latency: %llu us\n", (unsigned long long) (micros () - play_us));
+		play_us = 0;
+	}
+
 	// process midi event here
 	// we only want to process CC messages
 	if (fluid_midi_event_get_type(event) == 0xB0) {
@@ -923,8 +946,9 @@ int handle_midi_event_to_synth(void* data, fluid_midi_event_t* event)
 			// first, save received CC7 value as the real-time volume
 			chan->slider.value_rt = evalue;			// we have received volume event, save the new requested value for the volume 
 
-			// calculate new value for CC7, ponderated by slider position
-			evalue = adjust_volume (chan->slider.value, chan->slider.value_rt);
+			// calculate new value for CC7, ponderated by slider position: a single access to the mixer table
+			// slider position is the one applied to the song: a solo or mute quantized to the next beat does not apply before it
+			evalue = volume_lut [chan->slider.value_applied & 0x7F] [evalue & 0x7F];
 			fluid_midi_event_set_value (event, evalue);
 //			printf ("     MODIF %02x %02x %02x\n", echannel, econtrol, evalue);
 		}
@@ -935,8 +959,8 @@ int handle_midi_event_to_synth(void* data, fluid_midi_event_t* event)
 			// first, save received CC10 value as the real-time panning
 			chan->knob.value_rt = evalue;			// we have received panning event, save the new requested value for the panning 
 
-			// calculate new value for CC10, ponderated by knob position
-			evalue = adjust_panning (chan->knob.value, chan->knob.value_rt);
+			// calculate new value for CC10, ponderated by knob position: a single access to the mixer table
+			evalue = panning_lut [chan->knob.value & 0x7F] [evalue & 0x7F];
 			fluid_midi_event_set_value (event, evalue);
 //			printf ("     MODIF %02x %02x %02x\n", echannel, econtrol, evalue);
 		}
@@ -948,31 +972,31 @@ int handle_midi_event_to_synth(void* data, fluid_midi_event_t* event)
 }
 
 
+// callback called by the song engine at each audio block, with the current tick of the song (in the synth thread)
+// data is the player itself: callbacks of players that are not current anymore are ignored
+// to activate this callback, use the statement:
+// engine_set_tick_callback (player, handle_tick, (void *) player);
+int handle_tick (void* data, int tick)
+{
+	if (data != (void *) player) return FLUID_OK;
+
+	// loop wrap comes first: a song cued at next bar switches at the loop boundary
+	loop_tick (tick);
+	return cue_tick (tick);
+}
+
+
 // ponderate volume value with slider position, and return this to be set as value of cc
+// response curve of the slider is in the mixer table (see mixer.c)
 uint8_t adjust_volume (uint8_t sld, uint8_t vol) {
-	float a;								// temp variable to manage volume
-	uint8_t res=0;
 
-	// ponderate the volume with slider position before sending CC7 to synth
-	a = sld / 127.0f;						// slider value is now a value between 0 and 1 in float
-	a *= vol;								// current volume value is adjusted according to slider value
-	res = (uint8_t) a;						// set new volume value to be sent in CC
-
-	return res;
+	return volume_lut [sld & 0x7F][vol & 0x7F];
 }
 
 
 // ponderate panning value with knob position, and return this to be set as value of cc
+// response curve of the knob is in the mixer table (see mixer.c)
 uint8_t adjust_panning (uint8_t knb, uint8_t pan) {
-	int a;								// temp variable to manage panning
-	uint8_t res=0;
-
-	// ponderate the volume with slider position before sending CC7 to synth
-	a = knb - 0x40;						// a has values from -64 to +63
-	a += pan;							// incoming CC10 panning value is ajusted according to knob value
-	if (a < 0) a = 0;					// test upper and lower values
-	if (a > 0x7f) a = 0x7f;
-	res = (uint8_t) a;					// set new volume value to be sent in CC
 
-	return res;
+	return panning_lut [knb & 0x7F][pan & 0x7F];
 }
@@ -29,8 +29,12 @@ int process_record (void *, uint8_t *);
 int process_set (void *, uint8_t *);
 int process_marker_l (void *, uint8_t *);
 int process_marker_r (void *, uint8_t *);
+int process_marker_l_shift (void *, uint8_t *);
+int process_marker_r_shift (void *, uint8_t *);
 int handle_midi_event_from_hw (void*, fluid_midi_event_t*);
+int dispatch_control (uint8_t *);
 int handle_midi_event_to_synth (void*, fluid_midi_event_t*);
+int handle_tick (void*, int);
 uint8_t adjust_volume (uint8_t, uint8_t); 
 uint8_t adjust_panning (uint8_t, uint8_t);
 
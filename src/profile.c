@@ -0,0 +1,223 @@
+/** @file profile.c
+ *
+ * @brief Load profile of songs: a song is rendered offline through its song engine, faster than realtime, and voices and render time
+ * are recorded per block. The profile gives the polyphony and quality level advised for the song; it is saved next to the
+ * context of the song (./save/XX.prof), and read by syntwo when the song is loaded.
+ *
+ */
+
+#include "types.h"
+#include "globals.h"
+#include "config.h"
+#include "process.h"
+#include "utils.h"
+#include "gpio.h"
+#include "govern.h"
+#include "smf.h"
+#include "engine.h"
+#include "profile.h"
+
+#define PROFILE_LOAD	70.0	// cpu load (%) of the busiest second above which quality is lowered up front
+#define PROFILE_MARGIN	1.25	// advised polyphony is peak polyphony plus 25%...
+#define PROFILE_STEP	16		// ...rounded up to a multiple of 16...
+#define PROFILE_MIN		32		// ...and at least 32
+#define TAIL_S			5		// max time rendered after the end of the song, while voices are released
+
+
+// render midi file with the synth and the soundfonts loaded in it, through a song engine as in the audio callback
+// voices and cpu time are recorded for each block, in prof
+// returns TRUE if OK, FALSE if file could not be rendered
+int render_song (char *midi, profile_t *prof)
+{
+	engine_t *p;
+	smf_t *smf;
+	fluid_voice_t **voice;
+	float *left, *right, *out [2];
+	double rate;
+	uint64_t start, cpu, total = 0, frames = 0, tail = 0, nb_block = 0, sum_voices = 0;
+	int period, poly, i, n, sec, v, count [NB_MIDI_CHANNEL];
+	void *m;
+
+	memset (prof, 0, sizeof (profile_t));
+	fluid_settings_getint (settings, "audio.period-size", &period);
+	fluid_settings_getnum (settings, "synth.sample-rate", &rate);
+	poly = fluid_synth_get_polyphony (synth);
+	if ((voice = malloc ((poly + 1) * sizeof (fluid_voice_t *))) == NULL) return FALSE;
+
+	// events are copied by the engine: event table is not needed afterwards
+	smf = smf_read (midi);
+	p = (smf != NULL) ? new_engine (synth, smf) : NULL;
+	smf_free (smf);
+	left = malloc (period * sizeof (float));
+	right = malloc (period * sizeof (float));
+	if ((p == NULL) || (left == NULL) || (right == NULL) || (engine_play (p) != FLUID_OK)) {
+		fprintf (stderr, "cannot render %s\n", midi);
+		delete_engine (p);
+		free (left);
+		free (right);
+		free (voice);
+		return FALSE;
+	}
+	out [0] = left;
+	out [1] = right;
+
+	// render until end of song, then until all voices are released
+	while ((engine_get_status (p) == ENGINE_PLAYING) ||
+		((fluid_synth_get_active_voice_count (synth) > 0) && (tail < TAIL_S * rate))) {
+		if (engine_get_status (p) != ENGINE_PLAYING) tail += period;
+
+		// render time of a block is elapsed time, as for fluid_synth_get_cpu_load (): with synth.cpu-cores above 1,
+		// voices are also rendered by helper threads, and the block is ready when the slowest core is done
+		start = micros ();
+		if (process_engines (synth, period, 0, NULL, 2, out) != FLUID_OK) break;
+		cpu = micros () - start;
+		total += cpu;
+		nb_block++;
+		if (cpu > prof->max_block_us) prof->max_block_us = cpu;
+
+		// voices of the synth and of each channel
+		memset (count, 0, sizeof (count));
+		fluid_synth_get_voicelist (synth, voice, poly + 1, -1);
+		for (i = 0, n = 0; (i <= poly) && (voice [i] != NULL); i++) {
+			if (!fluid_voice_is_playing (voice [i])) continue;
+			n++;
+			v = fluid_voice_get_channel (voice [i]);
+			if ((v >= 0) && (v < NB_MIDI_CHANNEL)) count [v]++;
+		}
+		if (n > prof->peak_voices) prof->peak_voices = n;
+		sum_voices += n;
+		for (i = 0; i < NB_MIDI_CHANNEL; i++) {
+			if (count [i] > prof->peak_channel [i]) prof->peak_channel [i] = count [i];
+		}
+
+		// per-second statistics, on the time of the song
+		sec = (int) (frames / rate);
+		if (sec >= prof->nb_second) {
+			if ((sec % 64) == 0) {
+				if ((m = realloc (prof->voices, (sec + 64) * sizeof (uint16_t))) == NULL) break;
+				prof->voices = m;
+				if ((m = realloc (prof->cpu_us, (sec + 64) * sizeof (uint32_t))) == NULL) break;
+				prof->cpu_us = m;
+			}
+			prof->voices [sec] = 0;
+			prof->cpu_us [sec] = 0;
+			prof->nb_second = sec + 1;
+		}
+		if (n > prof->voices [sec]) prof->voices [sec] = n;
+		prof->cpu_us [sec] += cpu;
+		frames += period;
+	}
+
+	delete_engine (p);
+	fluid_synth_system_reset (synth);
+	free (left);
+	free (right);
+	free (voice);
+
+	prof->duration_ms = (uint32_t) (frames * 1000.0 / rate);
+	prof->mean_block_us = (nb_block > 0) ? (double) total / nb_block : 0.0;
+	prof->mean_voices = (nb_block > 0) ? (double) sum_voices / nb_block : 0.0;
+	prof->rt_factor = (total > 0) ? (frames * 1000000.0 / rate) / total : 0.0;
+	for (i = 0; i < prof->nb_second; i++) {
+		if (prof->cpu_us [i] / 10000.0 > prof->peak_load) prof->peak_load = prof->cpu_us [i] / 10000.0;
+	}
+	return TRUE;
+}
+
+
+// profile a song: render it at full quality, then advise polyphony from its peak polyphony;
+// if the busiest second is too loaded, render it again at lower quality levels until it is not
+// returns TRUE if OK, FALSE if file could not be rendered
+int profile_song (char *midi, profile_t *prof)
+{
+	profile_t p;
+	int poly, l;
+
+	set_governor_level (0, 0);
+	poly = fluid_synth_get_polyphony (synth);
+	if (render_song (midi, prof) == FALSE) return FALSE;
+
+	// advised polyphony; if polyphony of the synth has been reached, more voices would have been played
+	prof->polyphony = poly;
+	if (prof->peak_voices < poly) {
+		prof->polyphony = ((int) (prof->peak_voices * PROFILE_MARGIN) + PROFILE_STEP - 1) / PROFILE_STEP * PROFILE_STEP;
+		if (prof->polyphony < PROFILE_MIN) prof->polyphony = PROFILE_MIN;
+		if (prof->polyphony > poly) prof->polyphony = poly;
+	}
+
+	// advised quality level
+	prof->level = 0;
+	if (prof->peak_load > PROFILE_LOAD) {
+		for (l = 1; set_governor_level (prof->polyphony, l); l++) {
+			prof->level = l;
+			if (render_song (midi, &p) == FALSE) break;
+			free_profile (&p);
+			if (p.peak_load <= PROFILE_LOAD) break;
+		}
+	}
+
+	set_governor_level (0, 0);
+	return TRUE;
+}
+
+
+// free per-second statistics of a profile
+void free_profile (profile_t *prof)
+{
+	free (prof->voices);
+	free (prof->cpu_us);
+	prof->voices = NULL;
+	prof->cpu_us = NULL;
+	prof->nb_second = 0;
+}
+
+
+// save profile of song number
+// returns TRUE if OK, FALSE otherwise
+int save_profile (int numfile, profile_t *prof)
+{
+	FILE *fp;
+	char s [30];
+	int i;
+
+	// same name as the context of the song, see save_song ()
+	sprintf (s, "./save/%02X.prof", numfile);
+	if ((fp = fopen (s, "wt")) == NULL) return FALSE;
+
+	fprintf (fp, "soundfont %s\n", prof->soundfont);
+	fprintf (fp, "duration_ms %u\n", prof->duration_ms);
+	fprintf (fp, "rt_factor %.1f\n", prof->rt_factor);
+	fprintf (fp, "peak_load %.1f\n", prof->peak_load);
+	fprintf (fp, "max_block_us %u\n", prof->max_block_us);
+	fprintf (fp, "mean_block_us %.1f\n", prof->mean_block_us);
+	fprintf (fp, "peak_voices %d\n", prof->peak_voices);
+	for (i = 0; i < NB_MIDI_CHANNEL; i++) fprintf (fp, "channel %02d %d\n", i, prof->peak_channel [i]);
+	fprintf (fp, "polyphony %d\n", prof->polyphony);
+	fprintf (fp, "level %d\n", prof->level);
+	// per second: second, max voices, cpu time in us
+	for (i = 0; i < prof->nb_second; i++) fprintf (fp, "second %d %d %u\n", i, prof->voices [i], prof->cpu_us [i]);
+
+	fclose (fp);
+	return TRUE;
+}
+
+
+// read advised polyphony and quality level from the profile of song number
+// returns FALSE if song has not been profiled (polyphony and level are then 0)
+int read_profile (int numfile, int *polyphony, int *level)
+{
+	FILE *fp;
+	char s [80];
+
+	*polyphony = 0;
+	*level = 0;
+
+	sprintf (s, "./save/%02X.prof", numfile);
+	if ((fp = fopen (s, "rt")) == NULL) return FALSE;
+	while (fgets (s, sizeof (s), fp) != NULL) {
+		sscanf (s, "polyphony %d", polyphony);
+		sscanf (s, "level %d", level);
+	}
+	fclose (fp);
+	return TRUE;
+}
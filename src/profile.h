@@ -0,0 +1,11 @@
+/** @file profile.h
+ *
+ * @brief This file defines prototypes of functions inside profile.c
+ *
+ */
+
+int render_song (char *, profile_t *);
+int profile_song (char *, profile_t *);
+void free_profile (profile_t *);
+int save_profile (int, profile_t *);
+int read_profile (int, int *, int *);
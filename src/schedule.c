@@ -0,0 +1,261 @@
+/** @file schedule.c
+ *
+ * @brief Scheduling of live changes: CC of sliders, knobs, solo and mute, and tempo changes, are sent to the synth through a
+ * fluidsynth sequencer driven by the synth itself, instead of being applied whenever the calling thread runs.
+ * Each change is stamped with the time it was made; it takes effect exactly one audio period later on the sample clock of the synth,
+ * so its latency is fixed instead of depending on where it falls between two audio periods. Solo and mute may also be quantized
+ * to the next beat or bar of the song, as given by the tempo map of the song (see tempomap.c).
+ * Slider positions go through our own client, so they weight the CC7 of the song from the time their CC7 takes effect only.
+ * Changes not yet applied are removed when playback is stopped or switched to another song.
+ * Sequencer ticks are on the scale of the sample rate, but the sample timer of the synth advances the sequencer in whole milliseconds,
+ * so ticks move in steps of rate / 1000; events are applied by the synth at its internal block boundary (64 frames).
+ *
+ */
+
+#include <stdatomic.h>
+#include "types.h"
+#include "globals.h"
+#include "config.h"
+#include "process.h"
+#include "utils.h"
+#include "gpio.h"
+#include "tempomap.h"
+#include "engine.h"
+#include "mixer.h"
+#include "schedule.h"
+
+// quantization of solo and mute
+#define QUANT_NONE			0
+#define QUANT_BEAT			1
+#define QUANT_BAR			2
+
+static fluid_sequencer_t *seq = NULL;
+static fluid_seq_id_t synth_dest = -1;		// sequencer client of the synth: CC
+static fluid_seq_id_t volume_dest = -1;		// our own sequencer client: slider positions, applied with their CC7 (see apply_volume ())
+static fluid_seq_id_t tempo_dest = -1;		// our own sequencer client: tempo changes of the player
+static fluid_event_t *audio_evt = NULL;		// event used by the audio thread
+static fluid_event_t *volume_evt = NULL;	// event used by the audio thread for slider positions
+static fluid_event_t *loop_evt = NULL;		// event used by the main loop
+static int quantize = QUANT_NONE;
+static double rate = 44100.0;				// sample rate: sequencer ticks per second
+static atomic_uint delay = 128;			// time between a change and its effect, in ticks: one audio period
+
+// sequencer tick at the start of the current audio period, and time of that start (lower 32 bits of us): a single word, so
+// it is read consistently by the main loop; wall time is converted to sequencer ticks from it
+static atomic_ullong ref = 0;
+
+// statistics
+static atomic_ulong nb_scheduled = 0;		// changes sent through the sequencer
+static atomic_ulong nb_late = 0;			// changes whose target time had already passed when they were scheduled
+static atomic_ulong nb_quantized = 0;		// changes moved to the next beat or bar
+
+
+// sequencer client of tempo changes: called by the synth, at the time of the event
+static void tempo_callback (unsigned int time, fluid_event_t *event, fluid_sequencer_t *s, void *data)
+{
+	engine_set_tempo (player, (double) (intptr_t) fluid_event_get_data (event));
+}
+
+
+// sequencer client of slider positions: called by the synth, at the time of the event; data is channel | position << 8
+static void volume_callback (unsigned int time, fluid_event_t *event, fluid_sequencer_t *s, void *data)
+{
+	intptr_t d = (intptr_t) fluid_event_get_data (event);
+
+	apply_volume (d & 0x0F, (d >> 8) & 0x7F);
+}
+
+
+// create sequencer, and register synth, volume and tempo clients; quantize is "beat" or "bar" for solo and mute, NULL for none
+// shall be called once synth is created, before audio is started
+// returns TRUE if OK, FALSE otherwise
+int init_schedule (char *quantize_to)
+{
+	if (quantize_to != NULL) {
+		if (strcmp (quantize_to, "beat") == 0) quantize = QUANT_BEAT;
+		else if (strcmp (quantize_to, "bar") == 0) quantize = QUANT_BAR;
+		else if (strcmp (quantize_to, "none") != 0) {
+			fprintf (stderr, "unknown quantization %s\n", quantize_to);
+			return FALSE;
+		}
+	}
+
+	// sequencer driven by the sample timer of the synth: time scale is the sample rate, and time advances by whole ms
+	if ((seq = new_fluid_sequencer2 (FALSE)) == NULL) {
+		fprintf (stderr, "sequencer creation failed\n");
+		return FALSE;
+	}
+	fluid_settings_getnum (settings, "synth.sample-rate", &rate);
+	fluid_sequencer_set_time_scale (seq, rate);
+
+	synth_dest = fluid_sequencer_register_fluidsynth (seq, synth);
+	volume_dest = fluid_sequencer_register_client (seq, "volume", volume_callback, NULL);
+	tempo_dest = fluid_sequencer_register_client (seq, "tempo", tempo_callback, NULL);
+	audio_evt = new_fluid_event ();
+	volume_evt = new_fluid_event ();
+	loop_evt = new_fluid_event ();
+	if ((synth_dest == FLUID_FAILED) || (volume_dest == FLUID_FAILED) || (tempo_dest == FLUID_FAILED) || (audio_evt == NULL) ||
+		(volume_evt == NULL) || (loop_evt == NULL)) {
+		fprintf (stderr, "sequencer client creation failed\n");
+		kill_schedule ();
+		return FALSE;
+	}
+	fluid_event_set_source (audio_evt, -1);
+	fluid_event_set_dest (audio_evt, synth_dest);
+	fluid_event_set_source (volume_evt, -1);
+	fluid_event_set_dest (volume_evt, volume_dest);
+	fluid_event_set_source (loop_evt, -1);
+	fluid_event_set_dest (loop_evt, tempo_dest);
+	return TRUE;
+}
+
+
+// delete sequencer; shall be done before synth is deleted
+void kill_schedule ()
+{
+	if (audio_evt != NULL) delete_fluid_event (audio_evt);
+	if (volume_evt != NULL) delete_fluid_event (volume_evt);
+	if (loop_evt != NULL) delete_fluid_event (loop_evt);
+	if (seq != NULL) delete_fluid_sequencer (seq);
+	audio_evt = volume_evt = loop_evt = NULL;
+	seq = NULL;
+}
+
+
+// start of an audio period of len frames: note sequencer tick and time, to convert time stamps of changes to ticks
+// latency of changes is the period, which is known here even if buffer settings have been tuned
+// called by the audio callback before rendering
+void schedule_period (int len)
+{
+	if (seq == NULL) return;
+	atomic_store (&delay, len);
+	atomic_store (&ref, ((uint64_t) fluid_sequencer_get_tick (seq) << 32) | (uint32_t) micros ());
+}
+
+
+// sequencer tick at which a change made at time t (in us) takes effect: one period later, on the sample clock
+// now is the current tick; target is never before it
+static unsigned int target_tick (uint64_t t, unsigned int now)
+{
+	uint64_t r;
+	int32_t dt;
+	unsigned int target;
+
+	r = atomic_load (&ref);
+	dt = (int32_t) ((uint32_t) t - (uint32_t) r);
+	target = (unsigned int) (r >> 32) + (int) (dt * rate / 1000000.0) + atomic_load (&delay);
+	if ((int) (target - now) < 0) {
+		atomic_fetch_add (&nb_late, 1);
+		return now;
+	}
+	return target;
+}
+
+
+// sequencer tick of the next beat or bar of the song, from target tick; target if song is not playing
+// called by the audio thread: player tick is the one at the start of the current period
+// beats and bars follow the time signature of the song, and time follows its tempo changes, or the tempo set by the user
+static unsigned int quantize_tick (unsigned int target)
+{
+	tempo_map_t *map;
+	uint32_t tick, now;
+	unsigned int start;
+	double us;
+
+	if ((player == NULL) || (engine_get_status (player) != ENGINE_PLAYING)) return target;
+
+	map = &player->map;
+	start = (unsigned int) (atomic_load (&ref) >> 32);
+
+	// song tick at target, then next beat or bar at or after it, converted back to sequencer ticks
+	now = engine_get_current_tick (player);
+	us = tick_to_us (map, now);
+	tick = us_to_tick (map, us + (double) (target - start) * 1000000.0 / rate);
+	tick = (quantize == QUANT_BAR) ? next_bar_tick (map, tick) : next_beat_tick (map, tick);
+	atomic_fetch_add (&nb_quantized, 1);
+	return start + (unsigned int) ((tick_to_us (map, tick) - us) * rate / 1000000.0);
+}
+
+
+// send CC to synth, at one period after time t (in us); quantized to next beat or bar if q is TRUE and quantization is set
+// called by the audio thread (see flush_mixer ()); CC is sent right away if there is no sequencer
+void schedule_cc (int ch, int cc, int val, uint64_t t, int q)
+{
+	unsigned int now, target;
+
+	if (seq == NULL) {
+		fluid_synth_cc (synth, ch, cc, val);
+		return;
+	}
+
+	now = fluid_sequencer_get_tick (seq);
+	target = target_tick (t, now);
+	if (q && (quantize != QUANT_NONE)) target = quantize_tick (target);
+
+	fluid_event_control_change (audio_evt, ch, cc, val);
+	fluid_sequencer_send_at (seq, audio_evt, target, TRUE);
+	atomic_fetch_add (&nb_scheduled, 1);
+}
+
+
+// apply slider position sld to midi channel ch (see apply_volume ()), at one period after time t (in us); quantized to next beat
+// or bar if q is TRUE and quantization is set
+// called by the audio thread (see flush_mixer ()); position is applied right away if there is no sequencer
+void schedule_volume (int ch, uint8_t sld, uint64_t t, int q)
+{
+	unsigned int now, target;
+
+	if (seq == NULL) {
+		apply_volume (ch, sld);
+		return;
+	}
+
+	now = fluid_sequencer_get_tick (seq);
+	target = target_tick (t, now);
+	if (q && (quantize != QUANT_NONE)) target = quantize_tick (target);
+
+	fluid_event_timer (volume_evt, (void *) (intptr_t) ((ch & 0x0F) | ((sld & 0x7F) << 8)));
+	fluid_sequencer_send_at (seq, volume_evt, target, TRUE);
+	atomic_fetch_add (&nb_scheduled, 1);
+}
+
+
+// remove CC and slider positions scheduled and not yet applied; tempo changes are kept
+// called when playback is stopped or switched to another song, so changes made for the song do not arrive afterwards
+void cancel_schedule ()
+{
+	if (seq == NULL) return;
+	fluid_sequencer_remove_events (seq, -1, synth_dest, -1);
+	fluid_sequencer_remove_events (seq, -1, volume_dest, -1);
+}
+
+
+// set tempo of the player (in us per quarter note) at one period after time t (in us)
+// called by the main loop; tempo is set right away if there is no sequencer
+void schedule_tempo (double tempo, uint64_t t)
+{
+	if (seq == NULL) {
+		engine_set_tempo (player, tempo);
+		return;
+	}
+
+	fluid_event_timer (loop_evt, (void *) (intptr_t) (int) (tempo + 0.5));
+	fluid_sequencer_send_at (seq, loop_evt, target_tick (t, fluid_sequencer_get_tick (seq)), TRUE);
+	atomic_fetch_add (&nb_scheduled, 1);
+}
+
+
+// latency of scheduled changes, in us
+uint64_t get_schedule_latency ()
+{
+	return (uint64_t) (atomic_load (&delay) * 1000000.0 / rate);
+}
+
+
+// number of changes scheduled, of changes scheduled late, and of changes quantized, since start
+void get_schedule_stats (unsigned long *scheduled, unsigned long *late, unsigned long *quantized)
+{
+	*scheduled = atomic_load (&nb_scheduled);
+	*late = atomic_load (&nb_late);
+	*quantized = atomic_load (&nb_quantized);
+}
@@ -0,0 +1,15 @@
+/** @file schedule.h
+ *
+ * @brief This file defines prototypes of functions inside schedule.c
+ *
+ */
+
+int init_schedule (char *);
+void kill_schedule ();
+void schedule_period (int);
+void schedule_cc (int, int, int, uint64_t, int);
+void schedule_volume (int, uint8_t, uint64_t, int);
+void cancel_schedule ();
+void schedule_tempo (double, uint64_t);
+uint64_t get_schedule_latency ();
+void get_schedule_stats (unsigned long *, unsigned long *, unsigned long *);
@@ -0,0 +1,160 @@
+/** @file section.c
+ *
+ * @brief Index of the sections of a song, sorted by tick: markers and cue points of the midi file (FF 06 / FF 07),
+ * merged with the time markers set by the user. Previous and next sections are found from the current tick with a binary search.
+ *
+ */
+
+#include "types.h"
+#include "globals.h"
+#include "config.h"
+#include "process.h"
+#include "utils.h"
+#include "gpio.h"
+#include "smf.h"
+#include "chase.h"
+#include "tempomap.h"
+#include "engine.h"
+#include "section.h"
+
+#define DEFAULT_DIVISION	480		// ticks per quarter note, if the song has no event table
+
+
+// find index of the first section at or after tick, with a binary search
+// returns nb if all sections are before tick
+int find_section (section_list_t *list, uint32_t tick)
+{
+	int lo = 0, hi = list->nb, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (list->section [mid].tick < tick) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+
+// insert a section at its place in the list; a section at the same tick as an existing one is merged with it
+// returns index of the section, or -1 if memory is exhausted
+static int insert_section (section_list_t *list, uint32_t tick, int user, uint8_t *name, int len)
+{
+	section_t *s;
+	int i;
+
+	i = find_section (list, tick);
+
+	if ((i == list->nb) || (list->section [i].tick != tick)) {
+		// grow list if required
+		if (list->nb == list->max) {
+			s = realloc (list->section, ((list->max == 0) ? 16 : list->max * 2) * sizeof (section_t));
+			if (s == NULL) return -1;
+			list->section = s;
+			list->max = (list->max == 0) ? 16 : list->max * 2;
+		}
+		memmove (&list->section [i + 1], &list->section [i], (list->nb - i) * sizeof (section_t));
+		list->nb++;
+		memset (&list->section [i], 0, sizeof (section_t));
+		list->section [i].tick = tick;
+	}
+
+	s = &list->section [i];
+	if (user) s->user = TRUE;
+	if ((name != NULL) && (s->name [0] == 0)) {
+		if (len >= SECTION_NAME_LEN) len = SECTION_NAME_LEN - 1;
+		memcpy (s->name, name, len);
+		s->name [len] = 0;
+	}
+	return i;
+}
+
+
+// build index of sections of a song: markers and cue points of the midi file, and time markers of the saved context
+// snapshots of channel state at each section are computed at the same time
+void build_sections (section_list_t *list, smf_t *smf, song_t *song)
+{
+	smf_event_t *ev;
+	int i;
+
+	list->nb = 0;
+
+	// marker (FF 06) and cue point (FF 07) meta events of the midi file, from the index of meta events
+	if (smf != NULL) {
+		for (i = 0; i < smf->nb_meta; i++) {
+			ev = &smf->event [smf->meta_index [i]];
+			if ((ev->status == 0xFF) && ((ev->data [0] == 0x06) || (ev->data [0] == 0x07)) && (ev->tick != 0))
+				insert_section (list, ev->tick, FALSE, ev->meta, ev->len);
+		}
+	}
+
+	// time markers set by the user
+	if ((song != NULL) && song->loaded) {
+		for (i = 0; i < song->nb_mark; i++) {
+			if (song->mark [i] != 0) insert_section (list, song->mark [i], TRUE, NULL, 0);
+		}
+	}
+
+	make_snapshots (smf, list);
+}
+
+
+// free memory of a list of sections
+void free_sections (section_list_t *list)
+{
+	free (list->section);
+	memset (list, 0, sizeof (section_list_t));
+}
+
+
+// add a time marker set by the user to the sections of current song, with channel state at marker
+// returns TRUE if OK, FALSE otherwise
+int add_mark (uint32_t tick)
+{
+	int i;
+
+	// a mark at the beginning of the file is useless
+	if (tick == 0) return FALSE;
+	if ((i = insert_section (&sections, tick, TRUE, NULL, 0)) < 0) return FALSE;
+	make_snapshot (song_smf, tick, &sections.section [i].snap);
+	return TRUE;
+}
+
+
+// get previous section before tick: index of the section, or -1 if none
+// a section that has started less than a beat ago is skipped, so pressing previous twice goes further back;
+// if there is no section before it, it is selected again
+int prev_section (uint32_t tick)
+{
+	uint32_t guard;
+	int i;
+
+	guard = (song_smf != NULL) ? song_smf->division : DEFAULT_DIVISION;
+	i = find_section (&sections, (tick > guard) ? tick - guard : 0) - 1;
+	if (i < 0) i = find_section (&sections, tick) - 1;
+	return i;
+}
+
+
+// get next section after tick: index of the section, or -1 if none
+int next_section (uint32_t tick)
+{
+	int i;
+
+	i = find_section (&sections, tick + 1);
+	return (i < sections.nb) ? i : -1;
+}
+
+
+// jump to section: restore channel state at start of section, then seek the player
+// the player resumes from the section at its next audio block
+void seek_section (int i)
+{
+	char pos [80];
+
+	if ((i < 0) || (i >= sections.nb)) return;
+
+	apply_snapshot (&sections.section [i].snap);
+	engine_seek (player, sections.section [i].tick);
+	printf ("section %d/%d at tick %u (%s) %s\n", i + 1, sections.nb, sections.section [i].tick,
+		position_string (&player->map, sections.section [i].tick, engine_get_total_ticks (player), pos), sections.section [i].name);
+}
@@ -0,0 +1,13 @@
+/** @file section.h
+ *
+ * @brief This file defines prototypes of functions inside section.c
+ *
+ */
+
+int find_section (section_list_t *, uint32_t);
+void build_sections (section_list_t *, smf_t *, song_t *);
+void free_sections (section_list_t *);
+int add_mark (uint32_t);
+int prev_section (uint32_t);
+int next_section (uint32_t);
+void seek_section (int);
@@ -0,0 +1,228 @@
+/** @file sfpool.c
+ *
+ * @brief Pool of resident soundfonts: several SF2 are kept loaded up to a RAM budget, least recently used one is evicted.
+ * Only selected soundfont is visible to the synth; others are hidden behind a bank offset.
+ *
+ */
+
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/sysinfo.h>
+#include "types.h"
+#include "globals.h"
+#include "config.h"
+#include "process.h"
+#include "utils.h"
+#include "gpio.h"
+#include "sfpool.h"
+
+#define NB_SF2_POOL			16		// max number of resident soundfonts
+#define SF2_HIDDEN_OFFSET	16384	// bank offset of hidden soundfonts: above any bank number a midi file can select
+#define SF2_BUDGET_RATIO	4		// default budget is 1/4th of the RAM (256MB on 1GB Pi, 2GB on 8GB Pi)
+#define WARM_CHUNK			65536	// size of chunks used to read files into page cache
+
+typedef struct {				// structure for each resident soundfont
+	int num;						// file number; -1 if entry is free
+	int id;							// soundfont id in synth
+	long size;						// size of the file, used as memory footprint estimate
+	unsigned long used;				// time of last selection (pool clock): used to find least recently used
+	int pinned;						// never evicted (default soundfont)
+} sfpool_t;
+
+static sfpool_t pool [NB_SF2_POOL];
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static long budget;					// memory budget of the pool, in bytes
+static long resident;				// memory currently used by the pool, in bytes
+static unsigned long clock_used;	// pool clock: incremented at each selection
+static int selected = -1;			// index of selected soundfont in pool
+static unsigned long hits, misses, evictions;
+
+
+// read a file into page cache without keeping it in memory
+// fluid_synth_sfload () holds the synth lock while reading samples: reading from page cache instead of SD card keeps this short
+static void warm_file (char *name)
+{
+	FILE *fp;
+	char buf [WARM_CHUNK];
+
+	if ((fp = fopen (name, "rb")) == NULL) return;
+	while (fread (buf, 1, WARM_CHUNK, fp) == WARM_CHUNK);
+	fclose (fp);
+}
+
+
+// return index of file number in pool, or -1 if not resident
+static int find_sf2 (int num)
+{
+	int i;
+
+	for (i = 0; i < NB_SF2_POOL; i++) {
+		if (pool [i].num == num) return i;
+	}
+	return -1;
+}
+
+
+// evict least recently used soundfonts until pool fits in budget (taking size of a new soundfont into account)
+// selected and pinned soundfonts are never evicted; returns index of a free entry, or -1 if none
+static int evict_sf2 (long size)
+{
+	int i, lru, free_slot;
+
+	while (1) {
+		lru = -1;
+		free_slot = -1;
+		for (i = 0; i < NB_SF2_POOL; i++) {
+			if (pool [i].num == -1) {
+				if (free_slot == -1) free_slot = i;
+				continue;
+			}
+			if ((i == selected) || (pool [i].pinned)) continue;
+			if ((lru == -1) || (pool [i].used < pool [lru].used)) lru = i;
+		}
+
+		// stop when there is a free entry and enough memory, or when nothing else can be evicted
+		if ((free_slot != -1) && (resident + size <= budget)) return free_slot;
+		if (lru == -1) return free_slot;
+
+		printf ("sf2 pool: evict %02X\n", pool [lru].num);
+		fluid_synth_sfunload (synth, pool [lru].id, FALSE);
+		resident -= pool [lru].size;
+		pool [lru].num = -1;
+		evictions++;
+	}
+}
+
+
+// init pool with a budget in MB (0 for default budget), and the id of default soundfont (-1 if none)
+// default soundfont is pinned in the pool: it is never unloaded, and not loaded twice if selected
+int init_sfpool (int budget_mb, int default_id)
+{
+	int i;
+	struct sysinfo info;
+	struct stat st;
+
+	for (i = 0; i < NB_SF2_POOL; i++) pool [i].num = -1;
+	resident = 0;
+	clock_used = 0;
+	hits = misses = evictions = 0;
+
+	if (budget_mb > 0) budget = (long) budget_mb * 1024 * 1024;
+	else {
+		// default budget depends on RAM size of the Pi
+		if (sysinfo (&info) == 0) budget = (long) ((info.totalram * (uint64_t) info.mem_unit) / SF2_BUDGET_RATIO);
+		else budget = 256L * 1024 * 1024;
+	}
+	printf ("sf2 pool: budget %ld MB\n", budget / (1024 * 1024));
+
+	if (default_id >= 0) {
+		pool [0].num = DEFAULT_SF2_NUM;
+		pool [0].id = default_id;
+		pool [0].size = (stat (DEFAULT_SF2, &st) == 0) ? st.st_size : 0;
+		pool [0].used = 0;
+		pool [0].pinned = TRUE;
+		resident = pool [0].size;
+	}
+	return TRUE;
+}
+
+
+// make sure soundfont file number is resident in pool; load it (hidden) if not
+// this can take long: called by loader thread
+// returns soundfont id, or -1 if file does not exist or is not a soundfont
+int acquire_sf2 (uint8_t num)
+{
+	char name [300];
+	struct stat st;
+	int i, id;
+	uint64_t start;
+
+	pthread_mutex_lock (&pool_mutex);
+	i = find_sf2 (num);
+	if (i != -1) {
+		hits++;
+		id = pool [i].id;
+		pthread_mutex_unlock (&pool_mutex);
+		return id;
+	}
+	pthread_mutex_unlock (&pool_mutex);
+
+	if (get_full_filename (name, num, "./soundfonts/") == FALSE) return -1;
+	if (!fluid_is_soundfont (name)) return -1;
+	if (stat (name, &st) != 0) return -1;
+
+	// make room in pool before loading, so memory peak stays within budget
+	pthread_mutex_lock (&pool_mutex);
+	misses++;
+	i = evict_sf2 (st.st_size);
+	pthread_mutex_unlock (&pool_mutex);
+	if (i == -1) {
+		fprintf (stderr, "sf2 pool full\n");
+		return -1;
+	}
+
+	start = micros ();
+	warm_file (name);
+
+	// load without resetting presets, so currently playing song is not affected
+	id = fluid_synth_sfload (synth, name, FALSE);
+	if (id == FLUID_FAILED) return -1;
+	// hide presets of the new soundfont until it is selected
+	fluid_synth_set_bank_offset (synth, id, SF2_HIDDEN_OFFSET);
+
+	pthread_mutex_lock (&pool_mutex);
+	pool [i].num = num;
+	pool [i].id = id;
+	pool [i].size = st.st_size;
+	pool [i].used = 0;
+	pool [i].pinned = FALSE;
+	resident += st.st_size;
+	pthread_mutex_unlock (&pool_mutex);
+
+	printf ("sf2:%s loaded in %llu ms\n", name, (unsigned long long) (micros () - start) / 1000);
+	return id;
+}
+
+
+// select resident soundfont file number: its presets become visible, other resident soundfonts are hidden
+// no loading is done here, only bank routing; returns soundfont id, or -1 if soundfont is not resident
+int select_sf2 (uint8_t num)
+{
+	int i, id;
+
+	pthread_mutex_lock (&pool_mutex);
+	i = find_sf2 (num);
+	if (i == -1) {
+		pthread_mutex_unlock (&pool_mutex);
+		return -1;
+	}
+
+	// default soundfont stays visible (lowest in soundfont stack) as a fallback for missing presets
+	if ((selected != -1) && (selected != i) && (pool [selected].pinned == FALSE)) fluid_synth_set_bank_offset (synth, pool [selected].id, SF2_HIDDEN_OFFSET);
+	fluid_synth_set_bank_offset (synth, pool [i].id, 0);
+	pool [i].used = ++clock_used;
+	selected = i;
+	id = pool [i].id;
+	pthread_mutex_unlock (&pool_mutex);
+
+	// select presets of the new soundfont on all channels
+	fluid_synth_program_reset (synth);
+
+	report_sfpool ();
+	return id;
+}
+
+
+// print resident soundfonts, and hit/miss counts
+void report_sfpool ()
+{
+	int i;
+
+	pthread_mutex_lock (&pool_mutex);
+	printf ("sf2 pool: %ld/%ld MB, hits %lu misses %lu evictions %lu, resident:", resident / (1024 * 1024), budget / (1024 * 1024), hits, misses, evictions);
+	for (i = 0; i < NB_SF2_POOL; i++) {
+		if (pool [i].num != -1) printf (" %02X%s", pool [i].num, (i == selected) ? "*" : "");
+	}
+	printf ("\n");
+	pthread_mutex_unlock (&pool_mutex);
+}
@@ -0,0 +1,10 @@
+/** @file sfpool.h
+ *
+ * @brief This file defines prototypes of functions inside sfpool.c
+ *
+ */
+
+int init_sfpool (int, int);
+int acquire_sf2 (uint8_t);
+int select_sf2 (uint8_t);
+void report_sfpool ();
@@ -0,0 +1,373 @@
+/** @file smf.c
+ *
+ * @brief Standard midi file parsing: walk through all events of a midi file, get information about it, or parse it once into an event table.
+ *
+ */
+
+#include "types.h"
+#include "globals.h"
+#include "smf.h"
+
+#define DEFAULT_TEMPO	500000		// default midi tempo: 120 BPM, in us per quarter note
+
+
+// read a big-endian value of n bytes
+static uint32_t read_be (uint8_t *p, int n)
+{
+	uint32_t v = 0;
+
+	while (n--) v = (v << 8) | *p++;
+	return v;
+}
+
+
+// read a variable-length quantity; returns number of bytes read, or 0 if quantity goes beyond end
+static int read_vlq (uint8_t *p, uint8_t *end, uint32_t *v)
+{
+	int n = 0;
+
+	*v = 0;
+	while (p + n < end) {
+		*v = (*v << 7) | (p [n] & 0x7F);
+		if ((p [n++] & 0x80) == 0) return n;
+		if (n == 4) return 0;
+	}
+	return 0;
+}
+
+
+// walk through all events of a midi file held in memory, track after track
+// callback is called for each event with the user data; walk stops if callback returns FALSE
+// returns number of tracks, or -1 if the file is not a valid midi file
+int smf_walk (uint8_t *buf, size_t len, int (*callback) (void *, smf_event_t *), void *data)
+{
+	uint8_t *p, *end, *trk_end;
+	uint8_t running;
+	uint32_t delta, trk_len, hdr_len;
+	int ntracks, track, n;
+	smf_event_t ev;
+
+	if ((len < 14) || (memcmp (buf, "MThd", 4) != 0)) return -1;
+	// header length is given by the file: a truncated or corrupt header would put the first track past the buffer
+	hdr_len = read_be (buf + 4, 4);
+	if (hdr_len > len - 8) return -1;
+	ntracks = read_be (buf + 10, 2);
+	p = buf + 8 + hdr_len;
+	end = buf + len;
+
+	for (track = 0; (track < ntracks) && (p + 8 <= end); track++) {
+		trk_len = read_be (p + 4, 4);
+		if (memcmp (p, "MTrk", 4) != 0) {
+			// unknown chunk: skip it
+			if (trk_len > (uint32_t) (end - p - 8)) break;
+			p += 8 + trk_len;
+			track--;
+			continue;
+		}
+		p += 8;
+		trk_end = ((size_t) (end - p) < trk_len) ? end : p + trk_len;
+		running = 0;
+		ev.tick = 0;
+		ev.track = track;
+
+		while (p < trk_end) {
+			if ((n = read_vlq (p, trk_end, &delta)) == 0) break;
+			p += n;
+			if (p >= trk_end) break;
+			ev.tick += delta;
+			ev.len = 0;
+			ev.meta = NULL;
+
+			if (*p == 0xFF) {
+				// meta event
+				if (p + 2 > trk_end) break;
+				ev.status = 0xFF;
+				ev.data [0] = p [1];
+				ev.data [1] = 0;
+				if ((n = read_vlq (p + 2, trk_end, &ev.len)) == 0) break;
+				ev.meta = p + 2 + n;
+				if (ev.len > (uint32_t) (trk_end - ev.meta)) break;
+				p = ev.meta + ev.len;
+			}
+			else if ((*p == 0xF0) || (*p == 0xF7)) {
+				// sysex
+				ev.status = *p;
+				if ((n = read_vlq (p + 1, trk_end, &ev.len)) == 0) break;
+				ev.meta = p + 1 + n;
+				if (ev.len > (uint32_t) (trk_end - ev.meta)) break;
+				p = ev.meta + ev.len;
+				running = 0;
+			}
+			else {
+				// channel event, possibly with running status
+				if (*p & 0x80) running = *p++;
+				if (running == 0) break;
+				ev.status = running;
+				ev.data [0] = (p < trk_end) ? *p++ : 0;
+				// program change and channel pressure have a single data byte
+				if (((running & 0xF0) == 0xC0) || ((running & 0xF0) == 0xD0)) ev.data [1] = 0;
+				else ev.data [1] = (p < trk_end) ? *p++ : 0;
+			}
+
+			if (callback (data, &ev) == FALSE) return ntracks;
+		}
+		p = trk_end;
+	}
+
+	return ntracks;
+}
+
+
+// tempo changes, collected while walking through a file to compute its duration
+typedef struct {
+	uint32_t tick;
+	uint32_t tempo;
+} tempo_change_t;
+
+typedef struct {
+	midi_info_t *info;
+	tempo_change_t *tempo;
+	int nb_tempo, max_tempo;
+} info_walk_t;
+
+
+// smf_walk callback used by smf_info ()
+static int info_callback (void *data, smf_event_t *ev)
+{
+	info_walk_t *w = data;
+	tempo_change_t *t;
+
+	if (ev->tick > w->info->ticks) w->info->ticks = ev->tick;
+
+	if (ev->status < 0xF0) w->info->channels |= 1 << (ev->status & 0x0F);
+
+	// tempo meta event
+	if ((ev->status == 0xFF) && (ev->data [0] == 0x51) && (ev->len == 3)) {
+		if (w->nb_tempo == w->max_tempo) {
+			w->max_tempo = (w->max_tempo == 0) ? 64 : w->max_tempo * 2;
+			t = realloc (w->tempo, w->max_tempo * sizeof (tempo_change_t));
+			if (t == NULL) return FALSE;
+			w->tempo = t;
+		}
+		w->tempo [w->nb_tempo].tick = ev->tick;
+		w->tempo [w->nb_tempo].tempo = read_be (ev->meta, 3);
+		w->nb_tempo++;
+	}
+	return TRUE;
+}
+
+
+// qsort comparison of tempo changes
+static int compare_tempo (const void *a, const void *b)
+{
+	const tempo_change_t *ta = a, *tb = b;
+
+	return (ta->tick > tb->tick) - (ta->tick < tb->tick);
+}
+
+
+// get information about a midi file: format, tracks, PPQ, initial tempo, duration, channels used
+// returns TRUE if OK, FALSE if file could not be read or is not a midi file
+int smf_info (char *name, midi_info_t *info)
+{
+	FILE *fp;
+	uint8_t *buf;
+	long len;
+	info_walk_t w;
+	uint32_t tick, tempo;
+	double us;
+	int i;
+
+	memset (info, 0, sizeof (midi_info_t));
+	if ((fp = fopen (name, "rb")) == NULL) return FALSE;
+	fseek (fp, 0, SEEK_END);
+	len = ftell (fp);
+	fseek (fp, 0, SEEK_SET);
+	buf = (len > 0) ? malloc (len) : NULL;
+	if ((buf == NULL) || (fread (buf, 1, len, fp) != (size_t) len)) {
+		free (buf);
+		fclose (fp);
+		return FALSE;
+	}
+	fclose (fp);
+
+	memset (&w, 0, sizeof (w));
+	w.info = info;
+	if (smf_walk (buf, len, info_callback, &w) < 0) {
+		free (buf);
+		return FALSE;
+	}
+	info->format = read_be (buf + 8, 2);
+	info->ntracks = read_be (buf + 10, 2);
+	info->division = read_be (buf + 12, 2);
+	free (buf);
+
+	// SMPTE division is not supported for duration: consider 120 BPM at 96 PPQ
+	if ((info->division & 0x8000) || (info->division == 0)) info->division = 96;
+
+	// integrate tempo changes over the song to get its duration
+	qsort (w.tempo, w.nb_tempo, sizeof (tempo_change_t), compare_tempo);
+	info->tempo = ((w.nb_tempo > 0) && (w.tempo [0].tick == 0)) ? w.tempo [0].tempo : DEFAULT_TEMPO;
+	tick = 0;
+	tempo = DEFAULT_TEMPO;
+	us = 0;
+	for (i = 0; (i < w.nb_tempo) && (w.tempo [i].tick < info->ticks); i++) {
+		us += (double) (w.tempo [i].tick - tick) * tempo / info->division;
+		tick = w.tempo [i].tick;
+		tempo = w.tempo [i].tempo;
+	}
+	us += (double) (info->ticks - tick) * tempo / info->division;
+	info->duration_ms = (uint32_t) (us / 1000);
+
+	free (w.tempo);
+	return TRUE;
+}
+
+
+// smf_walk callback used by smf_load (): count events (first pass), then store them (second pass)
+static int load_callback (void *data, smf_event_t *ev)
+{
+	smf_t *smf = data;
+
+	if (smf->event != NULL) smf->event [smf->nb_event] = *ev;
+	smf->nb_event++;
+	return TRUE;
+}
+
+
+// sort events by tick, keeping file order for events at the same tick (bottom-up merge sort, which is stable)
+// returns TRUE if OK, FALSE if out of memory (events are left unsorted)
+static int sort_events (smf_event_t *event, int n)
+{
+	smf_event_t *tmp, *src, *dst, *swap;
+	int width, i, l, r, lend, rend, k;
+
+	if (n < 2) return TRUE;
+
+	if ((tmp = malloc (n * sizeof (smf_event_t))) == NULL) return FALSE;
+	src = event;
+	dst = tmp;
+
+	for (width = 1; width < n; width *= 2) {
+		for (i = 0; i < n; i += 2 * width) {
+			l = i;
+			lend = r = (i + width < n) ? i + width : n;
+			rend = (i + 2 * width < n) ? i + 2 * width : n;
+			k = i;
+			while ((l < lend) && (r < rend)) dst [k++] = (src [r].tick < src [l].tick) ? src [r++] : src [l++];
+			while (l < lend) dst [k++] = src [l++];
+			while (r < rend) dst [k++] = src [r++];
+		}
+		swap = src;
+		src = dst;
+		dst = swap;
+	}
+
+	if (src != event) memcpy (event, src, n * sizeof (smf_event_t));
+	free (tmp);
+	return TRUE;
+}
+
+
+// parse a midi file held in memory into an event table sorted by tick
+// ownership of buf is given to the event table, and buf is freed if the table cannot be built
+// returns NULL if the file is not a valid midi file, or if memory is exhausted
+smf_t* smf_load (uint8_t *buf, size_t len)
+{
+	smf_t *smf;
+	int i, n;
+
+	if ((smf = calloc (1, sizeof (smf_t))) == NULL) {
+		free (buf);
+		return NULL;
+	}
+	smf->buf = buf;
+	smf->len = len;
+
+	// first pass to count events, second pass to store them
+	if (smf_walk (buf, len, load_callback, smf) < 0) {
+		smf_free (smf);
+		return NULL;
+	}
+	smf->event = malloc ((smf->nb_event + 1) * sizeof (smf_event_t));
+	if (smf->event == NULL) {
+		smf_free (smf);
+		return NULL;
+	}
+	smf->nb_event = 0;
+	smf_walk (buf, len, load_callback, smf);
+	// binary searches in the event table (seek, snapshots, sections) require it to be sorted
+	if (sort_events (smf->event, smf->nb_event) == FALSE) {
+		smf_free (smf);
+		return NULL;
+	}
+
+	// index of meta events, so tempo changes and markers are found without going through all events
+	for (i = 0; i < smf->nb_event; i++) {
+		if (smf->event [i].status == 0xFF) smf->nb_meta++;
+	}
+	if ((smf->meta_index = malloc ((smf->nb_meta + 1) * sizeof (int))) == NULL) {
+		smf_free (smf);
+		return NULL;
+	}
+	for (i = 0, n = 0; i < smf->nb_event; i++) {
+		if (smf->event [i].status == 0xFF) smf->meta_index [n++] = i;
+	}
+
+	smf->division = read_be (buf + 12, 2);
+	if ((smf->division & 0x8000) || (smf->division == 0)) smf->division = 96;
+
+	return smf;
+}
+
+
+// read a midi file, and parse it into an event table
+// returns NULL if the file cannot be read or is not a valid midi file
+smf_t* smf_read (char *name)
+{
+	FILE *fp;
+	uint8_t *buf;
+	long len;
+
+	if ((fp = fopen (name, "rb")) == NULL) return NULL;
+	fseek (fp, 0, SEEK_END);
+	len = ftell (fp);
+	fseek (fp, 0, SEEK_SET);
+
+	buf = (len > 0) ? malloc (len) : NULL;
+	if ((buf == NULL) || (fread (buf, 1, len, fp) != (size_t) len)) {
+		free (buf);
+		fclose (fp);
+		return NULL;
+	}
+	fclose (fp);
+
+	// buffer is owned by the event table, and freed with it
+	return smf_load (buf, len);
+}
+
+
+// free event table and file content
+void smf_free (smf_t *smf)
+{
+	if (smf == NULL) return;
+	free (smf->event);
+	free (smf->meta_index);
+	free (smf->buf);
+	free (smf);
+}
+
+
+// find index of the first event at or after tick, with a binary search
+// returns nb_event if all events are before tick
+int smf_find (smf_t *smf, uint32_t tick)
+{
+	int lo = 0, hi = smf->nb_event, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (smf->event [mid].tick < tick) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
@@ -0,0 +1,12 @@
+/** @file smf.h
+ *
+ * @brief This file defines prototypes of functions inside smf.c
+ *
+ */
+
+int smf_walk (uint8_t *, size_t, int (*) (void *, smf_event_t *), void *);
+int smf_info (char *, midi_info_t *);
+smf_t* smf_load (uint8_t *, size_t);
+smf_t* smf_read (char *);
+void smf_free (smf_t *);
+int smf_find (smf_t *, uint32_t);
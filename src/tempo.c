@@ -0,0 +1,284 @@
+/** @file tempo.c
+ *
+ * @brief Tap tempo: a phase-locked loop tracks the beat period and the beat time from the taps on the beat switch.
+ * Late taps are corrected gradually, missed taps and double taps are recognised, and outliers are rejected.
+ * Tempo of the player is ramped towards the estimate by a main loop timer, and nudged for one beat so the player phase follows the taps.
+ *
+ */
+
+#include <math.h>
+#include <sys/timerfd.h>
+#include "types.h"
+#include "globals.h"
+#include "config.h"
+#include "process.h"
+#include "utils.h"
+#include "gpio.h"
+#include "loop.h"
+#include "audio.h"
+#include "schedule.h"
+#include "engine.h"
+#include "tempo.h"
+
+#define MIN_PERIOD		200000.0	// 300 BPM
+#define MAX_PERIOD		2000000.0	// 30 BPM
+#define DOUBLE_TAP		0.35		// tap closer than this fraction of a beat to the last tap is a double tap: ignored
+#define MAX_MISSED		3			// taps may be missed up to this number of beats; beyond, tracker is locked again
+#define OUTLIER			0.20		// tap further than this fraction of a beat from the predicted beat is an outlier
+#define NB_OUTLIERS		2			// consecutive outliers mean a change of tempo: tracker is locked again on recent intervals
+#define NB_ACQUIRE		4			// taps after (re)lock using acquisition gains
+#define ALPHA_ACQUIRE	0.8			// phase gain during acquisition
+#define BETA_ACQUIRE	0.4			// period gain during acquisition
+#define ALPHA			0.5			// phase gain once locked
+#define BETA			0.15		// period gain once locked
+#define NUDGE_GAIN		0.5			// fraction of player phase error corrected over the next beat
+#define NUDGE_MAX		0.05		// max tempo change used to correct phase (5%)
+#define RAMP_MS			10			// period of tempo ramp timer
+#define RAMP			0.2			// fraction of remaining tempo difference applied at each ramp step
+#define DEFAULT_DIVISION	480		// ticks per quarter note, if the song has no event table
+
+static int ramp_timer = -1;			// timerfd of tempo ramp, armed while tempo of the player is not at target
+static tap_tracker_t tracker;		// tap tracker of the beat switch
+static double applied;				// tempo currently applied to the player, in us per quarter note
+static double target;				// tempo the player is ramped to, in us per quarter note
+static uint64_t nudge_end;			// time at which phase nudge ends, and target goes back to tracker period
+
+
+/*****************/
+/* tap tracker   */
+/*****************/
+
+// clamp period within tempo limits
+static double clamp_period (double p)
+{
+	if (p < MIN_PERIOD) return MIN_PERIOD;
+	if (p > MAX_PERIOD) return MAX_PERIOD;
+	return p;
+}
+
+
+// median of the last n intervals of the history
+static double median_interval (tap_tracker_t *tr, int n)
+{
+	double v [NB_TAP_HISTORY], x;
+	int i, j;
+
+	if (n > tr->nb_interval) n = tr->nb_interval;
+	if (n > NB_TAP_HISTORY) n = NB_TAP_HISTORY;
+	if (n == 0) return tr->period;
+
+	for (i = 0; i < n; i++) v [i] = tr->interval [(tr->nb_interval - 1 - i) % NB_TAP_HISTORY];
+	// insertion sort, n is small
+	for (i = 1; i < n; i++) {
+		x = v [i];
+		for (j = i - 1; (j >= 0) && (v [j] > x); j--) v [j + 1] = v [j];
+		v [j + 1] = x;
+	}
+	return v [n / 2];
+}
+
+
+// init tap tracker with a nominal beat period (tempo of the song), in us
+void init_tap (tap_tracker_t *tr, double period)
+{
+	memset (tr, 0, sizeof (tap_tracker_t));
+	tr->period = clamp_period (period);
+}
+
+
+// take a tap at time t (in us) into account
+// returns TAP_FIRST, TAP_LOCKED (estimate updated), TAP_IGNORED (double tap), TAP_OUTLIER (rejected) or TAP_RELOCK (tracker locked again)
+int tap (tap_tracker_t *tr, uint64_t t)
+{
+	double raw, err, alpha, beta;
+	int k;
+
+	// first tap: it gives the phase only
+	if (tr->locked == 0) {
+		tr->beat = t;
+		tr->last_tap = t;
+		tr->error = 0;
+		tr->locked = 1;
+		return TAP_FIRST;
+	}
+
+	raw = (double) (t - tr->last_tap);
+
+	// double tap or bounce: ignore it
+	if (raw < DOUBLE_TAP * tr->period) return TAP_IGNORED;
+
+	// second tap: it gives the period, unless the interval is out of range (too long pause: take it as first tap)
+	if (tr->locked == 1) {
+		if ((raw < MIN_PERIOD) || (raw > MAX_PERIOD)) {
+			tr->beat = t;
+			tr->last_tap = t;
+			return TAP_FIRST;
+		}
+		tr->period = raw;
+		tr->beat = t;
+		tr->last_tap = t;
+		tr->error = 0;
+		tr->interval [tr->nb_interval++ % NB_TAP_HISTORY] = raw;
+		tr->locked = 2;
+		return TAP_LOCKED;
+	}
+
+	// nearest predicted beat; taps may have been missed in between
+	k = (int) floor (((double) t - tr->beat) / tr->period + 0.5);
+	if (k < 1) k = 1;
+
+	// too many missed taps: the musician has stopped tapping; lock again from this tap
+	if (k > MAX_MISSED + 1) {
+		tr->beat = t;
+		tr->last_tap = t;
+		tr->error = 0;
+		tr->locked = 1;
+		tr->outliers = 0;
+		return TAP_RELOCK;
+	}
+
+	err = (double) t - (tr->beat + k * tr->period);
+	tr->error = err;
+	tr->interval [tr->nb_interval++ % NB_TAP_HISTORY] = raw / k;
+	tr->last_tap = t;
+
+	// tap too far from prediction: reject it, but keep predicted beat running
+	// a series of outliers means the tempo has really changed: lock again on the median of recent intervals
+	if (fabs (err) > OUTLIER * tr->period) {
+		if (++tr->outliers < NB_OUTLIERS) {
+			tr->beat += k * tr->period;
+			return TAP_OUTLIER;
+		}
+		tr->period = clamp_period (median_interval (tr, NB_OUTLIERS));
+		tr->beat = t;
+		tr->outliers = 0;
+		tr->locked = 2;
+		return TAP_RELOCK;
+	}
+	tr->outliers = 0;
+
+	// alpha-beta update of beat phase and period: strong gains first for fast convergence, then smoother tracking
+	alpha = (tr->locked < NB_ACQUIRE) ? ALPHA_ACQUIRE : ALPHA;
+	beta = (tr->locked < NB_ACQUIRE) ? BETA_ACQUIRE : BETA;
+	tr->beat += k * tr->period + alpha * err;
+	tr->period = clamp_period (tr->period + beta * err / k);
+	tr->locked++;
+	return TAP_LOCKED;
+}
+
+
+// period to apply to the player to correct its phase over the next beat
+// phase is the position of the player relative to the tapped beat, in beats, between -0.5 and 0.5 (positive if player is ahead)
+double nudge_period (double period, double phase)
+{
+	double n = NUDGE_GAIN * phase;
+
+	if (n > NUDGE_MAX) n = NUDGE_MAX;
+	if (n < -NUDGE_MAX) n = -NUDGE_MAX;
+	return period * (1.0 + n);
+}
+
+
+// one step of tempo ramp from current period to target period; returns new period
+double ramp_period (double current, double target)
+{
+	if (fabs (target - current) < 0.001 * target) return target;
+	return current + RAMP * (target - current);
+}
+
+
+/*****************/
+/* beat switch   */
+/*****************/
+
+// arm or disarm tempo ramp timer
+static void arm_ramp (int on)
+{
+	struct itimerspec ts;
+
+	memset (&ts, 0, sizeof (ts));
+	if (on) {
+		ts.it_value.tv_nsec = RAMP_MS * 1000000L;
+		ts.it_interval.tv_nsec = RAMP_MS * 1000000L;
+	}
+	timerfd_settime (ramp_timer, 0, &ts, NULL);
+}
+
+
+// main loop handler for tempo ramp timer: move tempo of the player one step towards target
+int tempo_event (int fd)
+{
+	uint64_t expirations;
+
+	// acknowledge timer
+	read (fd, &expirations, sizeof (expirations));
+
+	// phase nudge is over: go back to tempo of the tracker
+	if ((nudge_end != 0) && (micros () >= nudge_end)) {
+		target = tracker.period;
+		nudge_end = 0;
+	}
+
+	// tempo takes effect one period after this step, on the sample clock of the synth (see schedule.c)
+	applied = ramp_period (applied, target);
+	schedule_tempo (applied, micros ());
+
+	// stop timer once target is reached and there is no nudge pending
+	if ((applied == target) && (nudge_end == 0)) arm_ramp (FALSE);
+	return TRUE;
+}
+
+
+// create tempo ramp timer and register it to the main loop
+// returns TRUE if OK, FALSE otherwise
+int init_tempo ()
+{
+	ramp_timer = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (ramp_timer < 0) {
+		fprintf (stderr, "tempo timer creation failed\n");
+		return FALSE;
+	}
+	return add_loop_fd (ramp_timer, tempo_event);
+}
+
+
+// tap on the beat switch at time t (in us): update tempo tracker, then ramp tempo of the player and correct its phase
+// previous is the time of the last tap; it is set to 0 when a new song is loaded, to start tracking again
+void tempo_tap (uint64_t t)
+{
+	double pos, phase;
+	int tempo_us, res, division;
+
+	tempo_us = engine_get_midi_tempo (player);	// get tempo per quarter note
+	if (tempo_us == FLUID_FAILED) return;
+
+	if (previous == 0) {
+		init_tap (&tracker, tempo_us);
+		applied = tempo_us;
+		nudge_end = 0;
+	}
+
+	res = tap (&tracker, t);
+	if (res == TAP_IGNORED) return;
+	previous = t;
+	if (tracker.locked < 2) return;
+
+	// player phase against the tap: tapped beat shall fall on a quarter note of the song
+	// position of the player is taken back to what was heard at the time of the tap: player is ahead of the speakers by the output latency,
+	// and the tap has been time stamped some time before it is processed here
+	division = (song_smf != NULL) ? song_smf->division : DEFAULT_DIVISION;
+	pos = (double) engine_get_current_tick (player) / division;
+	pos -= (double) (micros () - t + get_audio_latency ()) / applied;
+	phase = pos - floor (pos + 0.5);
+
+	// correct phase over the next beat, then go back to tracked tempo
+	// phase is not corrected on an outlier, as the tap is not trusted
+	if (res == TAP_OUTLIER) target = tracker.period;
+	else {
+		target = nudge_period (tracker.period, phase);
+		nudge_end = t + (uint64_t) tracker.period;
+	}
+	if (res == TAP_RELOCK) applied = tracker.period;	// tempo has changed: no ramp
+
+	arm_ramp (TRUE);
+}
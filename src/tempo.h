@@ -0,0 +1,13 @@
+/** @file tempo.h
+ *
+ * @brief This file defines prototypes of functions inside tempo.c
+ *
+ */
+
+void init_tap (tap_tracker_t *, double);
+int tap (tap_tracker_t *, uint64_t);
+double nudge_period (double, double);
+double ramp_period (double, double);
+int tempo_event (int);
+int init_tempo ();
+void tempo_tap (uint64_t);
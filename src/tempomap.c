@@ -0,0 +1,218 @@
+/** @file tempomap.c
+ *
+ * @brief Tempo map of a song: tempo (FF 51) and time signature (FF 58) changes of the midi file, built once when the song is loaded,
+ * as a sorted array of segments with the time and the bar at which each one starts. Conversions between ticks, time and bar:beat
+ * are a binary search in the segments, instead of a walk through the events of the song.
+ * When the user sets the tempo (tap tempo, tempo ramps), the song is played at this tempo from start to end: time is then linear
+ * in ticks. Bars and beats do not depend on tempo.
+ *
+ */
+
+#include <stdatomic.h>
+#include "types.h"
+#include "globals.h"
+#include "config.h"
+#include "process.h"
+#include "utils.h"
+#include "gpio.h"
+#include "smf.h"
+#include "tempomap.h"
+
+#define DEFAULT_TEMPO		500000		// default midi tempo: 120 BPM, in us per quarter note
+#define DEFAULT_DIVISION	96			// ticks per quarter note, if the song has no event table
+
+
+// length of a beat of a segment, in ticks: a 1/den note (at least a tick, for very low divisions)
+static uint32_t beat_ticks (tempo_map_t *map, tempo_segment_t *s)
+{
+	uint32_t len = map->division * 4 / s->den;
+
+	return (len > 0) ? len : 1;
+}
+
+
+// length of a bar of a segment, in ticks
+static uint32_t bar_ticks (tempo_map_t *map, tempo_segment_t *s)
+{
+	return s->num * beat_ticks (map, s);
+}
+
+
+// build tempo map from tempo and time signature meta events of the event table (an empty song if smf is NULL)
+// the first segment is at tick 0, at 120 BPM and 4/4 unless the song sets them there
+// a time signature starts a bar; if it falls within a bar, this bar is cut short, and counts as a bar
+// returns TRUE if OK, FALSE if out of memory
+int build_tempo_map (tempo_map_t *map, smf_t *smf)
+{
+	smf_event_t *ev;
+	tempo_segment_t *s;
+	uint32_t tempo = 0, len;
+	int i, num = 0, den = 0, n = 1;
+
+	if (smf != NULL) n += smf->nb_meta;
+	map->division = ((smf != NULL) && (smf->division > 0)) ? smf->division : DEFAULT_DIVISION;
+	atomic_init (&map->external, 0);
+	if ((map->seg = malloc (n * sizeof (tempo_segment_t))) == NULL) return FALSE;
+
+	memset (map->seg, 0, sizeof (tempo_segment_t));
+	map->seg [0].tempo = DEFAULT_TEMPO;
+	map->seg [0].num = map->seg [0].den = 4;
+	map->nb = 1;
+
+	for (i = 0; (smf != NULL) && (i < smf->nb_meta); i++) {
+		ev = &smf->event [smf->meta_index [i]];
+		if ((ev->data [0] == 0x51) && (ev->len == 3)) {
+			tempo = (ev->meta [0] << 16) | (ev->meta [1] << 8) | ev->meta [2];
+			if (tempo == 0) continue;
+		}
+		// time signature: numerator, and denominator as a power of 2 (a 1/64 note at most)
+		else if ((ev->data [0] == 0x58) && (ev->len >= 2)) {
+			// checked before the shift: a malformed exponent would overflow it
+			if ((ev->meta [0] == 0) || (ev->meta [1] > 6)) continue;
+			num = ev->meta [0];
+			den = 1 << ev->meta [1];
+			tempo = 0;
+		}
+		else continue;
+
+		// new segment, from the previous one; several changes at the same tick go into the same segment
+		s = &map->seg [map->nb - 1];
+		if (ev->tick != s->tick) {
+			s [1] = s [0];
+			s [1].tick = ev->tick;
+			s [1].us = s->us + (double) (ev->tick - s->tick) * s->tempo / map->division;
+			s++;
+			map->nb++;
+		}
+
+		if (tempo != 0) s->tempo = tempo;
+		else {
+			if (s->bar_tick != s->tick) {
+				len = bar_ticks (map, s);
+				s->bar += (s->tick - s->bar_tick + len - 1) / len;
+				s->bar_tick = s->tick;
+			}
+			s->num = num;
+			s->den = den;
+		}
+	}
+	return TRUE;
+}
+
+
+// free memory of a tempo map
+void free_tempo_map (tempo_map_t *map)
+{
+	free (map->seg);
+	map->seg = NULL;
+	map->nb = 0;
+}
+
+
+// find index of the segment tick falls in, with a binary search
+int find_tempo_segment (tempo_map_t *map, uint32_t tick)
+{
+	int lo = 0, hi = map->nb, mid;
+
+	// last segment starting at or before tick; the first one starts at tick 0
+	while (hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if (map->seg [mid].tick <= tick) lo = mid;
+		else hi = mid;
+	}
+	return lo;
+}
+
+
+// time of tick from the start of the song, in us, at the tempo set by the user or along the tempo map
+double tick_to_us (tempo_map_t *map, uint32_t tick)
+{
+	tempo_segment_t *s;
+	int external = atomic_load (&map->external);
+
+	if (external > 0) return (double) tick * external / map->division;
+	s = &map->seg [find_tempo_segment (map, tick)];
+	return s->us + (double) (tick - s->tick) * s->tempo / map->division;
+}
+
+
+// tick at time us from the start of the song, at the tempo set by the user or along the tempo map
+uint32_t us_to_tick (tempo_map_t *map, double us)
+{
+	tempo_segment_t *s;
+	int lo = 0, hi = map->nb, mid;
+	int external = atomic_load (&map->external);
+
+	if (us <= 0.0) return 0;
+	if (external > 0) return (uint32_t) (us * map->division / external);
+
+	// last segment starting at or before us: time of segments grows with their tick
+	while (hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if (map->seg [mid].us <= us) lo = mid;
+		else hi = mid;
+	}
+	s = &map->seg [lo];
+	return s->tick + (uint32_t) ((us - s->us) * map->division / s->tempo);
+}
+
+
+// bar and beat of tick, counted from 1 as musicians do (bar 1 beat 1 is the start of the song)
+void tick_to_bar (tempo_map_t *map, uint32_t tick, int *bar, int *beat)
+{
+	tempo_segment_t *s;
+	uint32_t d, len;
+
+	s = &map->seg [find_tempo_segment (map, tick)];
+	d = tick - s->bar_tick;
+	len = bar_ticks (map, s);
+	*bar = s->bar + d / len + 1;
+	*beat = (d % len) / beat_ticks (map, s) + 1;
+}
+
+
+// first multiple of grid ticks from the start of a bar, at or after tick; a time signature change before it starts a bar
+static uint32_t next_grid (tempo_map_t *map, uint32_t tick, int bar)
+{
+	tempo_segment_t *s;
+	uint32_t grid, next;
+	int i;
+
+	i = find_tempo_segment (map, tick);
+	s = &map->seg [i];
+	grid = bar ? bar_ticks (map, s) : beat_ticks (map, s);
+	next = s->bar_tick + (tick - s->bar_tick + grid - 1) / grid * grid;
+
+	for (i++; (i < map->nb) && (map->seg [i].tick < next); i++) {
+		if (map->seg [i].bar_tick == map->seg [i].tick) return map->seg [i].tick;
+	}
+	return next;
+}
+
+
+// tick of the next beat, at or after tick
+uint32_t next_beat_tick (tempo_map_t *map, uint32_t tick)
+{
+	return next_grid (map, tick, FALSE);
+}
+
+
+// tick of the next bar, at or after tick
+uint32_t next_bar_tick (tempo_map_t *map, uint32_t tick)
+{
+	return next_grid (map, tick, TRUE);
+}
+
+
+// position of tick in a song ending at end, for display: bar and beat, time played and time left (eg. "bar 17.1, 0:32, 2:41 left")
+// returns s
+char* position_string (tempo_map_t *map, uint32_t tick, uint32_t end, char *s)
+{
+	int bar, beat, t, left;
+
+	tick_to_bar (map, tick, &bar, &beat);
+	t = (int) (tick_to_us (map, tick) / 1000000.0);
+	left = (tick < end) ? (int) ((tick_to_us (map, end) - tick_to_us (map, tick)) / 1000000.0) : 0;
+	sprintf (s, "bar %d.%d, %d:%02d, %d:%02d left", bar, beat, t / 60, t % 60, left / 60, left % 60);
+	return s;
+}
@@ -0,0 +1,15 @@
+/** @file tempomap.h
+ *
+ * @brief This file defines prototypes of functions inside tempomap.c
+ *
+ */
+
+int build_tempo_map (tempo_map_t *, smf_t *);
+void free_tempo_map (tempo_map_t *);
+int find_tempo_segment (tempo_map_t *, uint32_t);
+double tick_to_us (tempo_map_t *, uint32_t);
+uint32_t us_to_tick (tempo_map_t *, double);
+void tick_to_bar (tempo_map_t *, uint32_t, int *, int *);
+uint32_t next_beat_tick (tempo_map_t *, uint32_t);
+uint32_t next_bar_tick (tempo_map_t *, uint32_t);
+char* position_string (tempo_map_t *, uint32_t, uint32_t, char *);
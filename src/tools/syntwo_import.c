@@ -0,0 +1,111 @@
+/** @file syntwo_import.c
+ *
+ * @brief Import of songs: each song of ./songs/ is normalized into its optimized form (see optimize.c): tracks merged into a single track,
+ * redundant controller, program and tempo changes removed, controller and pitch bend ramps thinned to a tolerance.
+ * The optimized file is cached next to the song, and syntwo plays it instead of the song as long as the song has not changed since.
+ * Reduction of the number of events is reported for each song.
+ *
+ * usage: syntwo_import [-t cc_tolerance] [-b bend_tolerance] [-f] [song_number ...]
+ * tolerances are in controller steps (0-127) and pitch bend steps (0-16383); 0 keeps all points of ramps
+ * songs are only imported again if they have changed since their last import, unless -f is given
+ * numbers are hexadecimal, as file names (song number is bank * 256 + index in bank); all songs are imported if none is given
+ *
+ */
+
+#include <unistd.h>
+#include "../types.h"
+#include "../main.h"
+#include "../config.h"
+#include "../process.h"
+#include "../utils.h"
+#include "../loop.h"
+#include "../library.h"
+#include "../optimize.h"
+
+#define NB_SONG_NUM		0x10000		// song numbers: 256 banks of 256 songs
+#define NAME_LEN		310
+#define CC_TOL			1			// default tolerance of controller ramps: one step
+#define BEND_TOL		32			// default tolerance of pitch bend ramps: 32 steps, under one cent with a bend range of 2 semitones
+
+static int cc_tol = CC_TOL, bend_tol = BEND_TOL, force = FALSE;
+static optimize_t total;
+
+
+// import song number, and report reduction of events
+static void import (int num)
+{
+	optimize_t r;
+	char name [NAME_LEN], opt [NAME_LEN];
+
+	if (get_full_filename (name, num, "./songs/") == FALSE) {
+		fprintf (stderr, "no song %02X\n", num);
+		return;
+	}
+	if (!force && use_optimized (name, opt)) {
+		printf ("%02X %-40s up to date\n", num, name + strlen ("./songs/"));
+		return;
+	}
+	if (optimize_song (name, cc_tol, bend_tol, &r) == FALSE) {
+		fprintf (stderr, "cannot import %s\n", name);
+		return;
+	}
+
+	printf ("%02X %-40s %2d tracks  %7d -> %7d events (-%4.1f%%)  redundant %6d  thinned %6d  meta %4d  %6zu -> %6zu bytes\n",
+		num, name + strlen ("./songs/"), r.tracks, r.events, r.kept, (r.events > 0) ? 100.0 * (r.events - r.kept) / r.events : 0.0,
+		r.redundant, r.thinned, r.meta, r.size, r.opt_size);
+
+	total.tracks++;
+	total.events += r.events;
+	total.kept += r.kept;
+	total.redundant += r.redundant;
+	total.thinned += r.thinned;
+	total.meta += r.meta;
+	total.size += r.size;
+	total.opt_size += r.opt_size;
+}
+
+
+int main (int argc, char *argv[])
+{
+	char name [NAME_LEN];
+	int opt, num;
+
+	while ((opt = getopt (argc, argv, "t:b:f")) != -1) {
+		switch (opt) {
+			case 't':
+				cc_tol = atoi (optarg);
+				break;
+			case 'b':
+				bend_tol = atoi (optarg);
+				break;
+			case 'f':
+				force = TRUE;
+				break;
+			default:
+				fprintf (stderr, "usage: syntwo_import [-t cc_tolerance] [-b bend_tolerance] [-f] [song_number ...]\n");
+				exit (0);
+		}
+	}
+
+	// index of songs; directories are not watched, main loop is not run
+	init_loop ();
+	init_library ();
+
+	memset (&total, 0, sizeof (optimize_t));
+	if (optind < argc) {
+		for (; optind < argc; optind++) import (strtol (argv [optind], NULL, 16));
+	}
+	else {
+		for (num = 0; num < NB_SONG_NUM; num++) {
+			if (get_full_filename (name, num, "./songs/")) import (num);
+		}
+	}
+
+	// total of songs imported (tracks is the number of songs here)
+	if (total.tracks > 0) {
+		printf ("%d songs imported: %d -> %d events (-%.1f%%), redundant %d, thinned %d, meta %d, %zu -> %zu bytes\n",
+			total.tracks, total.events, total.kept, (total.events > 0) ? 100.0 * (total.events - total.kept) / total.events : 0.0,
+			total.redundant, total.thinned, total.meta, total.size, total.opt_size);
+	}
+	return 0;
+}
@@ -0,0 +1,102 @@
+/** @file syntwo_profile.c
+ *
+ * @brief Offline profiler of songs: each song of ./songs/ is rendered against a soundfont through a song engine (no audio hardware),
+ * faster than realtime, with the same synth setup as syntwo. Peak polyphony, voices and cpu time per second are saved to a profile
+ * per song (./save/XX.prof), which syntwo reads when the song is loaded to set polyphony and quality level up front.
+ * Run it on the Pi that plays the gig: cpu times are those of the machine it runs on.
+ *
+ * usage: syntwo_profile [-s soundfont_number] [song_number ...]
+ * numbers are hexadecimal, as file names (song number is bank * 256 + index in bank); all songs are profiled if none is given
+ *
+ */
+
+#include <unistd.h>
+#include "../types.h"
+#include "../main.h"
+#include "../config.h"
+#include "../process.h"
+#include "../utils.h"
+#include "../loop.h"
+#include "../library.h"
+#include "../audio.h"
+#include "../profile.h"
+
+#define NB_SONG_NUM		0x10000		// song numbers: 256 banks of 256 songs
+#define NAME_LEN		300
+
+
+// profile song number, and save its profile
+static void profile (int num, char *soundfont)
+{
+	profile_t prof;
+	char name [NAME_LEN];
+	char *s;
+
+	if (get_full_filename (name, num, "./songs/") == FALSE) {
+		fprintf (stderr, "no song %02X\n", num);
+		return;
+	}
+	if (profile_song (name, &prof) == FALSE) return;
+
+	s = strrchr (soundfont, '/');
+	snprintf (prof.soundfont, sizeof (prof.soundfont), "%s", (s != NULL) ? s + 1 : soundfont);
+	if (save_profile (num, &prof) == FALSE) fprintf (stderr, "cannot save profile of song %02X\n", num);
+
+	printf ("%02X %-40s %4u s  x%5.1f realtime  peak load %5.1f%%  peak voices %3d  max block %5u us  -> polyphony %3d, level %d\n",
+		num, name + strlen ("./songs/"), prof.duration_ms / 1000, prof.rt_factor, prof.peak_load, prof.peak_voices,
+		prof.max_block_us, prof.polyphony, prof.level);
+	free_profile (&prof);
+}
+
+
+int main (int argc, char *argv[])
+{
+	char soundfont [NAME_LEN], name [NAME_LEN];
+	int opt, num, sf = -1;
+
+	while ((opt = getopt (argc, argv, "s:")) != -1) {
+		switch (opt) {
+			case 's':
+				sf = strtol (optarg, NULL, 16);
+				break;
+			default:
+				fprintf (stderr, "usage: syntwo_profile [-s soundfont_number] [song_number ...]\n");
+				exit (0);
+		}
+	}
+
+	// index of songs and soundfonts; directories are not watched, main loop is not run
+	init_loop ();
+	init_library ();
+
+	// same synth as syntwo, rendered by blocks of a period without audio driver
+	// song engine is timed on rendered frames, so songs are rendered as fast as the cpu allows
+	settings = new_fluid_settings ();
+	set_audio_profile (NULL, 0);
+	fluid_settings_setint (settings, "synth.lock-memory", 0);
+	synth = new_fluid_synth (settings);
+
+	strcpy (soundfont, DEFAULT_SF2);
+	if ((sf >= 0) && (get_full_filename (soundfont, sf, "./soundfonts/") == FALSE)) {
+		fprintf (stderr, "no soundfont %02X\n", sf);
+		exit (0);
+	}
+	if (fluid_synth_sfload (synth, soundfont, TRUE) == FLUID_FAILED) {
+		fprintf (stderr, "cannot load soundfont %s\n", soundfont);
+		exit (0);
+	}
+	printf ("profiling against %s\n", soundfont);
+
+	if (optind < argc) {
+		for (; optind < argc; optind++) profile (strtol (argv [optind], NULL, 16), soundfont);
+	}
+	else {
+		for (num = 0; num < NB_SONG_NUM; num++) {
+			if (get_full_filename (name, num, "./songs/")) profile (num, soundfont);
+		}
+	}
+
+	delete_fluid_synth (synth);
+	delete_fluid_settings (settings);
+	return 0;
+}
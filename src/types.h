@@ -13,8 +13,11 @@
 #include <signal.h>
 #include <dirent.h>
 #include <time.h>
+#include <stdint.h>
+#ifndef NO_PIGPIO
 #include <pigpio.h>
 #include <pigpiod_if2.h>		// stupid pigpio cannot be run without beig root...
+#endif
 #ifndef WIN32
 #include <unistd.h>
 #endif
@@ -27,11 +30,13 @@
 /* default GPIO pins */
 #define LED_GPIO	19
 #define SWITCH_GPIO	26
-#define ANTIBOUNCE_US   250000      // 0.25 sec = 250000 usec : used for switch anti-bouncing check : allows 240BPM max
+#define ANTIBOUNCE_US   30000       // 0.03 sec = 30000 usec : used for switch anti-bouncing check, on time stamped presses
+#define DEBOUNCE_US     5000        // switch level shall be steady for 5 ms before an edge is reported by the backend (pigpiod glitch filter, kernel debounce)
 #define TIMEON_US       200000      // 0.20 sec : used as on/off time for leds 
 
 /* default soundfont file */
 #define DEFAULT_SF2 "./soundfonts/00_FluidR3_GM.sf2"
+#define DEFAULT_SF2_NUM	0x00	// file number of default soundfont
 
 /* define status, etc */
 #define TRUE 1
@@ -43,13 +48,35 @@
 #define NB_CHANNEL	8	// 8 channel
 #define NB_RECSHIFT	2	// shift key has 2 positions (non-shift & shift)
 #define NB_CYCSHIFT	2	// shift key has 2 positions (non-shift & shift)
-#define NB_MARKER	10	// up to 10 time markers for a song
+#define SECTION_NAME_LEN	32	// max length of section names (text of midi marker meta events)
+#define NB_STATUS	8	// midi status types (status nibble 0x8 to 0xF) for dispatch table
+#define NB_CONTROL	128	// midi controller (or key) numbers for dispatch table
+#define NB_SHIFT	2	// shift state used by dispatch table: 0 = non-shift, 1 = shift
+#define NB_MIDI_CHANNEL	16	// midi channels of a song
+#define NB_CHASE_CC	120	// controllers 0 to 119 are chased in snapshots (120 to 127 are channel mode messages)
+#define NB_COMMAND	256	// commands in each command ring (power of 2)
+#define NB_ENGINE	16	// song engines alive at a time: current, prepared, cued and retired songs, offline rendering
+
+/* status of a song engine (see engine.c) */
+#define ENGINE_READY	0	// created, not played yet
+#define ENGINE_PLAYING	1	// events are dispatched by the audio callback
+#define ENGINE_DONE		2	// stopped, or end of song reached
+
+/* commands pushed to the main loop by other threads (see command.c) */
+#define CMD_CONTROL		0	// midi message of a control of the midi controller
+#define CMD_SWITCH		1	// cued song has been started by the synth thread
+
+/* sources of commands: one ring per producer thread */
+#define CMD_FROM_MIDI	0	// midi driver thread
+#define CMD_FROM_SYNTH	1	// synth thread (player callbacks)
+#define NB_CMD_SOURCE	2
 
 /* types */
 typedef struct {								// structure for each control
 	uint8_t message [3];						// midi message of the control (sent from device to PI)
-	uint8_t value;								// value of the control (ie. value of slider position from incoming midi hw)
-	uint8_t value_rt;							// value of volume in real-time (actual volume info received from the midi song, this could change over time)
+	_Atomic uint8_t value;						// value of the control (ie. value of slider position from incoming midi hw); read by the player thread
+	_Atomic uint8_t value_rt;					// value of volume in real-time (actual volume info received from the midi song, this could change over time); written by the player thread
+	_Atomic uint8_t value_applied;				// value of the control applied to the song: value, once its scheduled CC7 has taken effect (see mixer.c); read by the player thread
 	uint8_t value_m;					// storage for value of the control in case of mute
 	uint8_t value_s;					// storage for value of the control in case of solo
 	int (*action) (void*, uint8_t*);		// function to be called if control is actioned
@@ -57,8 +84,8 @@ typedef struct {								// structure for each control
 
 typedef struct {				// structure for each control
 	uint8_t message [3];			// midi message of the control (sent from device to PI)
-	uint8_t value;					// value of the control (ie. value of the knob from incoming midi hw)
-	uint8_t value_rt;					// value of balance in real-time (actual balance info received from the midi song, this could change over time)
+	_Atomic uint8_t value;			// value of the control (ie. value of the knob from incoming midi hw); read by the player thread
+	_Atomic uint8_t value_rt;			// value of balance in real-time (actual balance info received from the midi song, this could change over time); written by the player thread
 	int (*action) (void*,uint8_t*);		// function to be called if control is actioned
 } knob_t;
 
@@ -77,3 +104,185 @@ typedef struct {				// structure for each channel control
 	button_t mute;
 	button_t rec;				// rec is used as shift key
 } channel_t;
+
+typedef struct {				// dispatch table entry: what to call when a given (status, controller) midi message is received
+	void *control [NB_SHIFT];		// control to be passed to action, indexed on shift state
+	int (*action [NB_SHIFT]) (void*,uint8_t*);	// function to be called, indexed on shift state; NULL if message is not assigned
+	uint8_t *shift;				// value of the key used as shift for this control (cycle, rec...); only bit 0 is used
+} dispatch_t;
+
+typedef struct {				// midi file event, as given by smf_walk ()
+	uint32_t tick;					// absolute time of the event, in ticks
+	uint8_t track;					// track number in the file
+	uint8_t status;					// status byte (including channel) of the event; 0xFF for meta events, 0xF0/0xF7 for sysex
+	uint8_t data [2];				// data bytes of channel events; data [0] is meta type for meta events
+	uint32_t len;					// length of meta or sysex data
+	uint8_t *meta;					// meta or sysex data (points into the file buffer)
+} smf_event_t;
+
+typedef struct {				// command pushed to the main loop
+	uint8_t type;					// CMD_CONTROL, CMD_SWITCH...
+	uint8_t data [3];				// midi message of CMD_CONTROL
+} command_t;
+
+typedef struct {				// lock-free ring of commands, with a single producer thread and a single consumer thread (main loop)
+	command_t command [NB_COMMAND];
+	_Atomic unsigned int head;		// next command to be written; written by the producer only
+	_Atomic unsigned int tail;		// next command to be read; written by the consumer only
+	_Atomic unsigned long dropped;	// commands dropped because ring was full
+} command_ring_t;
+
+typedef struct {				// midi file parsed once into an event table
+	uint8_t *buf;					// content of the file (meta data of events point into it)
+	size_t len;
+	int division;					// ticks per quarter note (PPQ)
+	int nb_event;					// number of events
+	smf_event_t *event;				// events of all tracks, sorted by tick (events at the same tick keep file order)
+	int nb_meta;					// number of meta events
+	int *meta_index;				// index in event table of each meta event (tempo, markers...), in tick order
+} smf_t;
+
+typedef struct {				// result of the import of a midi file into its optimized form (see optimize_song ())
+	int tracks;						// tracks of the original file
+	int events;						// events of the original file
+	int kept;						// events of the optimized file (end of track excluded)
+	int redundant;					// controller, program and tempo changes to the current value
+	int thinned;					// points of controller and pitch bend ramps within tolerance of the last point kept
+	int meta;						// end of track, channel prefix and port meta events, meaningless once tracks are merged
+	size_t size, opt_size;			// size of original and optimized files, in bytes
+} optimize_t;
+
+typedef struct {				// segment of a tempo map: tempo and time signature are the same from its tick to the next segment
+	uint32_t tick;					// start of the segment
+	uint32_t tempo;					// tempo, in us per quarter note
+	double us;						// time of the start of the segment from the start of the song, in us, at the tempo of the song
+	uint8_t num, den;				// time signature (eg. 6 and 8 for 6/8); a beat is a 1/den note
+	uint32_t bar;					// number of the bar starting at bar_tick, from 0
+	uint32_t bar_tick;				// start of a bar of the segment: the segment itself, or the bar it falls in for a tempo change
+} tempo_segment_t;
+
+typedef struct {				// tempo map of a song: tempo and time signature changes, with their time and bar (see tempomap.c)
+	int nb;							// number of segments; the first one is at tick 0
+	tempo_segment_t *seg;			// segments, sorted by tick
+	int division;					// ticks per quarter note
+	_Atomic int external;			// tempo set by the user, in us per quarter note, used instead of the tempo of the song; 0 if none
+} tempo_map_t;
+
+typedef struct {				// song engine: built-in sequencer playing a song from the audio callback (see engine.c)
+	// events of the song, as flat arrays: the dispatch loop only goes through the tick array until an event is due
+	int nb_event;
+	uint32_t *tick;					// tick of each event, sorted
+	uint32_t *msg;					// channel event: status | data1 << 8 | data2 << 16; sysex: 0xF0 | index in sysex table << 8
+	int nb_sysex;
+	int *sysex;						// offset of each sysex in sysex data (one more offset for the end of the last one)
+	uint8_t *sysex_data;			// sysex messages, without F0 and trailing F7
+	tempo_map_t map;				// tempo map of the song, and tempo set by the user
+	uint32_t total_ticks;			// tick of the last event
+	double rate;					// sample rate, in frames per second
+	// playback state, written by the audio thread only
+	double pos;						// position in the song, in ticks
+	int next;						// next event to dispatch
+	int segment;					// segment of the tempo map at position
+	int last_tick;					// tick given to the last tick callback
+	// requests from other threads, and position published by the audio thread
+	_Atomic int status;				// ENGINE_READY, ENGINE_PLAYING or ENGINE_DONE
+	_Atomic int seek;				// tick to go to at next block; -1 if none
+	_Atomic int release;			// TRUE if notes shall be released at next block (playback stopped)
+	_Atomic int cur_tick;			// position at the start of the current block
+	_Atomic int cur_tempo;			// tempo of the tempo map at position, in us per quarter note
+	handle_midi_event_func_t playback;	// callback of events; NULL to send them to the synth directly
+	void *playback_data;
+	handle_midi_tick_func_t on_tick;	// callback called once per block with the position; NULL if none
+	void *tick_data;
+	fluid_synth_t *synth;
+	fluid_midi_event_t *event;		// midi event given to the playback callback, allocated once
+} engine_t;
+
+typedef struct {				// information about a midi file, cached in library index
+	int format;						// SMF format (0, 1 or 2)
+	int ntracks;					// number of tracks
+	int division;					// ticks per quarter note (PPQ)
+	int tempo;						// initial tempo, in us per quarter note
+	uint32_t ticks;					// length of the song, in ticks
+	uint32_t duration_ms;			// length of the song, in ms
+	uint16_t channels;				// bitmask of midi channels used in the song
+} midi_info_t;
+
+typedef struct {				// saved context of a song (see save_song () and read_song ())
+	int loaded;						// TRUE if context has been read from save file
+	int volume;						// general volume (0 to 10)
+	int bpm;						// bpm set by user; 0 if bpm of the file is used
+	uint8_t slider [NB_CHANNEL] [NB_RECSHIFT];	// slider values
+	uint8_t knob [NB_CHANNEL] [NB_RECSHIFT];	// knob values
+	int nb_mark;					// number of time markers set by the user
+	uint32_t *mark;					// time markers set by the user, in ticks (allocated by read_song (), to be freed by caller)
+	int polyphony;					// polyphony advised by the load profile of the song; 0 if there is no profile
+	int level;						// quality level advised by the load profile of the song (see govern.c)
+} song_t;
+
+typedef struct {				// load profile of a song, rendered offline (see render_song () and save_profile ())
+	char soundfont [64];			// soundfont the song has been rendered with
+	uint32_t duration_ms;			// rendered length of the song
+	int nb_second;					// number of seconds of the per-second statistics
+	uint16_t *voices;				// max active voices in each second of the song
+	uint32_t *cpu_us;				// time spent rendering each second of the song, in us
+	int peak_voices;				// peak and mean polyphony of the synth
+	double mean_voices;
+	int peak_channel [NB_MIDI_CHANNEL];	// peak polyphony of each midi channel
+	uint32_t max_block_us;			// render time per block: max and mean, in us
+	double mean_block_us;
+	double peak_load;				// cpu load of the busiest second, in %
+	double rt_factor;				// audio time rendered per render time
+	int polyphony;					// advised polyphony and quality level, set up front when the song is loaded
+	int level;
+} profile_t;
+
+typedef struct {				// state of all midi channels at a given tick, chased from the start of the song
+	int valid;						// TRUE if snapshot has been computed
+	uint32_t tick;					// tick of the snapshot
+	uint32_t tempo;					// tempo at tick, in us per quarter note
+	uint8_t program [NB_MIDI_CHANNEL];			// program of each channel; 0xFF if not set
+	uint16_t bend [NB_MIDI_CHANNEL];			// pitch bend of each channel; 0xFFFF if not set
+	uint8_t cc [NB_MIDI_CHANNEL] [NB_CHASE_CC];	// value of each controller (including bank select) of each channel; 0xFF if not set
+} snapshot_t;
+
+typedef struct {				// section of a song: marker or cue point of the midi file (FF 06 / FF 07), or time marker set by the user
+	uint32_t tick;					// start of the section
+	int user;						// TRUE if set by the user (saved in song context), FALSE if read from the midi file
+	char name [SECTION_NAME_LEN];	// text of the marker meta event; empty for time markers set by the user
+	snapshot_t snap;				// state of midi channels at start of the section
+} section_t;
+
+typedef struct {				// index of the sections of a song, sorted by tick
+	int nb;							// number of sections
+	int max;						// allocated number of sections
+	section_t *section;
+} section_list_t;
+
+#define NB_TAP_HISTORY	8		// number of recent tap intervals kept by the tap tempo tracker
+
+/* results of tap () */
+#define TAP_FIRST	0		// first tap after (re)start: gives the phase only
+#define TAP_LOCKED	1		// tap taken into account: period and phase updated
+#define TAP_IGNORED	2		// double tap: ignored
+#define TAP_OUTLIER	3		// tap too far from predicted beat: rejected
+#define TAP_RELOCK	4		// tempo has changed, or tapping has resumed: tracker locked again
+
+typedef struct {				// tap tempo tracker: phase-locked estimate of beat period and beat time from taps
+	double period;					// estimated beat period, in us
+	double beat;					// estimated time of the last beat, in us
+	double error;					// timing error of the last tap against predicted beat, in us (positive if late)
+	uint64_t last_tap;				// time of the last tap taken into account, in us
+	int locked;						// number of taps since last (re)lock; 0 if no tap yet
+	int outliers;					// number of consecutive taps rejected as outliers
+	double interval [NB_TAP_HISTORY];	// recent intervals between taps, per beat, in us
+	int nb_interval;				// number of intervals in history (ring buffer)
+} tap_tracker_t;
+
+typedef struct {				// backend of the beat switch and its LED (see gpio.c)
+	char *name;
+	int (*open) (char *);			// open backend with its argument; returns fd on which the main loop is woken up by presses, or -1
+	int (*read_edge) (uint64_t *);	// get next press, time stamped in us on the same clock as micros (); returns FALSE if none is left
+	void (*led) (int);				// turn LED ON or OFF
+	void (*close) ();
+} gpio_backend_t;
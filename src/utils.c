@@ -10,122 +10,85 @@
 #include "process.h"
 #include "utils.h"
 #include "gpio.h"
+#include "loader.h"
+#include "library.h"
+#include "cue.h"
+#include "smf.h"
+#include "section.h"
+#include "abloop.h"
+#include "govern.h"
+#include "profile.h"
+#include "mixer.h"
+#include "engine.h"
 
 // in the given directory, look for filename starting with number, and return corresponding full name
-// returns FALSE if no file found, TRUE if file is found 
-int get_full_filename (char * name, unsigned char number, char * directory) {
-
-	DIR *dir;
-	struct dirent *ent;
-	char st1[3], st2[3];
-
-	// convert number into string (in lowercases and uppercases)
-	sprintf (st1, "%02x", number);
-	sprintf (st2, "%02X", number);
-	if ((dir = opendir (directory)) != NULL) {
-		/* print all the files and directories within directory */
-		while ((ent = readdir (dir)) != NULL) {
-			// check if file starts with number; allow mixing lower and upper cases
-			if (((st1[0] == ent->d_name [0]) || (st2[0] == ent->d_name [0])) && ((st1[1] == ent->d_name [1]) || (st2[1] == ent->d_name [1]))) {
-				// copy full file name (including directory) into result variable
-				strcpy (name, directory);
-				strcat (name, ent->d_name);
-				closedir (dir);
-				return TRUE;
-			}
-		}
-	// could not find a file starting with number
-	closedir (dir);
-	return FALSE;
-	}
+// returns FALSE if no file found, TRUE if file is found
+// directory is not scanned: file is found in the library index, which is kept current by inotify
+int get_full_filename (char * name, int number, char * directory) {
 
-	else {
-		// could not open directory
-		fprintf ( stderr, "Directory not found.\n" );
-		return FALSE;
-	}
+	return lookup_library (name, number, directory);
 }
 
 
-// Check if file number (ie. filename) of midi & sf2 files has changed compared to what is currently used/played. So yes, then load new files (either midi, either SF2, either both)
+// Check if file number (ie. filename) of midi & sf2 files has changed compared to what is currently used/played. So yes, then swap in new files (either midi, either SF2, either both)
+// files have been prepared in background by the loader thread as soon as file number has been selected
 int load_midi_sf2 () {
 
-	// string containing : directory + filename
-	char name [300];
+	engine_t* p;
+	smf_t* smf;
+	int id;
+
+	// delete players that have been replaced by cued songs
+	reap_players ();
 
 	// make sure no file is playing to allow load of new files !
-	if ((fluid_player_get_status (player)== FLUID_PLAYER_DONE) || (fluid_player_get_status (player)== FLUID_PLAYER_READY)) {
+	if ((engine_get_status (player)== ENGINE_DONE) || (engine_get_status (player)== ENGINE_READY)) {
 
 		// check if user has requested load midi of midi file and that new file to download is not the same as current
 		if (new_midi_num != current_midi_num) {
-		
-			// get name of requested midi file from directory
-			if (get_full_filename (name, new_midi_num, "./songs/") == TRUE) {
-				// if a file exists
-				if (fluid_is_midifile(name)) {
-printf ("midi:%s\n", name);
-					// delete current fluid player
-					delete_fluid_player (player);
-					// create new player
-					player = new_fluid_player(synth);
-
-					// assign a callback function for midi events going to the synth
-					fluid_player_set_playback_callback (player, handle_midi_event_to_synth, (void *) synth);
-
-					// load midi file
-					fluid_player_add(player, name);
-
-					// set endless looping of current file
-					//fluid_player_set_loop (player, -1);
-
-					// initial bpm of the file is set to -1 to force reading of initial bpm if bpm pads are pressed
-					initial_bpm = -1;
-					bpm = 0	;			// bpm is only set when file is playing
-					now = 0;			// used for automated tempo adjustment (at press of switch)
-					previous = 0;
-
-					// clear table of time markers
-					memset (&marker [0], 0, sizeof (int) * NB_MARKER);
-					marker_pos = 0;
-
-					// set default values for sliders and song volume: all values to max
-					set_slider_value (0x64);
-					set_volume_value (0x7F);		// useless as it is done before play... but let's do it anyway
-					// set default values for knobs and song panning: all values to middle
-					set_knob_value (0x40);
-					set_panning_value (0x40);		// useless as it is done before play... but let's do it anyway
-
-					// load a save of previous settings (sliders values, knobs...), if exists
-					load_song (new_midi_num);
-
-					// we are at initial BPM, set leds accordingly
-					// this is useless as we cannot control the leds for now
-					led (&rwd[0], ON);
-					led (&fwd[0], ON);
-
-					// loading has been done
-					current_midi_num = new_midi_num;
-				}
+
+			// get player of a song that has been cued but not started, or player prepared by the loader (NULL if file does not exist)
+			p = uncue (new_midi_num, &smf);
+			if (p == NULL) p = take_player (new_midi_num, &smf);
+			if (p != NULL) {
+				// delete current song engine, and use prepared one instead
+				// playback callback has already been assigned by the loader
+				delete_engine (player);
+				player = p;
+				// same for the event table of the song
+				smf_free (song_smf);
+				song_smf = smf;
+
+				// set endless looping of current file
+				//fluid_player_set_loop (player, -1);
+
+				// reset context of the song to default values
+				reset_song_context ();
+
+				// load a save of previous settings (sliders values, knobs...), if exists
+				// sections of the song (and channel state at each of them) are indexed at the same time
+				load_song (new_midi_num);
+
+				// we are at initial BPM, set leds accordingly
+				// this is useless as we cannot control the leds for now
+				led (&rwd[0], ON);
+				led (&fwd[0], ON);
+
+				// loading has been done
+				current_midi_num = new_midi_num;
 			}
 		}
 
 		if (new_sf2_num != current_sf2_num) {
-			// get name of requested SF2 file from directory
-			if (get_full_filename (name, new_sf2_num, "./soundfonts/") == TRUE) {
-				// if a file exists
-				if (fluid_is_soundfont(name)) {
-printf ("sf2:%s\n", name);
-					// unload previously loaded soundfont
-					// this is to prevent memory issues (lack of memory)
-					// however make sure we don't unload the only soundfont in memory
-					// in theory we should have at least 1 soundfont all the time in memory (default SF2)
-					if (fluid_synth_sfcount (synth) > 1) fluid_synth_sfunload (synth, sf2_id, TRUE);
-					// load new sf2 file
-					sf2_id = fluid_synth_sfload(synth, name, TRUE);
-
-					// loading has been done
-					current_sf2_num = new_sf2_num;
-				}
+
+			// select soundfont made resident in soundfont pool by the loader (-1 if file does not exist)
+			// previous soundfont is not unloaded, only hidden: it is evicted from the pool when memory budget is reached
+			id = take_sf2 (new_sf2_num);
+			if (id >= 0) {
+				sf2_id = id;
+
+				// loading has been done
+				current_sf2_num = new_sf2_num;
 			}
 		}
 	}
@@ -141,7 +104,7 @@ printf ("sf2:%s\n", name);
 uint64_t micros () {
 	
     struct timespec ts;
-    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
     uint64_t us = SEC_TO_US((uint64_t)ts.tv_sec) + NS_TO_US((uint64_t)ts.tv_nsec);
     return us;
 }
@@ -170,6 +133,7 @@ int save_song (int numfile) {
 	char s[20];
 
 	// open file
+	// songs of bank 00 keep 2-digit names; songs of other banks (bank * 256 + index) give 3 or 4 digits
 	sprintf (s, "./save/%02X", numfile);
 	if ((fp = fopen(s,"wt")) == NULL) return FALSE;
 	
@@ -203,8 +167,10 @@ int save_song (int numfile) {
 		}
 	}
 
-	// save markers
-	for (i = 0; i < NB_MARKER; i++) fprintf (fp, "marker %02d %d\n", i, marker [i]);
+	// save time markers set by the user; sections read from the midi file are not saved
+	for (i = 0, k = 0; i < sections.nb; i++) {
+		if (sections.section [i].user) fprintf (fp, "marker %02d %u\n", k++, sections.section [i].tick);
+	}
 
 	// close file
 	fclose(fp);
@@ -212,31 +178,93 @@ int save_song (int numfile) {
 }
 
 
-// Load the context of the song
-int load_song (int numfile) {
+// Read the context of the song into song structure, without applying it
+// returns FALSE if there is no saved context for this song (song->loaded is FALSE then)
+int read_song (int numfile, song_t *song) {
 
-	int i,j,k,cc;
+	int i,j,k,cc,mark;
+	uint32_t *m;
 	FILE *fp;
 	char s[20];
 
+	memset (song, 0, sizeof (song_t));
+	song->loaded = FALSE;
+
+	// polyphony and quality level advised by the load profile of the song, if it has been profiled
+	read_profile (numfile, &song->polyphony, &song->level);
+
 	// open file
+	// songs of bank 00 keep 2-digit names; songs of other banks (bank * 256 + index) give 3 or 4 digits
 	sprintf (s, "./save/%02X", numfile);
 	if ((fp = fopen(s,"rt")) == NULL) return FALSE;
 
 	// load volume
-	fscanf (fp, "vol %d\n", &volume);
-	// assign
-	if (volume <= 0) volume = 2;	// in case volume is 0, set to default (ie. 2)
-	if (volume >10) volume = 10;
+	fscanf (fp, "vol %d\n", &song->volume);
+	if (song->volume <= 0) song->volume = 2;	// in case volume is 0, set to default (ie. 2)
+	if (song->volume >10) song->volume = 10;
+
+	// load bpm
+	fscanf (fp, "bpm %d\n", &song->bpm);
+
+	// load sliders
+	for (j = 0; j < NB_RECSHIFT; j++) {
+		for (i = 0; i < NB_CHANNEL; i++) {
+
+			// load current CC slider value
+			fscanf (fp, "slider %02X %02X\n", &k, &cc);
+			song->slider [i][j] = cc;
+		}
+	}
+
+	// load knobs
+	for (j = 0; j < NB_RECSHIFT; j++) {
+		for (i = 0; i < NB_CHANNEL; i++) {
+
+			// load current CC knob value
+			fscanf (fp, "knob %02X %02X\n", &k, &cc);
+			song->knob [i][j] = cc;
+		}
+	}
+
+	// load time markers: there is no limit on their number
+	// markers are sorted when sections are built, so their index in the file is not used
+	while (fscanf (fp, "marker %d %d\n", &k, &mark) == 2) {
+		if (mark <= 0) continue;
+		if ((song->nb_mark % 16) == 0) {
+			if ((m = realloc (song->mark, (song->nb_mark + 16) * sizeof (uint32_t))) == NULL) break;
+			song->mark = m;
+		}
+		song->mark [song->nb_mark++] = mark;
+	}
+
+	// close file
+	fclose(fp);
+	song->loaded = TRUE;
+	return TRUE;
+}
+
+
+// Apply the context of the song read by read_song () to the current player and controls
+// nothing is applied if there is no saved context for the song; time markers are applied by build_sections ()
+void apply_song (song_t *song) {
+
+	int i,j;
+
+	// polyphony and quality level of the song are set up front by the governor (default ones if song has not been profiled)
+	set_governor_profile (song->polyphony, song->level);
+
+	if (song->loaded == FALSE) return;
+
+	// assign volume
+	volume = song->volume;
 	// set gain: 0 < gain < 1.0 (default = 0.2)
 	fluid_settings_setnum (settings, "synth.gain", (float) volume/10.0f);
 
-	// load bpm
-	fscanf (fp, "bpm %d\n", &bpm);
-	// assign
+	// assign bpm
+	bpm = song->bpm;
 	if (bpm !=0) {
-		initial_bpm = (fluid_player_get_bpm (player) == FLUID_FAILED) ? 0 : fluid_player_get_bpm (player);
-		fluid_player_set_tempo (player, FLUID_PLAYER_TEMPO_EXTERNAL_BPM, bpm);
+		initial_bpm = (engine_get_bpm (player) == FLUID_FAILED) ? 0 : engine_get_bpm (player);
+		engine_set_bpm (player, bpm);
 	}
 
 	// this part is useless as we cannot control the leds for now
@@ -258,41 +286,49 @@ int load_song (int numfile) {
 		}
 	}
 
-
-	// load sliders
+	// assign sliders and knobs
 	for (j = 0; j < NB_RECSHIFT; j++) {
 		for (i = 0; i < NB_CHANNEL; i++) {
-
-			// load current CC slider value
-			fscanf (fp, "slider %02X %02X\n", &k, &cc);
-			// assign
-			channel [i][j].slider.value = cc;
+			channel [i][j].slider.value = song->slider [i][j];
+			channel [i][j].knob.value = song->knob [i][j];
 		}
 	}
+}
 
-	// load knobs
-	for (j = 0; j < NB_RECSHIFT; j++) {
-		for (i = 0; i < NB_CHANNEL; i++) {
 
-			// load current CC knob value
-			fscanf (fp, "knob %02X %02X\n", &k, &cc);
-			// assign
-			channel [i][j].knob.value = cc;
-		}
-	}
+// Load the context of the song, and build index of its sections from its event table and saved time markers
+int load_song (int numfile) {
 
-	// load markers
-	for (i = 0; i < NB_MARKER; i++) {
-		// loading shall be done in 2 steps as we cannot read within 1 single fscanf
-		// both value of k and of an array object indexed on k
-		fscanf (fp, "marker %02d ", &k);
-		fscanf (fp, "%d\n", &marker [k]);
-	}
-	marker_pos = 0;		// reset marker_pos
+	song_t song;
+	int res;
 
-	// close file
-	fclose(fp);
-	return TRUE;
+	res = read_song (numfile, &song);
+	apply_song (&song);
+	build_sections (&sections, song_smf, &song);
+	free (song.mark);
+	return res;
+}
+
+
+// Reset the context of a newly loaded song: bpm, beat, markers, sliders and knobs to default values
+void reset_song_context () {
+
+	// initial bpm of the file is set to -1 to force reading of initial bpm if bpm pads are pressed
+	initial_bpm = -1;
+	bpm = 0	;			// bpm is only set when file is playing
+	now = 0;			// used for automated tempo adjustment (at press of switch)
+	previous = 0;
+
+	// clear index of sections (memory is kept for next song), and loop
+	sections.nb = 0;
+	clear_loop ();
+
+	// set default values for sliders and song volume: all values to max
+	set_slider_value (0x64);
+	set_volume_value (0x7F);		// useless as it is done before play... but let's do it anyway
+	// set default values for knobs and song panning: all values to middle
+	set_knob_value (0x40);
+	set_panning_value (0x40);		// useless as it is done before play... but let's do it anyway
 }
 
 
@@ -303,8 +339,9 @@ int set_slider_value (uint8_t val) {
 	
 	for (j = 0; j < NB_RECSHIFT; j++) {
 		for (i = 0; i < NB_CHANNEL; i++) {
-			// slider values to "val"
+			// slider values to "val", applied to the song right away
 			channel [i][j].slider.value = val;
+			channel [i][j].slider.value_applied = val;
 		}
 	}
 }
@@ -325,22 +362,18 @@ int set_volume_value (uint8_t val) {
 
 
 // send CC7 to reset song volume, according to real-time channel volume and sliders positions
-// this basically consists in sending a CC7 for each channel; callback will intercept this CC7 and adjust volume according to slider position
+// this basically consists in sending a CC7 for each channel; all of them are sent in one batch at next audio period
 int reset_song_volume () {
 
 	int i,j,k;
-	uint8_t vol;
 	
 	for (j = 0; j < NB_RECSHIFT; j++) {
 		for (i = 0; i < NB_CHANNEL; i++) {
 			// k is the channel number
 			k = i + (j * 8);
 
-			// ponderate real-time volume value according to slider position
-			vol = adjust_volume (channel [i][j].slider.value, channel [i][j].slider.value_rt);
-
-			// send CC7 with current ponderated volume for the channel
-			fluid_synth_cc (synth, k, 7, vol);
+			// send CC7 with current ponderated volume for the channel, at next audio period (see mixer.c)
+			post_volume (k);
 		}
 	}
 }
@@ -375,22 +408,18 @@ int set_panning_value (uint8_t val) {
 
 
 // send CC10 to reset song panning, according to real-time channel panning and knobs positions
-// this basically consists in sending a CC10 for each channel; callback will intercept this CC10 and adjust panning according to knob position
+// this basically consists in sending a CC10 for each channel; all of them are sent in one batch at next audio period
 int reset_song_panning () {
 
 	int i,j,k;
-	uint8_t pan;
 	
 	for (j = 0; j < NB_RECSHIFT; j++) {
 		for (i = 0; i < NB_CHANNEL; i++) {
 			// k is the channel number
 			k = i + (j * 8);
 
-			// ponderate real-time panning value according to knob position
-			pan = adjust_panning (channel [i][j].knob.value, channel [i][j].knob.value_rt);
-
-			// send CC10 with current ponderated panning for the channel
-			fluid_synth_cc (synth, k, 10, pan);
+			// send CC10 with current ponderated panning for the channel, at next audio period (see mixer.c)
+			post_panning (k);
 		}
 	}
 }
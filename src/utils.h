@@ -4,12 +4,15 @@
  *
  */
 
-int get_full_filename (char *, unsigned char, char *);
+int get_full_filename (char *, int, char *);
 int load_midi_sf2 ();
 uint64_t micros ();
 void led (button_t *, int);
 int save_song (int);
+int read_song (int, song_t *);
+void apply_song (song_t *);
 int load_song (int);
+void reset_song_context ();
 int set_slider_value (uint8_t);
 int set_volume_value (uint8_t);
 int reset_song_volume ();